@@ -0,0 +1,82 @@
+#!/bin/bash
+set -eu -o pipefail
+
+# round trip of the conversion daemon (example-11) and its client (example-12)
+# on a temporary socket: remux/transcode/probe replies and outputs, then a
+# "deadline exceeded" and a "busy" reply. needs jq.
+#
+# usage:
+#   bash misc/daemon-roundtrip.sh build/native/Debug misc/test.webm
+
+bin_dir="$1"
+in_file="$2"
+
+tmp_dir=$(mktemp -d)
+pids=()
+cleanup() {
+  for pid in "${pids[@]}"; do
+    kill "$pid" 2> /dev/null || true
+  done
+  rm -rf "$tmp_dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# example-12 exits with 1 on an "ok": false reply, so keep the reply either way
+client() {
+  "$bin_dir/example-12" --socket "$socket" "$@" || true
+}
+
+daemon() {
+  "$bin_dir/example-11" --socket "$socket" "$@" &
+  pids+=($!)
+  for _ in $(seq 50); do
+    [ -S "$socket" ] && return
+    sleep 0.1
+  done
+  fail "daemon didn't listen on $socket"
+}
+
+socket="$tmp_dir/conversion.sock"
+daemon --workers 2
+
+# remux
+reply=$(client --job remux --in "$in_file" --out "$tmp_dir/remux.opus")
+echo "$reply" | jq -e '.ok' > /dev/null || fail "remux: $reply"
+size=$(stat -c %s "$tmp_dir/remux.opus")
+echo "$reply" | jq -e --argjson size "$size" '.data.bytes == $size and $size > 0' > /dev/null || fail "remux size: $reply"
+[ "$(head -c 4 "$tmp_dir/remux.opus")" = "OggS" ] || fail "remux output isn't ogg"
+
+# transcode
+reply=$(client --job transcode --in "$in_file" --out "$tmp_dir/transcode.opus" --bit-rate 64000)
+echo "$reply" | jq -e '.ok and .data.bytes > 0' > /dev/null || fail "transcode: $reply"
+[ "$(head -c 4 "$tmp_dir/transcode.opus")" = "OggS" ] || fail "transcode output isn't ogg"
+
+# probe
+reply=$(client --job probe --in "$in_file")
+echo "$reply" | jq -e '.ok and (.data.streams | map(.type) | index("audio") != null)' > /dev/null || fail "probe: $reply"
+
+# deadline (stopped at a packet poll well before the end of the input)
+reply=$(client --job remux --in "$in_file" --out "$tmp_dir/deadline.opus" --deadline-ms 0.001)
+echo "$reply" | jq -e '(.ok | not) and .data == "deadline exceeded" and .control.stopped == "deadline exceeded"' > /dev/null || fail "deadline: $reply"
+
+# busy: single worker and queue slot, and a budget (1MB) smaller than any job.
+# a probe of a fifo nobody writes to blocks the worker, a second one waits
+# for the budget in the queue slot, so a third is rejected.
+socket="$tmp_dir/busy.sock"
+daemon --workers 1 --queue 1 --memory-budget 1
+mkfifo "$tmp_dir/fifo"
+exec 3<> "$tmp_dir/fifo"  # writer end (held open until exit)
+for _ in 1 2; do
+  "$bin_dir/example-12" --socket "$socket" --job probe --in "$tmp_dir/fifo" > /dev/null &
+  pids+=($!)
+  sleep 0.5
+done
+reply=$(client --job probe --in "$in_file")
+echo "$reply" | jq -e '(.ok | not) and .data == "busy"' > /dev/null || fail "busy: $reply"
+
+echo "OK"
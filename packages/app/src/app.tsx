@@ -10,8 +10,8 @@ import { getWorker } from "./worker-client";
 import { useForm } from "react-hook-form";
 import { tinyassert } from "./utils/tinyassert";
 import toast, { Toaster } from "react-hot-toast";
-import type { WorkerImpl } from "./worker-impl";
-import type { Remote } from "comlink";
+import type { ConvertProgress, WorkerImpl } from "./worker-impl";
+import { proxy, Remote } from "comlink";
 import TEST_WEBM_URL from "../../../misc/test.webm?url";
 import TEST_JPG_URL from "../../../misc/test.jpg?url";
 import { GitHub } from "react-feather";
@@ -56,21 +56,34 @@ interface FormType {
 
 function AppImpl() {
   const workerQuery = useWorker();
+  const [progress, setProgress] = React.useState<ConvertProgress>();
+  const [abort, setAbort] = React.useState<Int32Array>();
 
   const processFileMutation = useMutation(
     async (data: FormType) => {
       tinyassert(workerQuery.isSuccess);
-      return processFile(workerQuery.data, data);
+      const flag = createAbortFlag();
+      setAbort(flag);
+      setProgress(undefined);
+      return processFile(workerQuery.data, data, {
+        abort: flag,
+        onProgress: setProgress,
+      });
     },
     {
       onSuccess: () => {
         toast.success("successfully created an opus file");
       },
-      onError: () => {
-        toast.error("failed to create an opus file", {
+      onError: (e) => {
+        // e.g. "cancelled", "deadline exceeded"
+        const reason = e instanceof Error ? ` (${e.message})` : "";
+        toast.error("failed to create an opus file" + reason, {
           id: "processFileMutation:onError",
         });
       },
+      onSettled: () => {
+        setAbort(undefined);
+      },
     }
   );
 
@@ -83,6 +96,11 @@ function AppImpl() {
   });
   const { audioFile } = form.watch();
 
+  const percent =
+    processFileMutation.isLoading && progress && progress.totalBytes > 0
+      ? ` (${Math.floor((100 * progress.bytes) / progress.totalBytes)}%)`
+      : "";
+
   return (
     <div className="h-full flex flex-col items-center bg-gray-50">
       <div className="w-2xl max-w-full flex flex-col gap-4 p-4">
@@ -150,12 +168,30 @@ function AppImpl() {
           })}
         >
           <div className="flex justify-center items-center relative">
-            <span>Create Opus File</span>
+            <span>Create Opus File{percent}</span>
             {processFileMutation.isLoading && (
               <div className="absolute right-2 w-5 h-5 spinner"></div>
             )}
           </div>
         </button>
+        {processFileMutation.isLoading && (
+          <button
+            className="p-1 border bg-gray-300 filter transition duration-200 hover:brightness-95 disabled:(pointer-events-none text-gray-500 bg-gray-200)"
+            disabled={!abort}
+            title={
+              abort
+                ? undefined
+                : "needs cross-origin isolation (SharedArrayBuffer)"
+            }
+            onClick={() => {
+              if (abort) {
+                Atomics.store(abort, 0, 1);
+              }
+            }}
+          >
+            Cancel
+          </button>
+        )}
         <a
           className="p-1 border bg-gray-300 filter transition duration-200 hover:brightness-95 aria-disabled:(pointer-events-none text-gray-500 bg-gray-200) text-center cursor"
           aria-disabled={!processFileMutation.isSuccess}
@@ -189,9 +225,26 @@ function useWorker() {
   });
 }
 
+// stop a conversion which takes unreasonably long (e.g. huge input)
+const CONVERT_DEADLINE_MS = 60_000;
+const CONVERT_PROGRESS_MS = 100;
+
+// flag which the worker sees while it's busy in wasm (undefined without
+// cross-origin isolation, i.e. can't cancel)
+function createAbortFlag(): Int32Array | undefined {
+  if (typeof SharedArrayBuffer === "undefined" || !crossOriginIsolated) {
+    return undefined;
+  }
+  return new Int32Array(new SharedArrayBuffer(4));
+}
+
 async function processFile(
   remoteWorker: Remote<WorkerImpl>,
-  data: FormType
+  data: FormType,
+  control: {
+    abort: Int32Array | undefined;
+    onProgress: (progress: ConvertProgress) => void;
+  }
 ): Promise<{ url: string; name: string }> {
   const audio = data.audioFile?.[0];
   tinyassert(audio);
@@ -200,16 +253,22 @@ async function processFile(
   const image = data.imageFile?.[0];
   const imageData = image && new Uint8Array(await image.arrayBuffer());
 
-  const output = await remoteWorker.convert({
-    data: audioData,
-    outFormat: "opus",
-    picture: imageData,
-    metadata: {
-      title: data.title,
-      artist: data.artist,
-      album: data.album,
+  const output = await remoteWorker.convertWithControl(
+    {
+      data: audioData,
+      outFormat: "opus",
+      picture: imageData,
+      metadata: {
+        title: data.title,
+        artist: data.artist,
+        album: data.album,
+      },
+      deadlineMs: CONVERT_DEADLINE_MS,
+      progressMs: CONVERT_PROGRESS_MS,
+      abort: control.abort,
     },
-  });
+    proxy(control.onProgress)
+  );
   // TODO: URL.revokeObjectURL
   const url = URL.createObjectURL(new Blob([output]));
   const name =
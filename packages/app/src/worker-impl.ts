@@ -4,38 +4,107 @@ import type { ModuleExports } from "@hiogawa/ffmpeg-experiment";
 import WASM_URL from "@hiogawa/ffmpeg-experiment/build/index.wasm?url";
 
 // for comlink typing
-export type { WorkerImpl };
+export type { WorkerImpl, ConvertProgress };
 
 let Module: ModuleExports;
 
+interface ConvertArg {
+  data: Uint8Array;
+  outFormat: string;
+  metadata: Record<string, string>;
+  picture?: Uint8Array;
+}
+
+interface ConvertProgress {
+  bytes: number;
+  totalBytes: number;
+  seconds: number;
+}
+
 class WorkerImpl {
   async initialize() {
     Module = await init({ locateFile: () => WASM_URL });
   }
 
-  convert(arg: {
+  convert(arg: ConvertArg): Uint8Array {
+    const output = Module.convert(
+      createVector(arg.data),
+      arg.outFormat,
+      createMetadata(arg)
+    ).view();
+    checkLastError(output);
+    return output;
+  }
+
+  // `convert` stopped after `deadlineMs` or once `abort[0]` is set to 1.
+  // this worker is inside wasm for the whole call and doesn't get to handle
+  // another comlink call, so the main thread sets `abort` (Int32Array on a
+  // SharedArrayBuffer) and it's checked at every progress callback.
+  // (`onProgress` is a separate argument as comlink only proxies those)
+  convertWithControl(
+    arg: ConvertArg & {
+      deadlineMs: number;
+      progressMs: number;
+      abort?: Int32Array;
+    },
+    onProgress?: (progress: ConvertProgress) => void
+  ): Uint8Array {
+    const { abort } = arg;
+    const output = Module.convertWithControl(
+      createVector(arg.data),
+      arg.outFormat,
+      createMetadata(arg),
+      arg.deadlineMs,
+      arg.progressMs,
+      (bytes, totalBytes, seconds) => {
+        // comlink proxy call is posted right away without waiting for reply
+        onProgress?.({ bytes, totalBytes, seconds });
+        return !(abort && Atomics.load(abort, 0));
+      }
+    ).view();
+    checkLastError(output);
+    return output;
+  }
+
+  // cf. `computePeaks` in @hiogawa/ffmpeg-experiment for the binary format
+  computePeaks(arg: { data: Uint8Array }): Uint8Array {
+    return Module.computePeaks(createVector(arg.data)).view();
+  }
+
+  computeSpectrogram(arg: {
     data: Uint8Array;
-    outFormat: string;
-    metadata: Record<string, string>;
-    picture?: Uint8Array;
+    hop: number;
+    bins: number;
   }): Uint8Array {
-    const stringMap = new Module.StringMap();
-    if (arg.metadata) {
-      for (const [k, v] of Object.entries(arg.metadata)) {
-        stringMap.set(k, v);
-      }
-    }
-    if (arg.picture) {
-      const encoded = Module.encodePictureMetadata(createVector(arg.picture));
-      stringMap.set("METADATA_BLOCK_PICTURE", encoded);
+    return Module.computeSpectrogram(
+      createVector(arg.data),
+      arg.hop,
+      arg.bins
+    ).view();
+  }
+}
+
+function createMetadata(arg: ConvertArg) {
+  const stringMap = new Module.StringMap();
+  if (arg.metadata) {
+    for (const [k, v] of Object.entries(arg.metadata)) {
+      stringMap.set(k, v);
     }
+  }
+  if (arg.picture) {
+    const encoded = Module.encodePictureMetadata(createVector(arg.picture));
+    stringMap.set("METADATA_BLOCK_PICTURE", encoded);
+  }
+  return stringMap;
+}
 
-    const output = Module.convert(
-      createVector(arg.data),
-      arg.outFormat,
-      stringMap
-    );
-    return output.view();
+// `convert` returns empty output on error instead of throwing
+function checkLastError(output: Uint8Array) {
+  if (output.length === 0) {
+    const error = Module.getLastError();
+    if (error) {
+      throw new Error(error);
+    }
   }
 }
 
@@ -8,6 +8,14 @@ export default defineConfig({
   optimizeDeps: {
     include: ["@hiogawa/ffmpeg-experiment"],
   },
+  server: {
+    // cross-origin isolation for SharedArrayBuffer (abort flag of a running
+    // conversion, cf. worker-impl.ts)
+    headers: {
+      "Cross-Origin-Opener-Policy": "same-origin",
+      "Cross-Origin-Embedder-Policy": "require-corp",
+    },
+  },
   worker: {
     // workaround for iife worker bug with `?url` https://github.com/vitejs/vite/issues/9879
     format: "es",
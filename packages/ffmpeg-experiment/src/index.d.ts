@@ -3,19 +3,89 @@ class Vector {
   view(): Uint8Array;
 }
 
+class VectorList {
+  push_back(v: Vector): void;
+  size(): number;
+  get(i: number): Vector;
+}
+
 class StringMap {
   set(k: string, v: string): void;
 }
 
+// empty on error (message from `getLastError`)
 const convert: (
   inData: Vector,
   outFormat: string,
   metadata: StringMap
 ) => Vector;
 
+// `convert` stopped after `deadlineMs` (none unless positive) or when
+// `onProgress` returns false, which is called at most every `progressMs`
+// (null for none). error is "cancelled" or "deadline exceeded" (cf.
+// `getLastError`)
+const convertWithControl: (
+  inData: Vector,
+  outFormat: string,
+  metadata: StringMap,
+  deadlineMs: number,
+  progressMs: number,
+  onProgress:
+    | ((bytes: number, totalBytes: number, seconds: number) => boolean | void)
+    | null
+) => Vector;
+
+// trim/concat opus by stream copy (seconds, negative `end` for until the end)
+const editOpus: (
+  inDataList: VectorList,
+  start: number,
+  end: number,
+  metadata: StringMap
+) => Vector;
+
+// split opus into chapters by stream copy
+// chaptersJson: [{ start: number, end?: number, metadata?: {...} }] (seconds)
+// or "" for chapters of the input
+const splitOpus: (
+  inData: Vector,
+  chaptersJson: string,
+  metadata: StringMap
+) => VectorList;
+
+// waveform peaks of 256/1024/4096 samples per bin (min/max/rms as int16)
+// "WFPK" u8 version, u8 bits, u16 reserved, u32 sampleRate, u32 numLevels,
+// (u32 samplesPerBin, u32 numBins) * numLevels, then (i16 min, i16 max,
+// i16 rms) per bin level by level (little endian)
+const computePeaks: (inData: Vector) => Vector;
+
+// mel spectrogram (fft size 2048) as u8 per bin (0 for -90 dBFS, 255 for 0)
+// "SPEC" u8 version, u8 reserved, u16 numBins, u32 sampleRate, u32 fftSize,
+// u32 hop, u32 numColumns, then numColumns * numBins bytes column by column
+// (low to high frequency) (little endian)
+const computeSpectrogram: (inData: Vector, hop: number, bins: number) => Vector;
+
 const encodePictureMetadata: (inData: Vector) => string;
 
-const moduleExports = { Vector, StringMap, convert, encodePictureMetadata };
+// JSON report of timers and counters of the last `convert` call
+const getLastStats: () => string;
+
+// error of the last `convert` call ("" on success)
+const getLastError: () => string;
+
+const moduleExports = {
+  Vector,
+  VectorList,
+  StringMap,
+  convert,
+  convertWithControl,
+  editOpus,
+  splitOpus,
+  computePeaks,
+  computeSpectrogram,
+  encodePictureMetadata,
+  getLastStats,
+  getLastError,
+};
 
 export type ModuleExports = typeof moduleExports;
 
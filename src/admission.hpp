@@ -0,0 +1,214 @@
+#pragma once
+
+// memory budgeted admission of concurrent jobs (cf. example-11)
+//
+// - a job's peak memory is estimated from the input size and the operation.
+//   buffered I/O (BufferInput/BufferOutput) holds the whole input and output,
+//   streaming I/O (FdInput/FdOutput) only holds AVIO buffers and codec state.
+// - a job is estimated when its request arrives, and runs buffered when its
+//   estimate fits in what's left of the budget at arrival, otherwise it's
+//   switched to streaming instead of rejected.
+// - waiting jobs sit in a priority queue keyed by reservation, smallest
+//   first (cuts tail latency of small jobs stuck behind huge ones), aged by
+//   arrival: the key is bytes + aging * arrival seconds, so that having
+//   waited `n / aging` seconds longer counts as being `n` bytes smaller and a
+//   stream of small jobs can't starve a large one. the key doesn't change
+//   while waiting, hence a plain ordered map.
+// - only the first waiting job is admitted (nothing overtakes it once it's
+//   first), when it fits in the budget and a worker asks for a job. a job
+//   larger than the whole budget still runs alone so that nothing waits
+//   forever.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <utility>
+#include "utils.hpp"
+
+namespace admission {
+
+enum class Operation { probe, remux, transcode };
+
+inline Operation parseOperation(const std::string& s) {
+  if (s == "probe") {
+    return Operation::probe;
+  }
+  if (s == "remux") {
+    return Operation::remux;
+  }
+  ASSERT(s == "transcode");
+  return Operation::transcode;
+}
+
+// rough upper bounds of what isn't proportional to the input
+constexpr int64_t IO_OVERHEAD = 1 << 20;       // avio buffers, packets
+constexpr int64_t CODEC_OVERHEAD = 8 << 20;    // decoder + encoder state
+constexpr int64_t DEMUXER_OVERHEAD = 4 << 20;  // probe and index
+
+struct Estimate {
+  int64_t buffered;   // whole input and output in memory
+  int64_t streaming;  // I/O through file descriptors
+};
+
+// output is at most the input for stream copy, and assumed so for transcode
+// (opus output is mostly smaller than the input). probe always streams.
+inline Estimate estimate(Operation operation, int64_t input_size) {
+  int64_t base = IO_OVERHEAD + DEMUXER_OVERHEAD;
+  switch (operation) {
+    case Operation::probe:
+      return {base, base};
+    case Operation::remux:
+      return {base + 2 * input_size, base};
+    case Operation::transcode:
+      return {base + CODEC_OVERHEAD + 2 * input_size, base + CODEC_OVERHEAD};
+  }
+  return {base, base};
+}
+
+// bytes per second of waiting (cf. the aging of waiting jobs above)
+constexpr double DEFAULT_AGING = 64 << 20;
+
+struct Budget;
+
+// reservation released on destruction (none until admitted)
+struct Ticket {
+  Budget* budget_ = nullptr;
+  int64_t bytes_ = 0;
+  bool streaming_ = false;
+  double wait_ms_ = 0;
+
+  Ticket() = default;
+  Ticket(Ticket&& other) { *this = std::move(other); }
+  Ticket& operator=(Ticket&& other) {
+    std::swap(budget_, other.budget_);
+    std::swap(bytes_, other.bytes_);
+    std::swap(streaming_, other.streaming_);
+    std::swap(wait_ms_, other.wait_ms_);
+    return *this;
+  }
+  inline ~Ticket();
+
+  nlohmann::json toJson() const {
+    return {{"mode", streaming_ ? "streaming" : "buffered"},
+            {"reserved_bytes", bytes_},
+            {"wait_ms", wait_ms_}};
+  }
+};
+
+// reservations of running jobs
+struct Budget {
+  const int64_t budget_;  // bytes (0 for unlimited)
+  int64_t used_ = 0;
+  std::mutex mutex_;
+  std::condition_variable changed_;  // released or queued
+
+  // totals
+  int64_t peak_ = 0;
+  int64_t buffered_jobs_ = 0;
+  int64_t streaming_jobs_ = 0;
+
+  Budget(int64_t budget) : budget_{budget} {}
+
+  // with `mutex_` held
+  bool fits(int64_t bytes) const {
+    return budget_ <= 0 || used_ == 0 || used_ + bytes <= budget_;
+  }
+
+  void release(int64_t bytes) {
+    {
+      std::lock_guard lock{mutex_};
+      used_ -= bytes;
+    }
+    changed_.notify_all();
+  }
+};
+
+// waiting jobs of item `T` (e.g. connection with its request)
+template <class T>
+struct Scheduler : Budget {
+  using Clock = std::chrono::steady_clock;
+  using Key = std::pair<double, uint64_t>;  // (aged bytes, arrival)
+
+  struct Waiting {
+    T item;
+    Ticket ticket;
+    Clock::time_point arrival;
+  };
+
+  const size_t capacity_;  // waiting jobs
+  const double aging_;     // bytes per second
+  const Clock::time_point start_ = Clock::now();
+  uint64_t sequence_ = 0;
+  std::map<Key, Waiting> waiting_;
+
+  Scheduler(int64_t budget, size_t capacity, double aging = DEFAULT_AGING)
+      : Budget{budget}, capacity_{capacity}, aging_{aging} {}
+
+  // on arrival. false instead of queueing when `capacity_` jobs are waiting
+  // (e.g. reject as busy), `item` is only moved from when queued
+  bool tryPush(const Estimate& estimate, T&& item) {
+    {
+      std::lock_guard lock{mutex_};
+      if (waiting_.size() >= capacity_) {
+        return false;
+      }
+      Ticket ticket;
+      ticket.streaming_ = budget_ > 0 && used_ + estimate.buffered > budget_;
+      ticket.bytes_ =
+          ticket.streaming_ ? estimate.streaming : estimate.buffered;
+      auto now = Clock::now();
+      double seconds = std::chrono::duration<double>(now - start_).count();
+      Key key{ticket.bytes_ + aging_ * seconds, sequence_++};
+      waiting_.emplace(key, Waiting{std::move(item), std::move(ticket), now});
+    }
+    changed_.notify_all();
+    return true;
+  }
+
+  // by a free worker. blocks until the first waiting job fits
+  std::pair<T, Ticket> pop() {
+    std::unique_lock lock{mutex_};
+    changed_.wait(lock, [&]() {
+      return !waiting_.empty() && fits(waiting_.begin()->second.ticket.bytes_);
+    });
+    auto node = waiting_.extract(waiting_.begin());
+    Waiting& waiting = node.mapped();
+    Ticket ticket = std::move(waiting.ticket);
+    ticket.budget_ = this;
+    used_ += ticket.bytes_;
+    peak_ = std::max(peak_, used_);
+    (ticket.streaming_ ? streaming_jobs_ : buffered_jobs_)++;
+    lock.unlock();
+
+    // next one might fit as well
+    changed_.notify_all();
+    auto elapsed = Clock::now() - waiting.arrival;
+    ticket.wait_ms_ =
+        std::chrono::duration<double, std::milli>(elapsed).count();
+    return {std::move(waiting.item), std::move(ticket)};
+  }
+
+  nlohmann::json toJson() {
+    std::lock_guard lock{mutex_};
+    return {{"budget_bytes", budget_},
+            {"used_bytes", used_},
+            {"peak_bytes", peak_},
+            {"waiting", waiting_.size()},
+            {"aging_bytes_per_s", aging_},
+            {"buffered_jobs", buffered_jobs_},
+            {"streaming_jobs", streaming_jobs_}};
+  }
+};
+
+Ticket::~Ticket() {
+  if (budget_) {
+    budget_->release(bytes_);
+  }
+}
+
+}  // namespace admission
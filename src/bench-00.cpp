@@ -0,0 +1,592 @@
+// benchmark suite on synthetic inputs
+//   probe latency, remux/decode throughput, AVIO read/write throughput
+
+#include <cstring>
+#include <functional>
+#include <random>
+#include "fingerprint.hpp"
+#include "loudness.hpp"
+#include "matroska-reader.hpp"
+#include "spectrogram.hpp"
+#include "ogg-opus-writer.hpp"
+#include "pipeline.hpp"
+#include "synthetic-media.hpp"
+#include "utils-bench.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils-log.hpp"
+#include "utils-pool.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+//
+// input AVFormatContext (cf. emscripten-01 `convert`)
+//
+
+struct Input {
+  BufferInput input_;
+  AVFormatContext* ifmt_ctx_;
+
+  Input(const std::vector<uint8_t>& data) : input_{data} {
+    ifmt_ctx_ = avformat_alloc_context();
+    ASSERT(ifmt_ctx_);
+    ifmt_ctx_->pb = input_.avio_ctx_;
+    ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+  }
+
+  ~Input() { avformat_close_input(&ifmt_ctx_); }
+
+  int audioStream() {
+    auto stream_index =
+        av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index);
+    return stream_index;
+  }
+};
+
+//
+// benchmarked operations
+//
+
+double probe(const std::vector<uint8_t>& data) {
+  Input input{data};
+  return static_cast<double>(input.ifmt_ctx_->duration) / AV_TIME_BASE;
+}
+
+// webm/ogg -> ogg without transcoding (cf. example-03)
+size_t remux(const std::vector<uint8_t>& data) {
+  Input input{data};
+  auto stream_index = input.audioStream();
+  AVStream* in_stream = input.ifmt_ctx_->streams[stream_index];
+
+  BufferOutput output;
+  AVFormatContext* ofmt_ctx = nullptr;
+  avformat_alloc_output_context2(&ofmt_ctx, NULL, "opus", NULL);
+  ASSERT(ofmt_ctx);
+  DEFER {
+    avformat_free_context(ofmt_ctx);
+  };
+  ofmt_ctx->pb = output.avio_ctx_;
+  ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  AVStream* out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+  ASSERT(out_stream);
+  ASSERT_AV(avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar));
+  out_stream->time_base = in_stream->time_base;
+
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+
+  ASSERT_AV(avformat_write_header(ofmt_ctx, nullptr));
+  while (av_read_frame(input.ifmt_ctx_, pkt) >= 0) {
+    if (pkt->stream_index == stream_index) {
+      pkt->stream_index = out_stream->index;
+      av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
+      ASSERT_AV(av_interleaved_write_frame(ofmt_ctx, pkt));
+    }
+    av_packet_unref(pkt);
+  }
+  ASSERT_AV(av_interleaved_write_frame(ofmt_ctx, nullptr));
+  ASSERT_AV(av_write_trailer(ofmt_ctx));
+  return output.output_.size();
+}
+
+// same as `remux` but with ogg_opus::Writer instead of libavformat muxer
+size_t remuxOggWriter(const std::vector<uint8_t>& data) {
+  Input input{data};
+  auto stream_index = input.audioStream();
+  ASSERT(ogg_opus::canCopy(input.ifmt_ctx_->streams[stream_index]));
+  std::vector<uint8_t> output;
+  ogg_opus::copy(input.ifmt_ctx_, stream_index, {}, output);
+  return output.size();
+}
+
+// same as `remuxOggWriter` but with matroska::Reader instead of libavformat
+// demuxer (webm only)
+size_t remuxMatroskaReader(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> output;
+  ASSERT(matroska::copyToOggOpus(data.data(), data.size(), {}, output));
+  return output.size();
+}
+
+// decode all samples (cf. example-02) and optionally feed them to
+// loudness::FrameMeter, spectrogram::Builder or fingerprint::Builder. frames
+// come from `arena` if given, otherwise from the default allocator.
+enum class Analysis { none, loudness, spectrogram, fingerprint };
+
+int64_t decode(const std::vector<uint8_t>& data,
+               Analysis analysis = Analysis::none,
+               utils::BufferArena* arena = nullptr) {
+  Input input{data};
+  auto stream_index = input.audioStream();
+  AVStream* stream = input.ifmt_ctx_->streams[stream_index];
+
+  const AVCodec* dec = avcodec_find_decoder(stream->codecpar->codec_id);
+  ASSERT(dec);
+  AVCodecContext* dec_ctx = utils::allocCodecContext(dec);
+  DEFER {
+    avcodec_free_context(&dec_ctx);
+  };
+  ASSERT_AV(avcodec_parameters_to_context(dec_ctx, stream->codecpar));
+  if (arena) {
+    arena->attach(dec_ctx);
+  }
+  ASSERT_AV(avcodec_open2(dec_ctx, dec, NULL));
+
+  AVFrame* frame = utils::allocFrame();
+  DEFER {
+    av_frame_free(&frame);
+  };
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+
+  std::optional<loudness::FrameMeter> meter;
+  std::optional<spectrogram::Builder> spectrogram;
+  if (analysis == Analysis::loudness) {
+    meter.emplace();
+  }
+  if (analysis == Analysis::spectrogram) {
+    spectrogram.emplace(spectrogram::Options{});
+  }
+  std::optional<fingerprint::Builder> fingerprinter;
+  if (analysis == Analysis::fingerprint) {
+    fingerprinter.emplace();
+  }
+
+  int64_t nb_samples = 0;
+  auto receiveFrames = [&]() {
+    while (true) {
+      auto ret = avcodec_receive_frame(dec_ctx, frame);
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      nb_samples += frame->nb_samples;
+      if (meter) {
+        meter->addFrame(frame);
+      }
+      if (spectrogram) {
+        spectrogram->addFrame(frame);
+      }
+      if (fingerprinter) {
+        fingerprinter->addFrame(frame);
+      }
+      av_frame_unref(frame);
+    }
+  };
+  while (av_read_frame(input.ifmt_ctx_, pkt) >= 0) {
+    if (pkt->stream_index == stream_index) {
+      ASSERT_AV(avcodec_send_packet(dec_ctx, pkt));
+      receiveFrames();
+    }
+    av_packet_unref(pkt);
+  }
+  ASSERT_AV(avcodec_send_packet(dec_ctx, nullptr));
+  receiveFrames();
+  if (meter) {
+    meter->result();
+  }
+  if (spectrogram) {
+    spectrogram->finish();
+  }
+  if (fingerprinter) {
+    fingerprinter->finish();
+  }
+  return nb_samples;
+}
+
+// index of `size` random fingerprints plus the given one
+fingerprint::Index makeIndex(const std::vector<uint32_t>& hashes,
+                             int size,
+                             uint32_t seed) {
+  fingerprint::Index index;
+  std::mt19937 rng{seed};
+  std::vector<uint32_t> random(index.options_.prefix);
+  for (int i = 0; i < size; i++) {
+    for (auto& hash : random) {
+      hash = rng();
+    }
+    index.add(random);
+  }
+  index.add(hashes);
+  index.build();
+  return index;
+}
+
+constexpr int AVIO_CHUNK_SIZE = 1 << 16;
+
+// BufferInput through avio_read
+size_t avioRead(const std::vector<uint8_t>& data) {
+  BufferInput input{data};
+  std::vector<uint8_t> chunk(AVIO_CHUNK_SIZE);
+  size_t total = 0;
+  while (true) {
+    auto ret = avio_read(input.avio_ctx_, chunk.data(), chunk.size());
+    if (ret == AVERROR_EOF || ret == 0) {
+      break;
+    }
+    ASSERT_AV(ret);
+    total += ret;
+  }
+  ASSERT(total == data.size());
+  return total;
+}
+
+// BufferOutput through avio_write
+size_t avioWrite(const std::vector<uint8_t>& data) {
+  BufferOutput output;
+  for (size_t pos = 0; pos < data.size(); pos += AVIO_CHUNK_SIZE) {
+    auto size = std::min<size_t>(AVIO_CHUNK_SIZE, data.size() - pos);
+    avio_write(output.avio_ctx_, &data[pos], size);
+  }
+  avio_flush(output.avio_ctx_);
+  ASSERT(output.output_.size() == data.size());
+  return output.output_.size();
+}
+
+// per job setup of a decode (decoder, frame, packet) repeated `jobs` times,
+// either allocated fresh or recycled through utils::ContextPool (cf.
+// example-11 worker)
+constexpr int SETUP_JOBS = 100;
+
+int64_t jobSetupFresh(const AVCodecParameters* par, int jobs) {
+  int64_t total = 0;
+  for (int i = 0; i < jobs; i++) {
+    auto dec_ctx = utils::makeDecoder(par);
+    auto frame = utils::makeFrame();
+    auto pkt = utils::makePacket();
+    total += dec_ctx->sample_rate;
+  }
+  return total;
+}
+
+int64_t jobSetupPooled(utils::ContextPool& pool,
+                       const AVCodecParameters* par,
+                       int jobs) {
+  int64_t total = 0;
+  for (int i = 0; i < jobs; i++) {
+    auto dec_ctx = pool.decoder(par);
+    auto frame = pool.frame();
+    auto pkt = pool.packet();
+    total += dec_ctx->sample_rate;
+  }
+  return total;
+}
+
+// per packet path of the copy loop (cf. example-03 `runCopy`), statically
+// composed (pipeline.hpp) vs runtime polymorphic stages. packets are demuxed
+// up front and replayed `PIPELINE_REPLAYS` times into a counting sink, so
+// only the chain itself is measured. output keeps the input stream and time
+// base so that replays see the same packets. both chains skip the identity
+// rescale (at compile time vs by av_cmp_q at runtime), so
+// "pipeline_static"/"pipeline_dynamic" is the dispatch cost alone, and
+// "pipeline_static_rescale" (rescale kept) vs "pipeline_static" what
+// skipping the rescale saves.
+constexpr int PIPELINE_REPLAYS = 100;
+
+struct DemuxedPackets {
+  std::vector<utils::UniquePacket> packets_;
+  int stream_index_;
+  AVRational time_base_;
+  size_t bytes_ = 0;
+};
+
+DemuxedPackets demuxPackets(const std::vector<uint8_t>& data) {
+  Input input{data};
+  DemuxedPackets result;
+  result.stream_index_ = input.audioStream();
+  result.time_base_ = input.ifmt_ctx_->streams[result.stream_index_]->time_base;
+  auto pkt = utils::makePacket();
+  while (av_read_frame(input.ifmt_ctx_, pkt.get()) >= 0) {
+    result.bytes_ += pkt->size;
+    result.packets_.emplace_back(av_packet_clone(pkt.get()));
+    ASSERT(result.packets_.back());
+    av_packet_unref(pkt.get());
+  }
+  return result;
+}
+
+// runtime counterpart of pipeline.hpp stages
+namespace dynamic_pipeline {
+
+struct Stage {
+  Stage* next_ = nullptr;
+  virtual ~Stage() = default;
+  virtual void write(AVPacket* pkt) = 0;
+  virtual void finish() {
+    if (next_) {
+      next_->finish();
+    }
+  }
+};
+
+struct SelectStream : Stage {
+  int stream_index_;
+  SelectStream(int stream_index) : stream_index_{stream_index} {}
+  void write(AVPacket* pkt) override {
+    if (pkt->stream_index == stream_index_) {
+      STATS_ADD(packets, 1);
+      next_->write(pkt);
+    }
+  }
+};
+
+struct Tap : Stage {
+  std::function<void(const AVPacket*)> fn_;
+  Tap(std::function<void(const AVPacket*)> fn) : fn_{std::move(fn)} {}
+  void write(AVPacket* pkt) override {
+    fn_(pkt);
+    next_->write(pkt);
+  }
+};
+
+struct ToOutput : Stage {
+  int stream_index_;
+  AVRational from_;
+  AVRational to_;
+  bool rescale_;  // only if time bases differ
+  ToOutput(int stream_index, AVRational from, AVRational to)
+      : stream_index_{stream_index},
+        from_{from},
+        to_{to},
+        rescale_{av_cmp_q(from, to) != 0} {}
+  void write(AVPacket* pkt) override {
+    pkt->stream_index = stream_index_;
+    if (rescale_) {
+      av_packet_rescale_ts(pkt, from_, to_);
+    }
+    next_->write(pkt);
+  }
+};
+
+}  // namespace dynamic_pipeline
+
+// size and pts sum (keeps the chain from being optimized away)
+struct CountSink : dynamic_pipeline::Stage {
+  int64_t total_ = 0;
+
+  void write(AVPacket* pkt) override { (*this)(pkt, *this); }
+
+  template <class Next>
+  void operator()(AVPacket* pkt, Next&) {
+    total_ += pkt->size + pkt->pts;
+  }
+};
+
+template <bool RESCALE>
+int64_t pipelineStatic(DemuxedPackets& input) {
+  CountSink sink;
+  int64_t durations = 0;
+  auto chain = pipeline::makeChain(
+      pipeline::SelectStream{input.stream_index_},
+      pipeline::tap([&](const AVPacket* pkt) { durations += pkt->duration; }),
+      pipeline::ToOutput<RESCALE>{input.stream_index_, input.time_base_,
+                                  input.time_base_},
+      std::ref(sink));
+  for (int i = 0; i < PIPELINE_REPLAYS; i++) {
+    for (auto& pkt : input.packets_) {
+      chain(pkt.get());
+    }
+  }
+  chain.finish();
+  return sink.total_ + durations;
+}
+
+int64_t pipelineDynamic(DemuxedPackets& input) {
+  CountSink sink;
+  int64_t durations = 0;
+  std::vector<std::unique_ptr<dynamic_pipeline::Stage>> stages;
+  stages.push_back(
+      std::make_unique<dynamic_pipeline::SelectStream>(input.stream_index_));
+  stages.push_back(std::make_unique<dynamic_pipeline::Tap>(
+      [&](const AVPacket* pkt) { durations += pkt->duration; }));
+  stages.push_back(std::make_unique<dynamic_pipeline::ToOutput>(
+      input.stream_index_, input.time_base_, input.time_base_));
+  for (size_t i = 0; i + 1 < stages.size(); i++) {
+    stages[i]->next_ = stages[i + 1].get();
+  }
+  stages.back()->next_ = &sink;
+  for (int i = 0; i < PIPELINE_REPLAYS; i++) {
+    for (auto& pkt : input.packets_) {
+      stages.front()->write(pkt.get());
+    }
+  }
+  stages.front()->finish();
+  return sink.total_ + durations;
+}
+
+//
+// main
+//
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto seconds = cli.argument<double>("--seconds").value_or(60);
+  auto iterations = cli.argument<int>("--iterations").value_or(5);
+  auto seed = cli.argument<uint32_t>("--seed").value_or(0);
+  auto out_file = cli.argument("--out").value_or("-");
+  auto write_inputs = cli.argument("--write-inputs");
+  auto index_size = cli.argument<int>("--index-size").value_or(100000);
+
+  // keep ffmpeg quiet unless something goes wrong
+  utils::LogCapture logger{AV_LOG_WARNING};
+  DEFER {
+    logger.drain([](int, std::string_view message) { std::cerr << message; });
+  };
+
+  utils::bench::Report report;
+  report.build_["seed"] = seed;
+
+  for (auto format : {"webm", "opus"}) {
+    // generate input
+    synthetic_media::Options options;
+    options.format = format;
+    options.seconds = seconds;
+    options.seed = seed;
+    auto data = synthetic_media::generate(options);
+
+    std::ostringstream name;
+    name << (options.format == "opus" ? "ogg" : "webm") << "-" << seconds
+         << "s";
+    auto input = name.str();
+    if (write_inputs) {
+      auto ext = options.format == "opus" ? ".opus" : ".webm";
+      utils::writeFile(write_inputs.value() + "/" + input + ext, data);
+    }
+
+    // run
+    double media_seconds = probe(data);
+    report.add("probe", input, data.size(), media_seconds,
+               utils::bench::measure(iterations, [&]() { probe(data); }));
+    report.add("remux", input, data.size(), media_seconds,
+               utils::bench::measure(iterations, [&]() { remux(data); }));
+    report.add(
+        "remux_ogg_writer", input, data.size(), media_seconds,
+        utils::bench::measure(iterations, [&]() { remuxOggWriter(data); }));
+    if (options.format == "webm") {
+      report.add("remux_matroska_reader", input, data.size(), media_seconds,
+                 utils::bench::measure(iterations,
+                                       [&]() { remuxMatroskaReader(data); }));
+    }
+    auto decode_seconds =
+        report
+            .add("decode", input, data.size(), media_seconds,
+                 utils::bench::measure(iterations, [&]() { decode(data); }))
+            .at("seconds")
+            .at("median")
+            .get<double>();
+    // analysis cost as a fraction of decode alone ("realtime" of the
+    // result is the throughput against real time)
+    auto decodeWith = [&](const std::string& bench, Analysis analysis) {
+      auto& result = report.add(
+          bench, input, data.size(), media_seconds,
+          utils::bench::measure(iterations,
+                                [&]() { decode(data, analysis); }));
+      result["overhead"] =
+          result["seconds"]["median"].get<double>() / decode_seconds - 1;
+    };
+    {
+      // arena kept across iterations as a worker would (cf. ContextPool)
+      utils::BufferArena arena;
+      auto& result = report.add(
+          "decode_arena", input, data.size(), media_seconds,
+          utils::bench::measure(
+              iterations, [&]() { decode(data, Analysis::none, &arena); }));
+      result["speedup"] =
+          decode_seconds / result["seconds"]["median"].get<double>();
+      result["arena"] = arena.toJson();
+    }
+    decodeWith("decode_loudness", Analysis::loudness);
+    decodeWith("decode_spectrogram", Analysis::spectrogram);
+    decodeWith("decode_fingerprint", Analysis::fingerprint);
+
+    // near duplicate query of the input's fingerprint
+    {
+      Input fingerprint_input{data};
+      auto hashes = fingerprint::compute(fingerprint_input.ifmt_ctx_,
+                                         fingerprint_input.audioStream());
+      auto index = makeIndex(hashes, index_size, seed);
+      auto& result = report.add(
+          "fingerprint_query", input, hashes.size() * 4, media_seconds,
+          utils::bench::measure(iterations, [&]() { index.query(hashes); }));
+      result["index_size"] = index.size();
+      result["matches"] = index.query(hashes).size();
+    }
+    // per job setup cost (no bytes or media processed, compare "seconds")
+    {
+      Input setup_input{data};
+      auto par =
+          setup_input.ifmt_ctx_->streams[setup_input.audioStream()]->codecpar;
+      auto fresh_seconds =
+          report
+              .add("job_setup_fresh", input, 0, 0,
+                   utils::bench::measure(
+                       iterations, [&]() { jobSetupFresh(par, SETUP_JOBS); }))
+              .at("seconds")
+              .at("median")
+              .get<double>();
+      utils::ContextPool pool;
+      auto& result = report.add(
+          "job_setup_pooled", input, 0, 0,
+          utils::bench::measure(
+              iterations, [&]() { jobSetupPooled(pool, par, SETUP_JOBS); }));
+      result["jobs"] = SETUP_JOBS;
+      result["speedup"] =
+          fresh_seconds / result["seconds"]["median"].get<double>();
+      result["pool"] = pool.toJson();
+    }
+    // static vs runtime polymorphic copy chain
+    {
+      auto packets = demuxPackets(data);
+      auto bytes = packets.bytes_ * PIPELINE_REPLAYS;
+      auto replayed_seconds = media_seconds * PIPELINE_REPLAYS;
+      ASSERT(pipelineStatic<false>(packets) == pipelineDynamic(packets));
+      ASSERT(pipelineStatic<true>(packets) == pipelineDynamic(packets));
+      auto median = [](nlohmann::json& result) {
+        return result.at("seconds").at("median").get<double>();
+      };
+      auto dynamic_seconds = median(report.add(
+          "pipeline_dynamic", input, bytes, replayed_seconds,
+          utils::bench::measure(iterations,
+                                [&]() { pipelineDynamic(packets); })));
+      auto rescale_seconds = median(report.add(
+          "pipeline_static_rescale", input, bytes, replayed_seconds,
+          utils::bench::measure(
+              iterations, [&]() { pipelineStatic<true>(packets); })));
+      auto& result = report.add(
+          "pipeline_static", input, bytes, replayed_seconds,
+          utils::bench::measure(iterations,
+                                [&]() { pipelineStatic<false>(packets); }));
+      // static dispatch alone (both skip the rescale), rescale skip alone
+      result["speedup"] = dynamic_seconds / median(result);
+      result["rescale_skip_speedup"] = rescale_seconds / median(result);
+    }
+    report.add("avio_read", input, data.size(), media_seconds,
+               utils::bench::measure(iterations, [&]() { avioRead(data); }));
+    report.add("avio_write", input, data.size(), media_seconds,
+               utils::bench::measure(iterations, [&]() { avioWrite(data); }));
+  }
+
+  // write report
+  auto result = report.toJson().dump(2);
+  if (out_file == "-") {
+    std::cout << result << std::endl;
+  } else {
+    std::ofstream ostr(out_file);
+    ASSERT(ostr.is_open());
+    ostr << result << std::endl;
+  }
+  return 0;
+}
@@ -1,7 +1,11 @@
 #include <cstring>
 #include <nlohmann/json.hpp>
+#include <map>
 #include <optional>
+#include "matroska-reader.hpp"
+#include "opus-packet.hpp"
 #include "utils-ffmpeg.hpp"
+#include "utils-result.hpp"
 #include "utils.hpp"
 
 extern "C" {
@@ -15,7 +19,58 @@ extern "C" {
 // based on example-04
 //
 
-nlohmann::json runImpl(const std::vector<uint8_t>& in_data) {
+// packet statistics of opus streams from TOC bytes (no decoding)
+utils::Result<std::map<int, opus_packet::Summary>> summarizeOpus(
+    AVFormatContext* ifmt_ctx,
+    const std::vector<uint8_t>& in_data) {
+  std::map<int, opus_packet::Summary> result;
+  for (unsigned int i = 0; i < ifmt_ctx->nb_streams; i++) {
+    auto stream = ifmt_ctx->streams[i];
+    if (stream->codecpar->codec_id == AV_CODEC_ID_OPUS) {
+      result[i] = {};
+    } else {
+      stream->discard = AVDISCARD_ALL;
+    }
+  }
+  if (result.empty()) {
+    return result;
+  }
+
+  // single opus track in webm straight from the input buffer
+  if (result.size() == 1 &&
+      std::strstr(ifmt_ctx->iformat->name, "matroska")) {
+    auto& summary = result.begin()->second;
+    if (matroska::summarizeOpus(in_data.data(), in_data.size(), summary)) {
+      return result;
+    }
+  }
+
+  // otherwise demux without parsing (continues after find_stream_info)
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+  while (true) {
+    int ret = STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt));
+    if (ret == AVERROR_EOF) {
+      break;
+    }
+    ASSERT_AV_OR_RETURN(ret);
+    DEFER {
+      av_packet_unref(pkt);
+    };
+    auto found = result.find(pkt->stream_index);
+    if (found != result.end()) {
+      STATS_ADD(packets, 1);
+      found->second.add(pkt->data, pkt->size);
+    }
+  }
+  return result;
+}
+
+// input errors are returned rather than thrown so that this also works in
+// builds without exceptions (-DEMSCRIPTEN_EXCEPTIONS=OFF)
+utils::Result<nlohmann::json> runImpl(const std::vector<uint8_t>& in_data) {
   //
   // input
   //
@@ -28,8 +83,11 @@ nlohmann::json runImpl(const std::vector<uint8_t>& in_data) {
   ifmt_ctx_->pb = input_.avio_ctx_;
   ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-  ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
-  ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
+  {
+    STATS_SCOPE(probe);
+    ASSERT_AV_OR_RETURN(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV_OR_RETURN(avformat_find_stream_info(ifmt_ctx_, NULL));
+  }
 
   auto info = nlohmann::json::object(
       {{"format_name", ifmt_ctx_->iformat->name},
@@ -54,23 +112,48 @@ nlohmann::json runImpl(const std::vector<uint8_t>& in_data) {
         streamInfo["type"] = type_string;
       }
     }
+    if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+      streamInfo["channels"] = stream->codecpar->ch_layout.nb_channels;
+    }
     info["streams"].push_back(streamInfo);
   }
 
+  ASSIGN_OR_RETURN(auto summaries, summarizeOpus(ifmt_ctx_, in_data));
+  for (auto& [index, summary] : summaries) {
+    info["streams"][index]["opus"] = summary.toJson();
+  }
+
   return info;
 }
 
-// handle exception within c++ runtime so that we don't need emscripten's
-// exception support which can slow down many things
+// handle errors within c++ runtime so that we don't need emscripten's
+// exception support which can slow down many things. without exceptions,
+// only the errors returned by `runImpl` are reported (failed ASSERTs abort).
 std::string run(const std::vector<uint8_t>& in_data) {
   nlohmann::json result;
+  utils::stats::Stats stats;
+  auto report = [&]() {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+    auto info = runImpl(in_data);
+    result["ok"] = info.ok();
+    if (info.ok()) {
+      result["data"] = std::move(info.value());
+    } else {
+      result["data"] = info.error().message_;
+    }
+  };
+#if UTILS_EXCEPTIONS
   try {
-    result["ok"] = true;
-    result["data"] = runImpl(in_data);
+    report();
   } catch (const std::exception& e) {
     result["ok"] = false;
     result["data"] = e.what();
   }
+#else
+  report();
+#endif
+  result["stats"] = stats.toJson();
   return result.dump(2);
 }
 
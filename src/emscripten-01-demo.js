@@ -10,13 +10,19 @@ async function main() {
   const inPictureFile = cli.argument("--in-picture");
   const inMetadata = cli.argument("--in-metadata");
   const outFile = cli.argument("--out");
+  const outStats = cli.argument("--stats");
+  const start = cli.argument("--start"); // trim/concat via `editOpus`
+  const end = cli.argument("--end");
+  const deadlineMs = cli.argument("--deadline-ms"); // via `convertWithControl`
+  const progressMs = cli.argument("--progress-ms");
   const outFormat = outFile.split(".").at(-1);
 
   // initialize wasm
   const lib = await require(path.resolve(modulePath))();
 
   // load file data into wasm heap via embind vector
-  const inData = readFileToVector(new lib.Vector(), inFile);
+  const inFiles = inFile.split(",");
+  const inData = readFileToVector(new lib.Vector(), inFiles[0]);
 
   // metadata
   const metadata = new lib.StringMap();
@@ -33,10 +39,53 @@ async function main() {
   }
 
   // run
-  const outData = lib.convert(inData, outFormat, metadata);
+  let outData;
+  if (start || end || inFiles.length > 1) {
+    const inDataList = new lib.VectorList();
+    inDataList.push_back(inData);
+    for (const f of inFiles.slice(1)) {
+      inDataList.push_back(readFileToVector(new lib.Vector(), f));
+    }
+    outData = lib.editOpus(
+      inDataList,
+      Number(start ?? 0),
+      Number(end ?? -1),
+      metadata
+    );
+  } else if (deadlineMs || progressMs) {
+    const onProgress = progressMs
+      ? (bytes, totalBytes, seconds) => {
+          console.error(JSON.stringify({ bytes, totalBytes, seconds }));
+          return true;
+        }
+      : null;
+    outData = lib.convertWithControl(
+      inData,
+      outFormat,
+      metadata,
+      Number(deadlineMs ?? 0),
+      Number(progressMs ?? 0),
+      onProgress
+    );
+    const error = lib.getLastError();
+    if (error) {
+      throw new Error(error);
+    }
+  } else {
+    outData = lib.convert(inData, outFormat, metadata);
+    const error = lib.getLastError();
+    if (error) {
+      throw new Error(error);
+    }
+  }
 
   // write file
   fs.writeFileSync(outFile, outData.view());
+
+  // timers and counters
+  if (outStats) {
+    fs.writeFileSync(outStats, lib.getLastStats());
+  }
 }
 
 if (require.main === module) {
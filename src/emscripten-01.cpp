@@ -1,8 +1,17 @@
 #include <cstring>
+#include <memory>
 #include <optional>
+#include "matroska-reader.hpp"
+#include "ogg-opus-writer.hpp"
+#include "opus-edit.hpp"
+#include "opus-split.hpp"
 #include "opusenc-picture.hpp"
+#include "spectrogram.hpp"
+#include "utils-control.hpp"
 #include "utils-ffmpeg.hpp"
+#include "utils-result.hpp"
 #include "utils.hpp"
+#include "waveform.hpp"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,10 +24,27 @@ extern "C" {
 // based on example-03
 //
 
-std::vector<uint8_t> convert(
+// stats of the last `convert` call (exposed as JSON via `getLastStats`)
+utils::stats::Stats g_last_stats;
+
+// error of the last `convert` call (empty on success, cf. `getLastError`)
+std::string g_last_error;
+
+// input errors are returned rather than thrown so that this also works in
+// builds without exceptions (-DEMSCRIPTEN_EXCEPTIONS=OFF)
+utils::Result<std::vector<uint8_t>> convertImpl(
     const std::vector<uint8_t>& in_data,
     const std::string& out_format,
     const std::map<std::string, std::string>& metadata) {
+  // webm -> ogg without libavformat demuxer/muxer
+  if (out_format == "opus" || out_format == "ogg") {
+    std::vector<uint8_t> output;
+    if (matroska::copyToOggOpus(in_data.data(), in_data.size(), metadata,
+                                output)) {
+      return output;
+    }
+  }
+
   // input context
   BufferInput input_{in_data};
   AVFormatContext* ifmt_ctx_ = avformat_alloc_context();
@@ -28,15 +54,19 @@ std::vector<uint8_t> convert(
   };
   ifmt_ctx_->pb = input_.avio_ctx_;
   ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+  utils::control::attach(ifmt_ctx_);
 
-  ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
-  ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
+  {
+    STATS_SCOPE(probe);
+    ASSERT_AV_OR_RETURN(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV_OR_RETURN(avformat_find_stream_info(ifmt_ctx_, NULL));
+  }
 
   // output context
   BufferOutput output_;
   AVFormatContext* ofmt_ctx_;
   avformat_alloc_output_context2(&ofmt_ctx_, NULL, out_format.c_str(), NULL);
-  ASSERT(ofmt_ctx_);
+  ASSERT_OR_RETURN(ofmt_ctx_);
   DEFER {
     avformat_free_context(ofmt_ctx_);
   };
@@ -50,45 +80,195 @@ std::vector<uint8_t> convert(
   // input audio stream
   auto stream_index =
       av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-  ASSERT(stream_index >= 0);
+  ASSERT_AV_OR_RETURN(stream_index);
   AVStream* in_stream = ifmt_ctx_->streams[stream_index];
-  ASSERT(in_stream);
+
+  // write ogg pages directly without libavformat muxer
+  if ((out_format == "opus" || out_format == "ogg") &&
+      ogg_opus::canCopy(in_stream)) {
+    auto status =
+        ogg_opus::tryCopy(ifmt_ctx_, stream_index, metadata, output_.output_);
+    if (!status.ok()) {
+      return status.error();
+    }
+    STATS_SCOPE(output_copy);
+    return output_.output_;
+  }
 
   // output audio stream
   AVStream* out_stream = avformat_new_stream(ofmt_ctx_, nullptr);
   ASSERT(out_stream);
-  ASSERT(avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar) >=
-         0);
+  ASSERT_AV_OR_RETURN(
+      avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar));
   out_stream->time_base = in_stream->time_base;
 
   // allocate AVPacket
-  AVPacket* pkt = av_packet_alloc();
-  ASSERT(pkt);
+  AVPacket* pkt = utils::allocPacket();
   DEFER {
     av_packet_free(&pkt);
   };
 
   // write header
-  ASSERT(avformat_write_header(ofmt_ctx_, nullptr) >= 0);
+  ASSERT_AV_OR_RETURN(
+      STATS_TIMED(mux, avformat_write_header(ofmt_ctx_, nullptr)));
 
   // copy packets
-  std::vector<uint8_t> result;
-  while (av_read_frame(ifmt_ctx_, pkt) >= 0) {
-    ASSERT(pkt->stream_index == stream_index);
+  while (STATS_TIMED(demux, av_read_frame(ifmt_ctx_, pkt)) >= 0) {
+    DEFER {
+      av_packet_unref(pkt);
+    };
+    if (pkt->stream_index != stream_index) {
+      continue;
+    }
+    STATS_ADD(packets, 1);
+    utils::control::reached(pkt, in_stream->time_base);
     pkt->stream_index = out_stream->index;
     av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
-    ASSERT(av_interleaved_write_frame(ofmt_ctx_, pkt) == 0);
-    av_packet_unref(pkt);
+    ASSERT_AV_OR_RETURN(
+        STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, pkt)));
+  }
+  auto status = utils::control::check();
+  if (!status.ok()) {
+    return status.error();
   }
-  ASSERT(av_interleaved_write_frame(ofmt_ctx_, nullptr) == 0);
+  ASSERT_AV_OR_RETURN(
+      STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, nullptr)));
 
   // write trailer
-  av_write_trailer(ofmt_ctx_);
+  ASSERT_AV_OR_RETURN(STATS_TIMED(mux, av_write_trailer(ofmt_ctx_)));
 
   // return Vector
+  STATS_SCOPE(output_copy);
   return output_.output_;
 }
 
+// empty on error (message from `getLastError`)
+std::vector<uint8_t> convert(
+    const std::vector<uint8_t>& in_data,
+    const std::string& out_format,
+    const std::map<std::string, std::string>& metadata) {
+  g_last_stats.reset();
+  g_last_error.clear();
+  utils::stats::JobScope job{g_last_stats};
+  STATS_SCOPE(total);
+  auto result = convertImpl(in_data, out_format, metadata);
+  if (!result.ok()) {
+    // e.g. AVERROR_EXIT of a read is reported as what stopped the job
+    auto control = utils::control::current;
+    g_last_error = control && control->reason_ != utils::control::Reason::none
+                       ? control->message()
+                       : result.error().message_;
+    return {};
+  }
+  return std::move(result.value());
+}
+
+//
+// trim/concat by stream copy (cf. example-07)
+//
+
+struct EditInput {
+  BufferInput input_;
+  AVFormatContext* ifmt_ctx_;
+  int stream_index_;
+
+  EditInput(const std::vector<uint8_t>& data) : input_{data} {
+    ifmt_ctx_ = avformat_alloc_context();
+    ASSERT(ifmt_ctx_);
+    ifmt_ctx_->pb = input_.avio_ctx_;
+    ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    STATS_SCOPE(probe);
+    ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+    stream_index_ =
+        av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index_);
+  }
+
+  ~EditInput() { avformat_close_input(&ifmt_ctx_); }
+};
+
+// seconds (negative `end` for until the end)
+std::vector<uint8_t> editOpus(
+    const std::vector<std::vector<uint8_t>>& in_data_list,
+    double start,
+    double end,
+    const std::map<std::string, std::string>& metadata) {
+  g_last_stats.reset();
+  utils::stats::JobScope job{g_last_stats};
+  STATS_SCOPE(total);
+
+  std::vector<std::unique_ptr<EditInput>> inputs;
+  std::vector<opus_edit::Source> sources;
+  for (auto& in_data : in_data_list) {
+    inputs.push_back(std::make_unique<EditInput>(in_data));
+    sources.push_back({inputs.back()->ifmt_ctx_, inputs.back()->stream_index_});
+  }
+  opus_edit::Range range;
+  range.start = opus_edit::toSamples(start);
+  range.end = end < 0 ? -1 : opus_edit::toSamples(end);
+
+  std::vector<uint8_t> output;
+  opus_edit::edit(sources, range, metadata, output);
+  return output;
+}
+
+// chapters as JSON (cf. opus_split::fromJson), input's chapters if empty.
+// chapters are written sequentially since the module is built without pthread.
+std::vector<std::vector<uint8_t>> splitOpus(
+    const std::vector<uint8_t>& in_data,
+    const std::string& chapters_json,
+    const std::map<std::string, std::string>& metadata) {
+  g_last_stats.reset();
+  utils::stats::JobScope job{g_last_stats};
+  STATS_SCOPE(total);
+
+  EditInput input{in_data};
+  auto chapters =
+      chapters_json.empty()
+          ? opus_split::fromInput(input.ifmt_ctx_)
+          : opus_split::fromJson(nlohmann::json::parse(chapters_json));
+  ASSERT(!chapters.empty());
+
+  opus_edit::Timeline timeline;
+  opus_edit::collect({{input.ifmt_ctx_, input.stream_index_}}, timeline);
+  return opus_split::split(timeline, chapters, metadata, 1);
+}
+
+// waveform peaks pyramid (cf. example-09, binary format in waveform.hpp)
+std::vector<uint8_t> computePeaks(const std::vector<uint8_t>& in_data) {
+  g_last_stats.reset();
+  utils::stats::JobScope job{g_last_stats};
+  STATS_SCOPE(total);
+
+  EditInput input{in_data};
+  return waveform::compute(input.ifmt_ctx_, input.stream_index_,
+                           waveform::DEFAULT_LEVELS);
+}
+
+// 8 bit mel spectrogram (binary format in spectrogram.hpp)
+std::vector<uint8_t> computeSpectrogram(const std::vector<uint8_t>& in_data,
+                                        int hop,
+                                        int bins) {
+  g_last_stats.reset();
+  utils::stats::JobScope job{g_last_stats};
+  STATS_SCOPE(total);
+
+  EditInput input{in_data};
+  spectrogram::Options options;
+  options.hop = hop;
+  options.bins = bins;
+  return spectrogram::compute(input.ifmt_ctx_, input.stream_index_, options);
+}
+
+std::string getLastStats() {
+  return g_last_stats.toJson().dump(2);
+}
+
+std::string getLastError() {
+  return g_last_error;
+}
+
 std::string encodePictureMetadata(const std::vector<uint8_t>& data) {
   return opusenc_picture::encode(data);
 }
@@ -103,6 +283,37 @@ std::string encodePictureMetadata(const std::vector<uint8_t>& data) {
 
 using namespace emscripten;
 
+// `convert` stopped after `deadline_ms` (none unless positive) or when
+// `onProgress(bytes, totalBytes, seconds)` returns false. it's called at most
+// every `progress_ms` (null for none). the module is single threaded, so
+// that's where a worker aborts e.g. by checking a flag in a
+// SharedArrayBuffer set by the main thread. error is "cancelled" or
+// "deadline exceeded" (cf. `getLastError`).
+std::vector<uint8_t> convertWithControl(
+    const std::vector<uint8_t>& in_data,
+    const std::string& out_format,
+    const std::map<std::string, std::string>& metadata,
+    double deadline_ms,
+    double progress_ms,
+    val on_progress) {
+  utils::control::Control control;
+  control.setTimeout(deadline_ms);
+  if (!on_progress.isNull() && !on_progress.isUndefined()) {
+    control.progress_interval_ =
+        std::chrono::duration_cast<utils::control::Clock::duration>(
+            std::chrono::duration<double, std::milli>(progress_ms));
+    control.on_progress_ = [&](const utils::control::Progress& progress) {
+      auto result =
+          on_progress(static_cast<double>(progress.bytes),
+                      static_cast<double>(progress.total_bytes),
+                      progress.seconds);
+      return !result.isFalse();
+    };
+  }
+  utils::control::Scope scope{control};
+  return convert(in_data, out_format, metadata);
+}
+
 template <typename T>
 val Vector_view(const std::vector<T>& self) {
   return val(typed_memory_view(self.size(), self.data()));
@@ -110,8 +321,16 @@ val Vector_view(const std::vector<T>& self) {
 
 EMSCRIPTEN_BINDINGS(emscripten_01) {
   register_vector<uint8_t>("Vector").function("view", &Vector_view<uint8_t>);
+  register_vector<std::vector<uint8_t>>("VectorList");
   register_map<std::string, std::string>("StringMap");
 
   function("convert", &convert);
+  function("convertWithControl", &convertWithControl);
+  function("editOpus", &editOpus);
+  function("splitOpus", &splitOpus);
+  function("computePeaks", &computePeaks);
+  function("computeSpectrogram", &computeSpectrogram);
   function("encodePictureMetadata", &encodePictureMetadata);
+  function("getLastStats", &getLastStats);
+  function("getLastError", &getLastError);
 }
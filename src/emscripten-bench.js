@@ -0,0 +1,118 @@
+const path = require("path");
+const fs = require("fs");
+const assert = require("assert/strict");
+const {
+  Cli,
+  copyToVector,
+  measure,
+  BenchReport,
+} = require("./emscripten-utils.js");
+
+//
+// wasm counterpart of bench-00 (inputs are generated by `bench-00 --write-inputs`)
+//
+// usage:
+//   node ./src/emscripten-bench.js --label Release \
+//     --module-00 ./build/emscripten/Release/emscripten-00.js \
+//     --module-01 ./build/emscripten/Release/emscripten-01.js \
+//     --in webm-60s.webm,ogg-60s.opus --iterations 5 --out bench-wasm.json
+//
+
+// memory only grows (ALLOW_MEMORY_GROWTH) so current size is the peak
+function heapBytes(lib) {
+  return lib.HEAP8 ? lib.HEAP8.length : null;
+}
+
+async function main() {
+  const cli = new Cli(process.argv.slice(2));
+  const module00 = cli.argument("--module-00");
+  const module01 = cli.argument("--module-01");
+  const inFiles = (cli.argument("--in") ?? "").split(",").filter(Boolean);
+  const iterations = Number(cli.argument("--iterations") ?? 5);
+  const label = cli.argument("--label") ?? "unknown";
+  const outFile = cli.argument("--out") ?? "-";
+  assert.ok(module00 || module01);
+  assert.ok(inFiles.length > 0);
+
+  const report = new BenchReport({
+    type: label,
+    node: process.version,
+    modules: { "emscripten-00": module00, "emscripten-01": module01 },
+  });
+
+  // instantiate
+  const libs = {};
+  for (const [name, modulePath] of [
+    ["emscripten-00", module00],
+    ["emscripten-01", module01],
+  ]) {
+    if (!modulePath) {
+      continue;
+    }
+    const init = require(path.resolve(modulePath));
+    const wasmFile = modulePath.replace(/\.js$/, ".wasm");
+    const wasmBytes = fs.existsSync(wasmFile) ? fs.statSync(wasmFile).size : 0;
+    const seconds = await measure(iterations, () => init());
+    report.add("instantiate", name, wasmBytes, 0, seconds);
+    libs[name] = await init();
+  }
+
+  for (const inFile of inFiles) {
+    const input = path.basename(inFile).replace(/\.[^.]*$/, "");
+    const data = fs.readFileSync(inFile);
+
+    // probe via runTest (also gives media duration)
+    let mediaSeconds = 0;
+    const lib00 = libs["emscripten-00"];
+    if (lib00) {
+      const v = copyToVector(new lib00.Vector(), data);
+      const info = JSON.parse(lib00.runTest(v));
+      assert.ok(info.ok, info.data);
+      mediaSeconds = info.data.duration / 1e6;
+      const seconds = await measure(iterations, () => lib00.runTest(v));
+      Object.assign(
+        report.add("probe", input, data.length, mediaSeconds, seconds),
+        { function: "runTest", peak_heap_bytes: heapBytes(lib00) }
+      );
+      v.delete();
+    }
+
+    // remux via convert
+    const lib01 = libs["emscripten-01"];
+    if (lib01) {
+      const v = copyToVector(new lib01.Vector(), data);
+      const metadata = new lib01.StringMap();
+      let seconds = await measure(iterations, () => {
+        lib01.convert(v, "opus", metadata).delete();
+      });
+      Object.assign(
+        report.add("remux", input, data.length, mediaSeconds, seconds),
+        { function: "convert", peak_heap_bytes: heapBytes(lib01) }
+      );
+
+      // JS <-> heap copies (cf. readFileToVector and Vector.view)
+      seconds = await measure(iterations, () => {
+        copyToVector(new lib01.Vector(), data).delete();
+      });
+      report.add("copy_in", input, data.length, mediaSeconds, seconds);
+
+      const out = lib01.convert(v, "opus", metadata);
+      seconds = await measure(iterations, () => out.view().slice());
+      report.add("copy_out", input, out.size(), mediaSeconds, seconds);
+      out.delete();
+      metadata.delete();
+      v.delete();
+    }
+  }
+
+  const result = JSON.stringify(report.toJson(), null, 2);
+  if (outFile === "-") {
+    console.log(result);
+  } else {
+    fs.writeFileSync(outFile, result + "\n");
+  }
+}
+
+if (require.main === module) {
+  main();
+}
@@ -1,4 +1,5 @@
 const fs = require("fs");
+const { performance } = require("perf_hooks");
 
 class Cli {
   constructor(argv) {
@@ -14,10 +15,75 @@ class Cli {
 }
 
 function readFileToVector(vector, filename) {
-  const buffer = fs.readFileSync(filename);
-  vector.resize(buffer.length, 0);
-  vector.view().set(new Uint8Array(buffer));
+  return copyToVector(vector, fs.readFileSync(filename));
+}
+
+function copyToVector(vector, data) {
+  vector.resize(data.length, 0);
+  vector.view().set(new Uint8Array(data));
   return vector;
 }
 
-module.exports = { Cli, readFileToVector };
+//
+// benchmark helper (same report schema as src/utils-bench.hpp)
+//
+
+const BENCH_SCHEMA = "ffmpeg-experiment-bench/1";
+
+// one warmup run and then `iterations` measured runs
+async function measure(iterations, fn) {
+  await fn();
+  const result = [];
+  for (let i = 0; i < iterations; i++) {
+    const start = performance.now();
+    await fn();
+    result.push((performance.now() - start) / 1000);
+  }
+  return result;
+}
+
+class BenchReport {
+  constructor(build) {
+    this.build = build;
+    this.results = [];
+  }
+
+  // `bytes` and `mediaSeconds` are amount of work done by a single run
+  add(name, input, bytes, mediaSeconds, seconds) {
+    seconds = [...seconds].sort((a, b) => a - b);
+    const n = seconds.length;
+    const min = seconds[0];
+    const median =
+      n % 2 ? seconds[(n - 1) / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+    const mean = seconds.reduce((a, b) => a + b, 0) / n;
+    const entry = {
+      name,
+      input,
+      bytes,
+      media_seconds: mediaSeconds,
+      iterations: n,
+      seconds: { min, median, mean },
+      throughput_mb_s: bytes / median / 1e6,
+      realtime: mediaSeconds / median,
+    };
+    this.results.push(entry);
+    return entry;
+  }
+
+  toJson() {
+    return {
+      schema: BENCH_SCHEMA,
+      runtime: "wasm",
+      build: this.build,
+      results: this.results,
+    };
+  }
+}
+
+module.exports = {
+  Cli,
+  readFileToVector,
+  copyToVector,
+  measure,
+  BenchReport,
+};
@@ -2,6 +2,11 @@
 // third_party/FFmpeg/doc/examples/demuxing_decoding.c
 
 #include <cstring>
+#include "fingerprint.hpp"
+#include "loudness.hpp"
+#include "ogg-opus-writer.hpp"
+#include "spectrogram.hpp"
+#include "utils-ffmpeg.hpp"
 #include "utils.hpp"
 
 extern "C" {
@@ -11,73 +16,6 @@ extern "C" {
 #include <libavutil/avutil.h>
 }
 
-//
-// AVIOContext wrapper for in-memory data
-//
-
-struct BufferInput {
-  AVIOContext* avio_ctx_;
-  std::vector<uint8_t> input_;
-  size_t input_pos_ = 0;
-
-  BufferInput(const std::vector<uint8_t>& input) : input_{input} {
-    // ffmpeg internal buffer (needs to be allocated on our own initially)
-    constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
-    auto avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
-    ASSERT(avio_buffer);
-
-    // instantiate AVIOContext (`seek` doesn't seem necessary but why not)
-    avio_ctx_ =
-        avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, this,
-                           BufferInput::readPacket, NULL, BufferInput::seek);
-    ASSERT(avio_ctx_);
-  }
-
-  ~BufferInput() {
-    av_freep(&avio_ctx_->buffer);
-    avio_context_free(&avio_ctx_);
-  }
-
-  static int readPacket(void* opaque, uint8_t* buf, int buf_size) {
-    return reinterpret_cast<BufferInput*>(opaque)->readPacketImpl(buf,
-                                                                  buf_size);
-  }
-
-  int readPacketImpl(uint8_t* buf, int buf_size) {
-    int read_size = std::min<int>(buf_size, input_.size() - input_pos_);
-    if (read_size == 0) {
-      return AVERROR_EOF;
-    }
-    std::memcpy(buf, &input_[input_pos_], read_size);
-    input_pos_ += read_size;
-    return read_size;
-  }
-
-  static int64_t seek(void* opaque, int64_t offset, int whence) {
-    return reinterpret_cast<BufferInput*>(opaque)->seekImpl(offset, whence);
-  }
-
-  int64_t seekImpl(int64_t offset, int whence) {
-    // cf. io_seek in third_party/FFmpeg/tools/target_dem_fuzzer.c
-
-    if (whence == AVSEEK_SIZE) {
-      return input_.size();
-    }
-
-    if (whence == SEEK_CUR) {
-      offset += input_pos_;
-    } else if (whence == SEEK_END) {
-      offset = input_.size() - offset;
-    }
-
-    if (offset < 0 || input_.size() < (size_t)offset) {
-      return -1;
-    }
-    input_pos_ = (size_t)offset;
-    return 0;
-  }
-};
-
 //
 // AVFormatContext wrapper
 //
@@ -85,6 +23,9 @@ struct BufferInput {
 struct FormatContext {
   AVFormatContext* ifmt_ctx_;
   BufferInput& input_;
+  std::optional<loudness::FrameMeter> loudness_;  // analyze decoded frames
+  std::optional<spectrogram::Builder> spectrogram_;
+  std::optional<fingerprint::Builder> fingerprint_;
 
   FormatContext(BufferInput& bytes_io) : input_{bytes_io} {
     ifmt_ctx_ = avformat_alloc_context();
@@ -100,6 +41,7 @@ struct FormatContext {
   }
 
   void openInput(bool debug = false) {
+    STATS_SCOPE(probe);
     ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
     ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
     if (debug) {
@@ -117,8 +59,7 @@ struct FormatContext {
     // find decoder and instantiate AVCodecContext
     const AVCodec* dec = avcodec_find_decoder(stream->codecpar->codec_id);
     ASSERT(dec);
-    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
-    ASSERT(dec_ctx);
+    AVCodecContext* dec_ctx = utils::allocCodecContext(dec);
     DEFER {
       avcodec_free_context(&dec_ctx);
     };
@@ -126,21 +67,20 @@ struct FormatContext {
     avcodec_open2(dec_ctx, dec, NULL);
 
     // allocate AVFrame and AVPacket
-    AVFrame* frame = av_frame_alloc();
-    ASSERT(frame);
+    AVFrame* frame = utils::allocFrame();
     DEFER {
       av_frame_free(&frame);
     };
-    AVPacket* pkt = av_packet_alloc();
-    ASSERT(pkt);
+    AVPacket* pkt = utils::allocPacket();
     DEFER {
       av_packet_free(&pkt);
     };
 
     // read and decode packets
     std::vector<uint8_t> result;
-    while (av_read_frame(ifmt_ctx_, pkt) >= 0) {
+    while (STATS_TIMED(demux, av_read_frame(ifmt_ctx_, pkt)) >= 0) {
       // dbg(pkt->pts, pkt->dts, pkt->duration);
+      STATS_ADD(packets, 1);
       if (pkt->stream_index == stream_index) {
         decodePacket(dec_ctx, pkt, frame, result);
       }
@@ -150,23 +90,37 @@ struct FormatContext {
     return result;
   }
 
-  static void decodePacket(AVCodecContext* dec_ctx,
-                           const AVPacket* pkt,
-                           AVFrame* frame,
-                           std::vector<uint8_t>& dest) {
-    ASSERT(avcodec_send_packet(dec_ctx, pkt) >= 0);
+  void decodePacket(AVCodecContext* dec_ctx,
+                    const AVPacket* pkt,
+                    AVFrame* frame,
+                    std::vector<uint8_t>& dest) {
+    ASSERT(STATS_TIMED(decode, avcodec_send_packet(dec_ctx, pkt)) >= 0);
     while (true) {
-      auto ret = avcodec_receive_frame(dec_ctx, frame);
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx, frame));
       if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
         return;
       }
       ASSERT(ret >= 0);
+      STATS_ADD(frames, 1);
       outputFrame(frame, dest);
+      if (loudness_) {
+        STATS_SCOPE(analysis);
+        loudness_->addFrame(frame);
+      }
+      if (spectrogram_) {
+        STATS_SCOPE(analysis);
+        spectrogram_->addFrame(frame);
+      }
+      if (fingerprint_) {
+        STATS_SCOPE(analysis);
+        fingerprint_->addFrame(frame);
+      }
       av_frame_unref(frame);
     }
   }
 
   static void outputFrame(AVFrame* frame, std::vector<uint8_t>& dest) {
+    STATS_SCOPE(output_copy);
     auto format = (enum AVSampleFormat)(frame->format);
     auto fmt_name = av_get_sample_fmt_name(format);
     ASSERT(fmt_name);
@@ -187,20 +141,70 @@ int main(int argc, const char** argv) {
   utils::Cli cli{argc, argv};
   auto in_file = cli.argument<std::string>("--in");
   auto out_file = cli.argument<std::string>("--out");
+  auto out_stats = cli.argument<std::string>("--stats");
+  auto analyze = cli.argument<int>("--loudness").value_or(0);
+  auto out_spectrogram = cli.argument<std::string>("--out-spectrogram");
+  auto out_fingerprint = cli.argument<std::string>("--out-fingerprint");
+  spectrogram::Options spectrogram_options;
+  spectrogram_options.hop =
+      cli.argument<int>("--hop").value_or(spectrogram_options.hop);
+  spectrogram_options.bins =
+      cli.argument<int>("--bins").value_or(spectrogram_options.bins);
   if (!in_file || !out_file) {
     std::cout << cli.help() << std::endl;
     return 1;
   }
 
-  // avio
-  auto data = utils::readFile(in_file.value());
-  BufferInput bytes_io{data};
+  // instrumentation
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // avio
+    auto data = utils::readFile(in_file.value());
+    BufferInput bytes_io{data};
+
+    // avformat
+    FormatContext format_context(bytes_io);
+    format_context.openInput(true);
+    if (analyze) {
+      format_context.loudness_.emplace();
+    }
+    if (out_spectrogram) {
+      format_context.spectrogram_.emplace(spectrogram_options);
+    }
+    if (out_fingerprint) {
+      format_context.fingerprint_.emplace();
+    }
+    auto decoded = format_context.decodeAudio();
+
+    // write raw audio
+    utils::writeFile(out_file.value(), decoded);
 
-  // avformat
-  FormatContext format_context(bytes_io);
-  format_context.openInput(true);
-  auto decoded = format_context.decodeAudio();
+    // e.g. { "integrated_lufs": -14.2, ..., "r128_track_gain": -2253 }
+    if (analyze) {
+      std::cout << format_context.loudness_->result().toJson().dump(2)
+                << std::endl;
+    }
+
+    // 8 bit mel spectrogram (cf. spectrogram.hpp)
+    if (out_spectrogram) {
+      utils::writeFile(out_spectrogram.value(),
+                       format_context.spectrogram_->finish());
+    }
 
-  // write raw audio
-  utils::writeFile(out_file.value(), decoded);
+    // u32 hashes (little endian) per ~0.11s (cf. fingerprint.hpp)
+    if (out_fingerprint) {
+      auto hashes = format_context.fingerprint_->finish();
+      std::vector<uint8_t> bytes(hashes.size() * 4);
+      for (size_t i = 0; i < hashes.size(); i++) {
+        ogg_opus::writeLE(&bytes[i * 4], hashes[i], 4);
+      }
+      utils::writeFile(out_fingerprint.value(), bytes);
+    }
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
 }
@@ -1,12 +1,23 @@
 // webm -> opus without transcoding (aka "-c copy")
 // third_party/FFmpeg/doc/examples/muxing.c
 // https://github.com/FFmpeg/FFmpeg/blob/81bc4ef14292f77b7dcea01b00e6f2ec1aea4b32/fftools/ffmpeg.c#L1782
+//
+// - `--deadline-ms` fails the job once exceeded and `--progress-ms` prints
+//   progress as json lines to stderr. SIGINT cancels the job (i.e. it fails
+//   at the next read instead of killing the process). cf. utils-control.hpp
 
+#include <csignal>
 #include <cstring>
 #include <map>
 #include <nlohmann/json.hpp>
 #include <optional>
+#include "loudness.hpp"
+#include "matroska-reader.hpp"
+#include "ogg-opus-writer.hpp"
 #include "opusenc-picture.hpp"
+#include "pipeline.hpp"
+#include "utils-control.hpp"
+#include "utils-ffmpeg.hpp"
 #include "utils.hpp"
 
 extern "C" {
@@ -16,105 +27,6 @@ extern "C" {
 #include <libavutil/avutil.h>
 }
 
-//
-// AVIOContext wrapper for in-memory data
-//
-
-struct BufferInput {
-  AVIOContext* avio_ctx_;
-  std::vector<uint8_t> input_;
-  size_t input_pos_ = 0;
-
-  BufferInput(const std::vector<uint8_t>& input) : input_{input} {
-    // ffmpeg internal buffer (needs to be allocated on our own initially)
-    constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
-    auto avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
-    ASSERT(avio_buffer);
-
-    // instantiate AVIOContext (`seek` doesn't seem necessary but why not)
-    avio_ctx_ =
-        avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, this,
-                           BufferInput::readPacket, NULL, BufferInput::seek);
-    ASSERT(avio_ctx_);
-  }
-
-  ~BufferInput() {
-    av_freep(&avio_ctx_->buffer);
-    avio_context_free(&avio_ctx_);
-  }
-
-  static int readPacket(void* opaque, uint8_t* buf, int buf_size) {
-    return reinterpret_cast<BufferInput*>(opaque)->readPacketImpl(buf,
-                                                                  buf_size);
-  }
-
-  int readPacketImpl(uint8_t* buf, int buf_size) {
-    int read_size = std::min<int>(buf_size, input_.size() - input_pos_);
-    if (read_size == 0) {
-      return AVERROR_EOF;
-    }
-    std::memcpy(buf, &input_[input_pos_], read_size);
-    input_pos_ += read_size;
-    return read_size;
-  }
-
-  static int64_t seek(void* opaque, int64_t offset, int whence) {
-    return reinterpret_cast<BufferInput*>(opaque)->seekImpl(offset, whence);
-  }
-
-  int64_t seekImpl(int64_t offset, int whence) {
-    // cf. io_seek in third_party/FFmpeg/tools/target_dem_fuzzer.c
-
-    if (whence == AVSEEK_SIZE) {
-      return input_.size();
-    }
-
-    if (whence == SEEK_CUR) {
-      offset += input_pos_;
-    } else if (whence == SEEK_END) {
-      offset = input_.size() - offset;
-    }
-
-    if (offset < 0 || input_.size() < (size_t)offset) {
-      return -1;
-    }
-    input_pos_ = (size_t)offset;
-    return 0;
-  }
-};
-
-struct BufferOutput {
-  AVIOContext* avio_ctx_;
-  std::vector<uint8_t> output_;
-
-  BufferOutput() {
-    // ffmpeg internal buffer (needs to be allocated on our own initially)
-    constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
-    auto avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
-    ASSERT(avio_buffer);
-
-    // instantiate AVIOContext
-    avio_ctx_ = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, this, NULL,
-                                   BufferOutput::writePacket, NULL);
-    ASSERT(avio_ctx_);
-  }
-
-  ~BufferOutput() {
-    av_freep(&avio_ctx_->buffer);
-    avio_context_free(&avio_ctx_);
-  }
-
-  static int writePacket(void* opaque, uint8_t* buf, int buf_size) {
-    return reinterpret_cast<BufferOutput*>(opaque)->writePacketImpl(buf,
-                                                                    buf_size);
-  }
-
-  int writePacketImpl(uint8_t* buf, int buf_size) {
-    output_.insert(output_.end(), buf, buf + buf_size);
-    return buf_size;
-  }
-};
-
 //
 // AVFormatContext wrapper
 //
@@ -124,6 +36,9 @@ struct FormatContext {
   AVFormatContext* ofmt_ctx_;
   BufferInput input_;
   BufferOutput output_;
+  bool fast_path_ = true;  // cf. ogg-opus-writer.hpp
+  bool loudness_ = false;  // decode side branch for R128_TRACK_GAIN
+  std::optional<loudness::Result> loudness_result_;
 
   FormatContext(const std::vector<uint8_t>& input,
                 const std::map<std::string, std::string>& metadata)
@@ -153,6 +68,8 @@ struct FormatContext {
   }
 
   void openInput(bool debug = false) {
+    STATS_SCOPE(probe);
+    utils::control::attach(ifmt_ctx_);
     ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
     ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
     if (debug) {
@@ -160,6 +77,17 @@ struct FormatContext {
     }
   }
 
+  // webm -> ogg without libavformat at all (false if `openInput/runCopy` is
+  // needed, cf. matroska-reader.hpp)
+  bool runCopyMatroska() {
+    if (!fast_path_ || loudness_) {
+      return false;
+    }
+    return matroska::copyToOggOpus(
+        input_.input_.data(), input_.input_.size(),
+        utils::mapFromAVDictionary(ofmt_ctx_->metadata), output_.output_);
+  }
+
   void runCopy() {
     // find audio stream from input
     auto stream_index =
@@ -168,6 +96,25 @@ struct FormatContext {
     AVStream* in_stream = ifmt_ctx_->streams[stream_index];
     ASSERT(in_stream);
 
+    // write ogg pages directly without libavformat muxer
+    if (fast_path_ && ogg_opus::canCopy(in_stream)) {
+      if (loudness_) {
+        runCopyLoudness(stream_index);
+        return;
+      }
+      ogg_opus::copy(ifmt_ctx_, stream_index,
+                     utils::mapFromAVDictionary(ofmt_ctx_->metadata),
+                     output_.output_);
+      return;
+    }
+
+    // OpusTags are written by avformat_write_header, so the result is only
+    // reported on this path
+    std::optional<loudness::Analyzer> analyzer;
+    if (loudness_) {
+      analyzer.emplace(in_stream->codecpar);
+    }
+
     // add audio stream to output and configure codec parameter
     AVStream* out_stream = avformat_new_stream(ofmt_ctx_, nullptr);
     ASSERT(out_stream);
@@ -176,35 +123,92 @@ struct FormatContext {
     out_stream->time_base = in_stream->time_base;
 
     // allocate AVPacket
-    AVPacket* pkt = av_packet_alloc();
-    ASSERT(pkt);
+    AVPacket* pkt = utils::allocPacket();
     DEFER {
       av_packet_free(&pkt);
     };
 
     // write header
-    ASSERT(avformat_write_header(ofmt_ctx_, nullptr) >= 0);
-
-    // copy packets
-    std::vector<uint8_t> result;
-    while (av_read_frame(ifmt_ctx_, pkt) >= 0) {
-      ASSERT(pkt->stream_index == stream_index);
-      pkt->stream_index = out_stream->index;
-      av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
-      ASSERT(av_interleaved_write_frame(ofmt_ctx_, pkt) == 0);
-      av_packet_unref(pkt);
+    ASSERT(STATS_TIMED(mux, avformat_write_header(ofmt_ctx_, nullptr)) >= 0);
+
+    // copy packets and write trailer (cf. pipeline.hpp). rescaling is only
+    // instantiated when the muxer changed the time base in
+    // avformat_write_header, the analysis tap only when requested.
+    auto copy = [&](auto rescale, auto... taps) {
+      auto chain = pipeline::makeChain(
+          pipeline::SelectStream{stream_index}, taps...,
+          pipeline::ToOutput<rescale>{out_stream->index, in_stream->time_base,
+                                      out_stream->time_base},
+          pipeline::Mux{ofmt_ctx_});
+      pipeline::run(ifmt_ctx_, pkt, chain);
+    };
+    bool rescale = av_cmp_q(in_stream->time_base, out_stream->time_base) != 0;
+    pipeline::dispatch(rescale, [&](auto rescale_ts) {
+      if (analyzer) {
+        copy(rescale_ts, pipeline::tap([&](const AVPacket* packet) {
+               analyzer->write(packet);
+             }));
+      } else {
+        copy(rescale_ts);
+      }
+    });
+    if (analyzer) {
+      loudness_result_ = analyzer->finish();
     }
-    ASSERT(av_interleaved_write_frame(ofmt_ctx_, nullptr) == 0);
+  }
 
-    // write trailer
-    av_write_trailer(ofmt_ctx_);
+  // stream copy with loudness analysis in the same demux pass. OpusTags are
+  // written with padding and R128_TRACK_GAIN is filled in at the end.
+  void runCopyLoudness(int stream_index) {
+    auto par = ifmt_ctx_->streams[stream_index]->codecpar;
+    auto par_time_base = ifmt_ctx_->streams[stream_index]->time_base;
+    std::vector<uint8_t> opus_head(par->extradata,
+                                   par->extradata + par->extradata_size);
+    auto metadata = utils::mapFromAVDictionary(ofmt_ctx_->metadata);
+    ogg_opus::Writer::Options options;
+    options.tags_padding = LOUDNESS_TAGS_PADDING;
+    ogg_opus::Writer writer{output_.output_, opus_head, metadata, options};
+    loudness::Analyzer analyzer{par};
+
+    AVPacket* pkt = utils::allocPacket();
+    DEFER {
+      av_packet_free(&pkt);
+    };
+    while (STATS_TIMED(demux, av_read_frame(ifmt_ctx_, pkt)) >= 0) {
+      if (pkt->stream_index == stream_index) {
+        STATS_ADD(packets, 1);
+        utils::control::reached(pkt, par_time_base);
+        analyzer.write(pkt);
+        STATS_SCOPE(mux);
+        writer.writePacket(pkt);
+      }
+      av_packet_unref(pkt);
+    }
+    ASSERT_OK(utils::control::check());
+    loudness_result_ = analyzer.finish();
+    STATS_SCOPE(mux);
+    writer.finish();
+
+    // e.g. "R128_TRACK_GAIN=-2253" (Q7.8 dB relative to -23 LUFS)
+    metadata["R128_TRACK_GAIN"] =
+        std::to_string(loudness_result_->r128TrackGain());
+    writer.updateTags(metadata);
   }
+
+  // room for "R128_TRACK_GAIN=-32768" and its length field
+  static constexpr size_t LOUDNESS_TAGS_PADDING = 32;
 };
 
 //
 // main
 //
 
+utils::control::Control g_control;
+
+void onSigint(int) {
+  g_control.cancel();
+}
+
 int main(int argc, const char** argv) {
   // parse arguments
   utils::Cli cli{argc, argv};
@@ -212,6 +216,11 @@ int main(int argc, const char** argv) {
   auto in_picture_file = cli.argument("--in-picture");
   auto in_metadata = cli.argument("--in-metadata");
   auto out_file = cli.argument("--out");
+  auto out_stats = cli.argument("--stats");
+  auto fast_path = cli.argument<int>("--fast-path").value_or(1);
+  auto analyze = cli.argument<int>("--loudness").value_or(0);
+  auto deadline_ms = cli.argument<double>("--deadline-ms").value_or(0);
+  auto progress_ms = cli.argument<int>("--progress-ms").value_or(0);
   if (!in_file || !out_file) {
     std::cout << cli.help() << std::endl;
     return 1;
@@ -239,11 +248,40 @@ int main(int argc, const char** argv) {
     metadata[opusenc_picture::TAG] = opusenc_picture::encode(picture_data);
   }
 
+  // cancellation, deadline and progress
+  g_control.setTimeout(deadline_ms);
+  if (progress_ms > 0) {
+    g_control.progress_interval_ = std::chrono::milliseconds(progress_ms);
+    g_control.on_progress_ = [](const utils::control::Progress& progress) {
+      std::cerr << progress.toJson().dump() << std::endl;
+      return true;
+    };
+  }
+  std::signal(SIGINT, onSigint);
+
   // process
-  FormatContext format_context{in_data, metadata};
-  format_context.openInput(true);
-  format_context.runCopy();
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    utils::control::Scope control{g_control};
+    STATS_SCOPE(total);
+    FormatContext format_context{in_data, metadata};
+    format_context.fast_path_ = fast_path;
+    format_context.loudness_ = analyze;
+    if (!format_context.runCopyMatroska()) {
+      format_context.openInput(true);
+      format_context.runCopy();
+    }
+    if (format_context.loudness_result_) {
+      std::cout << format_context.loudness_result_->toJson().dump(2)
+                << std::endl;
+    }
 
-  // write raw audio
-  utils::writeFile(out_file.value(), format_context.output_.output_);
+    // write raw audio
+    STATS_SCOPE(output_copy);
+    utils::writeFile(out_file.value(), format_context.output_.output_);
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
 }
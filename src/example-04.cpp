@@ -1,9 +1,15 @@
 // transcode audio stream (webm -> opus)
 // third_party/FFmpeg/doc/examples/transcoding.c
+// (demux/decode/encode as coroutine generators, cf. utils-generator.hpp)
 
 #include <cstring>
+#include <exception>
+#include <memory>
 #include <optional>
+#include <thread>
 #include "utils-ffmpeg.hpp"
+#include "utils-generator.hpp"
+#include "utils-queue.hpp"
 #include "utils.hpp"
 
 extern "C" {
@@ -13,40 +19,127 @@ extern "C" {
 #include <libavutil/avutil.h>
 }
 
-template <class Fn>
-void decodePacket(AVCodecContext* dec_ctx,
-                  const AVPacket* src_pkt,
-                  AVFrame* dst_frame,
-                  Fn on_frame_callback) {
-  ASSERT(avcodec_send_packet(dec_ctx, src_pkt) >= 0);
-  while (true) {
-    auto ret = avcodec_receive_frame(dec_ctx, dst_frame);
-    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-      return;
+//
+// bitrate ladder (decode once, encode on N threads)
+//
+
+// frames in flight per encoder (bounds memory when an encoder falls behind)
+constexpr size_t LADDER_QUEUE_SIZE = 32;
+
+struct LadderEncoder {
+  const int64_t bit_rate_;
+  AVCodecContext* enc_ctx_ = nullptr;
+  AVFormatContext* ofmt_ctx_ = nullptr;
+  AVStream* out_stream_ = nullptr;
+  AVPacket* pkt_ = nullptr;
+  BufferOutput output_;
+
+  // decoded frames shared with other encoders (nullptr for end of stream)
+  utils::BoundedQueue<AVFrame*> queue_{LADDER_QUEUE_SIZE};
+  std::thread thread_;
+  std::exception_ptr error_;
+  bool eof_ = false;
+  utils::stats::Stats stats_;  // merged into the main job after `finish`
+
+  LadderEncoder(int64_t bit_rate) : bit_rate_{bit_rate} {}
+
+  ~LadderEncoder() {
+    if (thread_.joinable()) {
+      queue_.push(nullptr);
+      thread_.join();
     }
-    ASSERT(ret >= 0);
-    on_frame_callback();
-    av_frame_unref(dst_frame);
+    av_packet_free(&pkt_);
+    avcodec_free_context(&enc_ctx_);
+    avformat_free_context(ofmt_ctx_);
+  }
+
+  void open(const AVCodecContext* dec_ctx) {
+    // output
+    avformat_alloc_output_context2(&ofmt_ctx_, NULL, "ogg", NULL);
+    ASSERT(ofmt_ctx_);
+    ofmt_ctx_->pb = output_.avio_ctx_;
+    ofmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    out_stream_ = avformat_new_stream(ofmt_ctx_, nullptr);
+    ASSERT(out_stream_);
+
+    // encoder (extradata is generated by encoder itself)
+    const AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_OPUS);
+    ASSERT(enc);
+    enc_ctx_ = utils::allocCodecContext(enc);
+    enc_ctx_->sample_rate = dec_ctx->sample_rate;
+    ASSERT_AV(
+        av_channel_layout_copy(&enc_ctx_->ch_layout, &dec_ctx->ch_layout));
+    enc_ctx_->sample_fmt = dec_ctx->sample_fmt;
+    enc_ctx_->time_base = {1, enc_ctx_->sample_rate};
+    enc_ctx_->bit_rate = bit_rate_;
+    enc_ctx_->strict_std_compliance = -2;
+    ASSERT_AV(avcodec_open2(enc_ctx_, enc, NULL));
+    ASSERT_AV(
+        avcodec_parameters_from_context(out_stream_->codecpar, enc_ctx_));
+
+    pkt_ = utils::allocPacket();
+
+    ASSERT_AV(STATS_TIMED(mux, avformat_write_header(ofmt_ctx_, nullptr)));
   }
-}
 
-template <class Fn>
-void encodeFrame(AVCodecContext* enc_ctx,
-                 const AVFrame* src_frame,
-                 AVPacket* dst_pkt,
-                 Fn on_packet_callback) {
-  // fails
-  ASSERT_AV(avcodec_send_frame(enc_ctx, src_frame));
-  while (true) {
-    auto ret = avcodec_receive_packet(enc_ctx, dst_pkt);
-    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-      return;
+  void start() {
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  // takes a new reference of `frame` (no sample copy)
+  void send(const AVFrame* frame) {
+    AVFrame* shared = av_frame_clone(frame);
+    ASSERT(shared);
+    queue_.push(shared);
+  }
+
+  void finish() {
+    queue_.push(nullptr);
+    thread_.join();
+    if (error_) {
+      std::rethrow_exception(error_);
     }
-    ASSERT(ret >= 0);
-    on_packet_callback();
-    av_packet_unref(dst_pkt);
   }
-}
+
+  // frames sent by the decoder until end of stream, re-chunked to the
+  // encoder's frame size with pts counted in samples (the decoder's frames
+  // are in the input's time base, cf. utils::FrameResizer)
+  utils::Generator<AVFrame*> frames() {
+    utils::FrameResizer resizer{enc_ctx_};
+    while (!eof_) {
+      AVFrame* frame = queue_.pop();
+      DEFER {
+        av_frame_free(&frame);
+      };
+      eof_ = !frame;
+      resizer.write(frame);
+      while (AVFrame* resized = resizer.read()) {
+        co_yield resized;
+      }
+    }
+  }
+
+  void run() {
+    utils::stats::JobScope job{stats_};
+    try {
+      for (AVPacket* pkt : frames() | utils::encode(enc_ctx_, pkt_)) {
+        av_packet_rescale_ts(pkt, enc_ctx_->time_base, out_stream_->time_base);
+        ASSERT_AV(STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, pkt)));
+      }
+      ASSERT_AV(
+          STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, nullptr)));
+      ASSERT_AV(STATS_TIMED(mux, av_write_trailer(ofmt_ctx_)));
+    } catch (...) {
+      error_ = std::current_exception();
+      // keep consuming so that the decoder thread doesn't block on `send`
+      while (!eof_) {
+        AVFrame* frame = queue_.pop();
+        eof_ = !frame;
+        av_frame_free(&frame);
+      }
+    }
+  }
+};
 
 struct FormatContext {
   AVFormatContext* ifmt_ctx_;
@@ -78,8 +171,11 @@ struct FormatContext {
 
   void transcode() {
     // initialize input
-    ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
-    ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
+    {
+      STATS_SCOPE(probe);
+      ASSERT(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL) == 0);
+      ASSERT(avformat_find_stream_info(ifmt_ctx_, NULL) == 0);
+    }
     av_dump_format(ifmt_ctx_, 0, NULL, 0);
     dbg(utils::mapFromAVDictionary(ifmt_ctx_->metadata));
 
@@ -93,8 +189,7 @@ struct FormatContext {
     // instantiate decoder
     const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
     ASSERT(dec);
-    AVCodecContext* dec_ctx = avcodec_alloc_context3(dec);
-    ASSERT(dec_ctx);
+    AVCodecContext* dec_ctx = utils::allocCodecContext(dec);
     DEFER {
       avcodec_free_context(&dec_ctx);
     };
@@ -108,8 +203,7 @@ struct FormatContext {
     // instantiate encoder
     const AVCodec* enc = avcodec_find_encoder(dec->id);
     ASSERT(enc);
-    AVCodecContext* enc_ctx = avcodec_alloc_context3(enc);
-    ASSERT(enc_ctx);
+    AVCodecContext* enc_ctx = utils::allocCodecContext(enc);
     DEFER {
       avcodec_free_context(&enc_ctx);
     };
@@ -127,18 +221,15 @@ struct FormatContext {
     av_dump_format(ofmt_ctx_, 0, nullptr, 1);
 
     // allocate AVFrame and AVPacket
-    AVFrame* in_frame = av_frame_alloc();
-    ASSERT(in_frame);
+    AVFrame* in_frame = utils::allocFrame();
     DEFER {
       av_frame_free(&in_frame);
     };
-    AVPacket* in_pkt = av_packet_alloc();
-    ASSERT(in_pkt);
+    AVPacket* in_pkt = utils::allocPacket();
     DEFER {
       av_packet_free(&in_pkt);
     };
-    AVPacket* out_pkt = av_packet_alloc();
-    ASSERT(out_pkt);
+    AVPacket* out_pkt = utils::allocPacket();
     DEFER {
       av_packet_free(&out_pkt);
     };
@@ -146,29 +237,78 @@ struct FormatContext {
     // write header
     // TODO: ogg/opus requires extradata to be configured?
     // https://github.com/FFmpeg/FFmpeg/blob/81bc4ef14292f77b7dcea01b00e6f2ec1aea4b32/libavformat/oggenc.c#L502-L507
-    ASSERT(avformat_write_header(ofmt_ctx_, nullptr) >= 0);
+    ASSERT(STATS_TIMED(mux, avformat_write_header(ofmt_ctx_, nullptr)) >= 0);
 
     // transcode packets
-    while (av_read_frame(ifmt_ctx_, in_pkt) >= 0) {
-      if (in_pkt->stream_index == in_stream->index) {
-        decodePacket(dec_ctx, in_pkt, in_frame, [&]() {
-          // TODO: encode and write frame
-          dbg(in_frame->pts);
-          encodeFrame(enc_ctx, in_frame, out_pkt, [&]() {
-            dbg(out_pkt->pts);
-            ASSERT(av_interleaved_write_frame(ofmt_ctx_, out_pkt) >= 0);
-          });
-        });
-      }
-      av_packet_unref(in_pkt);
+    for (AVPacket* pkt : utils::demux(ifmt_ctx_, in_pkt, in_stream->index) |
+                             utils::decode(dec_ctx, in_frame) |
+                             utils::encode(enc_ctx, out_pkt)) {
+      ASSERT(STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, pkt)) >= 0);
     }
-    encodeFrame(enc_ctx, nullptr, out_pkt, [&]() {
-      ASSERT(av_interleaved_write_frame(ofmt_ctx_, out_pkt) >= 0);
-    });
-    ASSERT(av_interleaved_write_frame(ofmt_ctx_, nullptr) == 0);
+    ASSERT(STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, nullptr)) ==
+           0);
 
     // write trailer
-    av_write_trailer(ofmt_ctx_);
+    STATS_TIMED(mux, av_write_trailer(ofmt_ctx_));
+  }
+
+  // one demux/decode pass feeding an opus encoder per bit rate
+  void transcodeLadder(std::vector<std::unique_ptr<LadderEncoder>>& encoders) {
+    // initialize input
+    {
+      STATS_SCOPE(probe);
+      ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+      ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+    }
+    av_dump_format(ifmt_ctx_, 0, NULL, 0);
+
+    // find input audio stream
+    auto stream_index =
+        av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index);
+    AVStream* in_stream = ifmt_ctx_->streams[stream_index];
+
+    // instantiate decoder
+    const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+    ASSERT(dec);
+    AVCodecContext* dec_ctx = utils::allocCodecContext(dec);
+    DEFER {
+      avcodec_free_context(&dec_ctx);
+    };
+    ASSERT_AV(avcodec_parameters_to_context(dec_ctx, in_stream->codecpar));
+    dec_ctx->pkt_timebase = in_stream->time_base;
+    ASSERT_AV(avcodec_open2(dec_ctx, dec, NULL));
+
+    // instantiate encoders
+    for (auto& encoder : encoders) {
+      encoder->open(dec_ctx);
+    }
+    for (auto& encoder : encoders) {
+      encoder->start();
+    }
+
+    // allocate AVFrame and AVPacket
+    AVFrame* in_frame = utils::allocFrame();
+    DEFER {
+      av_frame_free(&in_frame);
+    };
+    AVPacket* in_pkt = utils::allocPacket();
+    DEFER {
+      av_packet_free(&in_pkt);
+    };
+
+    // decode once and hand out references of each frame
+    for (AVFrame* frame : utils::demux(ifmt_ctx_, in_pkt, in_stream->index) |
+                              utils::decode(dec_ctx, in_frame)) {
+      for (auto& encoder : encoders) {
+        encoder->send(frame);
+      }
+    }
+
+    // flush encoders
+    for (auto& encoder : encoders) {
+      encoder->finish();
+    }
   }
 };
 
@@ -181,6 +321,8 @@ int main(int argc, const char** argv) {
   utils::Cli cli{argc, argv};
   auto in_file = cli.argument<std::string>("--in");
   auto out_file = cli.argument<std::string>("--out");
+  auto out_stats = cli.argument<std::string>("--stats");
+  auto ladder = cli.argument<std::string>("--ladder");  // e.g. 32000,64000
   if (!in_file || !out_file) {
     std::cout << cli.help() << std::endl;
     return 1;
@@ -189,10 +331,44 @@ int main(int argc, const char** argv) {
   // read data
   auto in_data = utils::readFile(in_file.value());
 
-  // transcode
-  FormatContext format_context{in_data, "ogg"};
-  format_context.transcode();
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    FormatContext format_context{in_data, "ogg"};
 
-  // write data
-  utils::writeFile(out_file.value(), format_context.output_.output_);
+    // bitrate ladder (e.g. "test.opus" -> "test-32000.opus", ...)
+    if (ladder) {
+      std::vector<std::unique_ptr<LadderEncoder>> encoders;
+      std::istringstream istr{ladder.value()};
+      for (std::string bit_rate; std::getline(istr, bit_rate, ',');) {
+        encoders.push_back(
+            std::make_unique<LadderEncoder>(std::stoll(bit_rate)));
+      }
+      ASSERT(!encoders.empty());
+      format_context.transcodeLadder(encoders);
+
+      STATS_SCOPE(output_copy);
+      auto& out = out_file.value();
+      auto ext = out.rfind('.');
+      ext = ext == std::string::npos ? out.size() : ext;
+      for (auto& encoder : encoders) {
+        stats.merge(encoder->stats_);
+        auto filename = out.substr(0, ext) + "-" +
+                        std::to_string(encoder->bit_rate_) + out.substr(ext);
+        utils::writeFile(filename, encoder->output_.output_);
+      }
+    } else {
+      // transcode
+      format_context.transcode();
+
+      // write data
+      STATS_SCOPE(output_copy);
+      utils::writeFile(out_file.value(), format_context.output_.output_);
+    }
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
 }
@@ -0,0 +1,88 @@
+// extract all audio streams (and raw previews) in a single demux pass
+//   <out-prefix>-<stream index>.opus    stream copy (opus streams)
+//   <out-prefix>-<stream index>.f32le   first channel decoded (--pcm 1)
+
+#include <cstring>
+#include "fanout.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_file = cli.argument("--in");
+  auto out_prefix = cli.argument("--out-prefix");
+  auto pcm = cli.argument<int>("--pcm").value_or(0);
+  auto out_stats = cli.argument("--stats");
+  auto fast_path = cli.argument<int>("--fast-path").value_or(1);
+  if (!in_file || !out_prefix) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // input
+    auto in_data = utils::readFile(in_file.value());
+    BufferInput input{in_data};
+    AVFormatContext* ifmt_ctx = avformat_alloc_context();
+    ASSERT(ifmt_ctx);
+    DEFER {
+      avformat_close_input(&ifmt_ctx);
+    };
+    ifmt_ctx->pb = input.avio_ctx_;
+    ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    {
+      STATS_SCOPE(probe);
+      ASSERT_AV(avformat_open_input(&ifmt_ctx, NULL, NULL, NULL));
+      ASSERT_AV(avformat_find_stream_info(ifmt_ctx, NULL));
+      av_dump_format(ifmt_ctx, 0, NULL, 0);
+    }
+
+    // sinks per audio stream
+    fanout::Pipeline pipeline{ifmt_ctx};
+    std::vector<std::pair<std::string, fanout::Sink*>> outputs;
+    auto metadata = utils::mapFromAVDictionary(ifmt_ctx->metadata);
+    for (auto stream_index : fanout::audioStreams(ifmt_ctx)) {
+      AVStream* stream = ifmt_ctx->streams[stream_index];
+      auto prefix = out_prefix.value() + "-" + std::to_string(stream_index);
+      if (stream->codecpar->codec_id == AV_CODEC_ID_OPUS) {
+        auto& sink = pipeline.add(
+            stream_index, fanout::makeCopySink(stream, metadata, fast_path));
+        outputs.push_back({prefix + ".opus", &sink});
+      } else {
+        std::cerr << "[warning] stream " << stream_index
+                  << " is not opus (skipped stream copy)" << std::endl;
+      }
+      if (pcm) {
+        auto& sink =
+            pipeline.add(stream_index, std::make_unique<fanout::DecodeSink>());
+        outputs.push_back({prefix + ".f32le", &sink});
+      }
+    }
+    ASSERT(!outputs.empty());
+
+    // process
+    pipeline.run();
+
+    // write outputs
+    STATS_SCOPE(output_copy);
+    for (auto& [filename, sink] : outputs) {
+      utils::writeFile(filename, sink->output());
+      std::cout << filename << std::endl;
+    }
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
@@ -0,0 +1,157 @@
+// mux vp9 and opus from separate inputs into single webm (stream copy)
+//   packets are merged in dts order, pulling from whichever input the merge
+//   waits for (interleave-queue.hpp)
+//   output file is written as packets are muxed, through a seekable fd so
+//   that muxer writes Cues
+
+#include <cstring>
+#include "interleave-queue.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+//
+// input with a single stream copied to output
+//
+
+struct Input {
+  BufferInput input_;
+  AVFormatContext* ifmt_ctx_;
+  int stream_index_ = -1;
+  int out_index_ = -1;
+  bool eof_ = false;
+
+  Input(const std::vector<uint8_t>& data, AVMediaType type) : input_{data} {
+    ifmt_ctx_ = avformat_alloc_context();
+    ASSERT(ifmt_ctx_);
+    ifmt_ctx_->pb = input_.avio_ctx_;
+    ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    {
+      STATS_SCOPE(probe);
+      ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+      ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+    }
+    av_dump_format(ifmt_ctx_, 0, NULL, 0);
+    stream_index_ = av_find_best_stream(ifmt_ctx_, type, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index_);
+    for (unsigned i = 0; i < ifmt_ctx_->nb_streams; i++) {
+      if ((int)i != stream_index_) {
+        ifmt_ctx_->streams[i]->discard = AVDISCARD_ALL;
+      }
+    }
+  }
+
+  ~Input() { avformat_close_input(&ifmt_ctx_); }
+
+  AVStream* stream() { return ifmt_ctx_->streams[stream_index_]; }
+};
+
+//
+// main
+//
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_video = cli.argument("--in-video");
+  auto in_audio = cli.argument("--in-audio");
+  auto out_file = cli.argument("--out");
+  auto out_stats = cli.argument("--stats");
+  if (!in_video || !in_audio || !out_file) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // inputs
+    auto video_data = utils::readFile(in_video.value());
+    auto audio_data = utils::readFile(in_audio.value());
+    Input video{video_data, AVMEDIA_TYPE_VIDEO};
+    Input audio{audio_data, AVMEDIA_TYPE_AUDIO};
+    ASSERT(video.stream()->codecpar->codec_id == AV_CODEC_ID_VP9);
+    ASSERT(audio.stream()->codecpar->codec_id == AV_CODEC_ID_OPUS);
+    Input* inputs[] = {&video, &audio};
+
+    // output
+    int out_fd = ::open(out_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(out_fd >= 0);
+    DEFER {
+      ::close(out_fd);
+    };
+    FdOutput output{out_fd, true};
+    AVFormatContext* ofmt_ctx = nullptr;
+    avformat_alloc_output_context2(&ofmt_ctx, NULL, "webm", NULL);
+    ASSERT(ofmt_ctx);
+    DEFER {
+      avformat_free_context(ofmt_ctx);
+    };
+    ofmt_ctx->pb = output.avio_ctx_;
+    ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    for (auto input : inputs) {
+      AVStream* out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+      ASSERT(out_stream);
+      ASSERT_AV(avcodec_parameters_copy(out_stream->codecpar,
+                                        input->stream()->codecpar));
+      out_stream->codecpar->codec_tag = 0;
+      out_stream->time_base = input->stream()->time_base;
+      input->out_index_ = out_stream->index;
+    }
+    ASSERT_AV(STATS_TIMED(mux, avformat_write_header(ofmt_ctx, nullptr)));
+
+    // merge packets (read from whichever input the queue is waiting for)
+    interleave::Queue queue{ofmt_ctx};
+    AVPacket* pkt = utils::allocPacket();
+    DEFER {
+      av_packet_free(&pkt);
+    };
+
+    while (true) {
+      bool running = false;
+      for (auto input : inputs) {
+        if (input->eof_ || !queue.needs(input->out_index_)) {
+          running = running || !input->eof_;
+          continue;
+        }
+        running = true;
+        int ret = STATS_TIMED(demux, av_read_frame(input->ifmt_ctx_, pkt));
+        if (ret == AVERROR_EOF) {
+          input->eof_ = true;
+          queue.setEof(input->out_index_);
+          continue;
+        }
+        ASSERT_AV(ret);
+        if (pkt->stream_index == input->stream_index_) {
+          STATS_ADD(packets, 1);
+          pkt->stream_index = input->out_index_;
+          pkt->pos = -1;
+          av_packet_rescale_ts(pkt, input->stream()->time_base,
+                               ofmt_ctx->streams[input->out_index_]->time_base);
+          queue.push(pkt);
+        }
+        av_packet_unref(pkt);
+      }
+      queue.drain();
+      if (!running) {
+        break;
+      }
+    }
+    queue.flush();
+    ASSERT_AV(STATS_TIMED(mux, av_write_trailer(ofmt_ctx)));
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
@@ -0,0 +1,91 @@
+// trim/concat opus audio by stream copy (cf. opus-edit.hpp)
+//   --in a.webm --start 10 --end 20.5   (seconds)
+//   --in a.webm,b.opus,c.webm           (concat, optionally trimmed as well)
+
+#include <cstring>
+#include <memory>
+#include "opus-edit.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+struct Input {
+  BufferInput input_;
+  AVFormatContext* ifmt_ctx_;
+  int stream_index_;
+
+  Input(const std::vector<uint8_t>& data) : input_{data} {
+    ifmt_ctx_ = avformat_alloc_context();
+    ASSERT(ifmt_ctx_);
+    ifmt_ctx_->pb = input_.avio_ctx_;
+    ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    STATS_SCOPE(probe);
+    ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+    stream_index_ =
+        av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index_);
+  }
+
+  ~Input() { avformat_close_input(&ifmt_ctx_); }
+};
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_files = cli.argument("--in");
+  auto out_file = cli.argument("--out");
+  auto start = cli.argument<double>("--start");
+  auto end = cli.argument<double>("--end");
+  auto out_stats = cli.argument("--stats");
+  if (!in_files || !out_file) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // open inputs
+    std::vector<std::vector<uint8_t>> in_data;
+    std::istringstream istr{in_files.value()};
+    for (std::string in_file; std::getline(istr, in_file, ',');) {
+      in_data.push_back(utils::readFile(in_file));
+    }
+    std::vector<std::unique_ptr<Input>> inputs;
+    std::vector<opus_edit::Source> sources;
+    for (auto& data : in_data) {
+      auto& input = inputs.emplace_back(std::make_unique<Input>(data));
+      sources.push_back({input->ifmt_ctx_, input->stream_index_});
+    }
+
+    // process
+    opus_edit::Range range;
+    if (start) {
+      range.start = opus_edit::toSamples(start.value());
+    }
+    if (end) {
+      range.end = opus_edit::toSamples(end.value());
+    }
+    std::vector<uint8_t> output;
+    opus_edit::edit(
+        sources, range,
+        utils::mapFromAVDictionary(inputs.front()->ifmt_ctx_->metadata),
+        output);
+
+    // write data
+    STATS_SCOPE(output_copy);
+    utils::writeFile(out_file.value(), output);
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
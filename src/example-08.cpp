@@ -0,0 +1,85 @@
+// split opus audio into chapters by stream copy (cf. opus-split.hpp)
+//   --in-chapters '[{ "start": 0, "metadata": { "title": "Intro" } }, ...]'
+//   (chapters of the input are used when not given)
+//   writes <out-prefix>-<chapter number>.opus
+
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include <thread>
+#include "opus-split.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_file = cli.argument("--in");
+  auto in_chapters = cli.argument("--in-chapters");
+  auto out_prefix = cli.argument("--out-prefix");
+  auto threads = cli.argument<int>("--threads").value_or(
+      std::max(1u, std::thread::hardware_concurrency()));
+  auto out_stats = cli.argument("--stats");
+  if (!in_file || !out_prefix) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // input
+    auto in_data = utils::readFile(in_file.value());
+    BufferInput input{in_data};
+    AVFormatContext* ifmt_ctx = avformat_alloc_context();
+    ASSERT(ifmt_ctx);
+    DEFER {
+      avformat_close_input(&ifmt_ctx);
+    };
+    ifmt_ctx->pb = input.avio_ctx_;
+    ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    {
+      STATS_SCOPE(probe);
+      ASSERT_AV(avformat_open_input(&ifmt_ctx, NULL, NULL, NULL));
+      ASSERT_AV(avformat_find_stream_info(ifmt_ctx, NULL));
+    }
+    av_dump_format(ifmt_ctx, 0, NULL, 0);
+    auto stream_index =
+        av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index);
+
+    // chapters
+    auto chapters =
+        in_chapters
+            ? opus_split::fromJson(nlohmann::json::parse(in_chapters.value()))
+            : opus_split::fromInput(ifmt_ctx);
+    ASSERT(!chapters.empty());
+
+    // index packets once and write chapters in parallel
+    opus_edit::Timeline timeline;
+    opus_edit::collect({{ifmt_ctx, stream_index}}, timeline);
+    auto outputs = opus_split::split(
+        timeline, chapters, utils::mapFromAVDictionary(ifmt_ctx->metadata),
+        threads);
+
+    // write data
+    STATS_SCOPE(output_copy);
+    for (size_t i = 0; i < outputs.size(); i++) {
+      auto filename =
+          out_prefix.value() + "-" + std::to_string(i + 1) + ".opus";
+      utils::writeFile(filename, outputs[i]);
+      std::cout << filename << std::endl;
+    }
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
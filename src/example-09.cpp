@@ -0,0 +1,64 @@
+// waveform peaks pyramid from a single decode (cf. waveform.hpp)
+//   --levels 256,1024,4096   (samples per bin of each level)
+
+#include <cstring>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+#include "waveform.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_file = cli.argument("--in");
+  auto out_file = cli.argument("--out");
+  auto levels = cli.argument("--levels");
+  auto out_stats = cli.argument("--stats");
+  if (!in_file || !out_file) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // input
+    auto in_data = utils::readFile(in_file.value());
+    BufferInput input{in_data};
+    AVFormatContext* ifmt_ctx = avformat_alloc_context();
+    ASSERT(ifmt_ctx);
+    DEFER {
+      avformat_close_input(&ifmt_ctx);
+    };
+    ifmt_ctx->pb = input.avio_ctx_;
+    ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    {
+      STATS_SCOPE(probe);
+      ASSERT_AV(avformat_open_input(&ifmt_ctx, NULL, NULL, NULL));
+      ASSERT_AV(avformat_find_stream_info(ifmt_ctx, NULL));
+    }
+    auto stream_index =
+        av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index);
+
+    // process
+    auto output = waveform::compute(
+        ifmt_ctx, stream_index,
+        levels ? waveform::parseLevels(levels.value())
+               : waveform::DEFAULT_LEVELS);
+
+    // write data
+    utils::writeFile(out_file.value(), output);
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
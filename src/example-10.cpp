@@ -0,0 +1,137 @@
+// near duplicate detection by acoustic fingerprint (cf. fingerprint.hpp)
+//   --in a.webm,b.opus,...  or  --in-list files.txt (one path per line)
+//   fingerprints are computed in parallel, indexed in memory and each input
+//   is queried against all others. prints json of duplicates.
+
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <thread>
+#include "fingerprint.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+std::vector<uint32_t> computeFile(const std::string& in_file) {
+  auto in_data = utils::readFile(in_file);
+  BufferInput input{in_data};
+  AVFormatContext* ifmt_ctx = avformat_alloc_context();
+  ASSERT(ifmt_ctx);
+  DEFER {
+    avformat_close_input(&ifmt_ctx);
+  };
+  ifmt_ctx->pb = input.avio_ctx_;
+  ifmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  {
+    STATS_SCOPE(probe);
+    ASSERT_AV(avformat_open_input(&ifmt_ctx, NULL, NULL, NULL));
+    ASSERT_AV(avformat_find_stream_info(ifmt_ctx, NULL));
+  }
+  auto stream_index =
+      av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  ASSERT_AV(stream_index);
+  return fingerprint::compute(ifmt_ctx, stream_index);
+}
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto in_files = cli.argument("--in");
+  auto in_list = cli.argument("--in-list");
+  auto threshold = cli.argument<double>("--threshold").value_or(0.75);
+  auto threads = cli.argument<int>("--threads").value_or(
+      std::max(1u, std::thread::hardware_concurrency()));
+  auto out_stats = cli.argument("--stats");
+  if (!in_files && !in_list) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> files;
+  if (in_files) {
+    std::istringstream istr{in_files.value()};
+    for (std::string file; std::getline(istr, file, ',');) {
+      files.push_back(file);
+    }
+  }
+  if (in_list) {
+    std::ifstream istr{in_list.value()};
+    ASSERT(istr.is_open());
+    for (std::string file; std::getline(istr, file);) {
+      if (!file.empty()) {
+        files.push_back(file);
+      }
+    }
+  }
+
+  utils::stats::Stats stats;
+  {
+    utils::stats::JobScope job{stats};
+    STATS_SCOPE(total);
+
+    // fingerprints in parallel (workers take the next file until none left)
+    std::vector<std::vector<uint32_t>> fingerprints(files.size());
+    std::atomic<size_t> next{0};
+    // (at least one, also for an empty --in-list)
+    int num_threads =
+        std::clamp<int>(threads, 1, std::max<size_t>(files.size(), 1));
+    std::vector<std::exception_ptr> errors(num_threads);
+    std::vector<utils::stats::Stats> worker_stats(num_threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < num_threads; t++) {
+      workers.emplace_back([&, t]() {
+        utils::stats::JobScope worker_job{worker_stats[t]};
+        try {
+          for (size_t i; (i = next.fetch_add(1)) < files.size();) {
+            fingerprints[i] = computeFile(files[i]);
+          }
+        } catch (...) {
+          errors[t] = std::current_exception();
+          next = files.size();
+        }
+      });
+    }
+    for (int t = 0; t < num_threads; t++) {
+      workers[t].join();
+      stats.merge(worker_stats[t]);
+    }
+    for (auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+
+    // index and query
+    fingerprint::Index index;
+    for (auto& hashes : fingerprints) {
+      index.add(hashes);
+    }
+    index.build();
+    auto result = nlohmann::json::array();
+    for (size_t i = 0; i < files.size(); i++) {
+      auto duplicates = nlohmann::json::array();
+      for (auto& match : index.query(fingerprints[i], threshold)) {
+        if (match.id != i) {
+          duplicates.push_back({{"file", files[match.id]},
+                                {"similarity", match.similarity},
+                                {"offset", match.offset}});
+        }
+      }
+      result.push_back({{"file", files[i]},
+                        {"frames", fingerprints[i].size()},
+                        {"duplicates", duplicates}});
+    }
+    std::cout << result.dump(2) << std::endl;
+  }
+  if (out_stats) {
+    stats.dump(out_stats.value());
+  }
+}
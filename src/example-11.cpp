@@ -0,0 +1,543 @@
+// conversion daemon over a unix domain socket (client is example-12)
+//   --socket /tmp/conversion.sock --workers 4 --queue 64
+//
+// - request is json { "job": "probe" | "remux" | "transcode", "metadata":
+//   {...}, "bit_rate": n, "deadline_ms": n } with input (and output) fd
+//   passed by SCM_RIGHTS (cf. unix-socket.hpp). input is mmap'ed and output
+//   is written to the fd.
+// - reply is json { "ok", "data", "latency", "stats", "control" } like
+//   emscripten-00.
+// - `--workers` threads run jobs. each keeps its packets/frames, output
+//   buffer and codec contexts across jobs (cf. utils-pool.hpp).
+// - the request is read when a connection is accepted (a peer silent for
+//   `INTAKE_TIMEOUT_S` is dropped) and the job is estimated and queued
+//   before any worker is assigned to it. waiting jobs are taken smallest
+//   estimate first, aged by `--aging` (MB/s) so that large ones aren't
+//   starved, and those beyond `--queue` waiting ones are rejected as "busy".
+// - with `--memory-budget` (MB), jobs are admitted against the budget by
+//   estimated memory, and those which don't fit are run with streaming I/O
+//   instead of buffers (cf. admission.hpp).
+// - a job taking longer than "deadline_ms" of the request (or
+//   `--deadline-ms`) since it was accepted is stopped at its next read and
+//   replied as "deadline exceeded", with how far it got in "control"
+//   (cf. utils-control.hpp)
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <thread>
+#include "admission.hpp"
+#include "matroska-reader.hpp"
+#include "ogg-opus-writer.hpp"
+#include "unix-socket.hpp"
+#include "utils-control.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils-pool.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+using Clock = std::chrono::steady_clock;
+
+inline double toMs(Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+//
+// input/output either buffered in memory or streamed through fd
+//
+
+struct Input {
+  std::optional<BufferInput> buffer_;
+  std::optional<FdInput> stream_;
+  AVFormatContext* ifmt_ctx_;
+  int stream_index_ = -1;
+
+  // whole input in memory
+  Input(const unix_socket::MappedFile& file)
+      : buffer_{std::in_place,
+                std::vector<uint8_t>(file.data_, file.data_ + file.size_)} {
+    init(buffer_->avio_ctx_);
+  }
+
+  // streaming
+  Input(int fd) : stream_{std::in_place, fd} { init(stream_->avio_ctx_); }
+
+  void init(AVIOContext* avio_ctx) {
+    ifmt_ctx_ = avformat_alloc_context();
+    ASSERT(ifmt_ctx_);
+    ifmt_ctx_->pb = avio_ctx;
+    ifmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    utils::control::attach(ifmt_ctx_);
+  }
+
+  ~Input() { avformat_close_input(&ifmt_ctx_); }
+
+  void open() {
+    STATS_SCOPE(probe);
+    ASSERT_AV(avformat_open_input(&ifmt_ctx_, NULL, NULL, NULL));
+    ASSERT_AV(avformat_find_stream_info(ifmt_ctx_, NULL));
+    stream_index_ =
+        av_find_best_stream(ifmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    ASSERT_AV(stream_index_);
+  }
+
+  AVStream* stream() { return ifmt_ctx_->streams[stream_index_]; }
+};
+
+// muxer output into `buffer` or straight to `fd` when streaming
+struct Output {
+  std::vector<uint8_t>& buffer_;
+  std::optional<BufferOutput> memory_;
+  std::optional<FdOutput> stream_;
+
+  Output(std::vector<uint8_t>& buffer, int fd, bool streaming)
+      : buffer_{buffer} {
+    if (streaming) {
+      stream_.emplace(fd);
+    } else {
+      // reuse capacity of the worker's buffer
+      memory_.emplace();
+      memory_->output_.swap(buffer_);
+    }
+  }
+
+  ~Output() {
+    if (memory_) {
+      buffer_.swap(memory_->output_);
+    }
+  }
+
+  AVIOContext* avio() {
+    return stream_ ? stream_->avio_ctx_ : memory_->avio_ctx_;
+  }
+};
+
+// what a job reads, writes and how (cf. admission.hpp)
+struct Job {
+  int in_fd;
+  int out_fd;
+  bool streaming;
+};
+
+// opus encoder following the decoder output (cf. example-04)
+utils::UniqueCodecContext openOpusEncoder(const AVCodecContext* dec_ctx,
+                                          int64_t bit_rate,
+                                          utils::BufferArena& arena) {
+  const AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_OPUS);
+  ASSERT(enc);
+  utils::UniqueCodecContext ctx{utils::allocCodecContext(enc)};
+  ctx->sample_rate = dec_ctx->sample_rate;
+  ASSERT_AV(av_channel_layout_copy(&ctx->ch_layout, &dec_ctx->ch_layout));
+  ctx->sample_fmt = dec_ctx->sample_fmt;
+  ctx->time_base = {1, ctx->sample_rate};
+  if (bit_rate > 0) {
+    ctx->bit_rate = bit_rate;
+  }
+  ctx->strict_std_compliance = -2;
+  arena.attach(ctx.get());
+  ASSERT_AV(avcodec_open2(ctx.get(), enc, NULL));
+  return ctx;
+}
+
+//
+// connection with its request, waiting for a worker
+//
+
+struct Connection {
+  unix_socket::Fd fd;
+  Clock::time_point accepted;
+  nlohmann::json request;
+  std::vector<unix_socket::Fd> fds;  // input (and output)
+};
+
+using Scheduler = admission::Scheduler<std::unique_ptr<Connection>>;
+
+//
+// worker (one job at a time)
+//
+
+struct Worker {
+  utils::ContextPool pool_;
+  std::vector<uint8_t> output_;  // capacity is kept across jobs
+  int64_t jobs_ = 0;
+  Scheduler& scheduler_;
+  double deadline_ms_;  // default of requests (0 for none)
+
+  Worker(Scheduler& scheduler, double deadline_ms)
+      : scheduler_{scheduler}, deadline_ms_{deadline_ms} {}
+
+  nlohmann::json probe(int fd) {
+    Input input{fd};
+    input.open();
+    auto ifmt_ctx = input.ifmt_ctx_;
+    auto info = nlohmann::json::object(
+        {{"format_name", ifmt_ctx->iformat->name},
+         {"duration", ifmt_ctx->duration},
+         {"bit_rate", ifmt_ctx->bit_rate},
+         {"metadata", utils::mapFromAVDictionary(ifmt_ctx->metadata)},
+         {"streams", nlohmann::json::array()}});
+    for (unsigned int i = 0; i < ifmt_ctx->nb_streams; i++) {
+      auto stream = ifmt_ctx->streams[i];
+      auto par = stream->codecpar;
+      auto type = av_get_media_type_string(par->codec_type);
+      info["streams"].push_back(nlohmann::json::object(
+          {{"type", type ? nlohmann::json(type) : nlohmann::json()},
+           {"codec", avcodec_get_name(par->codec_id)},
+           {"channels", par->ch_layout.nb_channels},
+           {"sample_rate", par->sample_rate},
+           {"metadata", utils::mapFromAVDictionary(stream->metadata)}}));
+    }
+    return info;
+  }
+
+  // copy of the mapped input when buffered, fd reads when streaming
+  std::optional<Input> openInput(const Job& job,
+                                 std::optional<unix_socket::MappedFile>& file) {
+    if (job.streaming) {
+      return std::optional<Input>{std::in_place, job.in_fd};
+    }
+    if (!file) {
+      file.emplace(job.in_fd);
+    }
+    return std::optional<Input>{std::in_place, *file};
+  }
+
+  // stream copy into ogg/opus (cf. example-03). fast paths write into
+  // `output_` so they're only taken when buffered.
+  void remux(const Job& job,
+             const std::map<std::string, std::string>& metadata) {
+    std::optional<unix_socket::MappedFile> file;
+    if (!job.streaming) {
+      file.emplace(job.in_fd);
+      if (matroska::copyToOggOpus(file->data_, file->size_, metadata,
+                                  output_)) {
+        return;
+      }
+    }
+    auto input = openInput(job, file);
+    input->open();
+    if (!job.streaming && ogg_opus::canCopy(input->stream())) {
+      ogg_opus::copy(input->ifmt_ctx_, input->stream_index_, metadata,
+                     output_);
+      return;
+    }
+
+    // libavformat muxer
+    auto pkt = pool_.packet();
+    auto ofmt = utils::makeOutputFormat("opus");
+    AVFormatContext* ofmt_ctx = ofmt.get();
+    Output output{output_, job.out_fd, job.streaming};
+    ofmt_ctx->pb = output.avio();
+    ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    for (auto& [k, v] : metadata) {
+      av_dict_set(&ofmt_ctx->metadata, k.c_str(), v.c_str(), 0);
+    }
+    AVStream* in_stream = input->stream();
+    AVStream* out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+    ASSERT(out_stream);
+    ASSERT_AV(
+        avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar));
+    out_stream->time_base = in_stream->time_base;
+    ASSERT_AV(STATS_TIMED(mux, avformat_write_header(ofmt_ctx, nullptr)));
+    AVFormatContext* ifmt_ctx = input->ifmt_ctx_;
+    while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt.get())) >= 0) {
+      DEFER {
+        av_packet_unref(pkt.get());
+      };
+      if (pkt->stream_index != input->stream_index_) {
+        continue;
+      }
+      STATS_ADD(packets, 1);
+      utils::control::reached(pkt.get(), in_stream->time_base);
+      pkt->stream_index = out_stream->index;
+      av_packet_rescale_ts(pkt.get(), in_stream->time_base,
+                           out_stream->time_base);
+      ASSERT_AV(
+          STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx, pkt.get())));
+    }
+    ASSERT_OK(utils::control::check());
+    ASSERT_AV(STATS_TIMED(mux, av_write_trailer(ofmt_ctx)));
+  }
+
+  // decode and encode into ogg/opus (cf. example-04)
+  void transcode(const Job& job, int64_t bit_rate) {
+    std::optional<unix_socket::MappedFile> file;
+    auto input = openInput(job, file);
+    input->open();
+    AVStream* in_stream = input->stream();
+    auto decoder = pool_.decoder(in_stream->codecpar);
+    AVCodecContext* dec_ctx = decoder.get();
+    dec_ctx->pkt_timebase = in_stream->time_base;  // recycled across inputs
+    auto encoder = pool_.encoder(
+        {dec_ctx->sample_rate, dec_ctx->ch_layout.nb_channels,
+         dec_ctx->sample_fmt, bit_rate},
+        [&]() { return openOpusEncoder(dec_ctx, bit_rate, pool_.arena_); });
+    AVCodecContext* enc_ctx = encoder.get();
+    auto pkt = pool_.packet();
+    auto out_pkt = pool_.packet();
+    auto frame = pool_.frame();
+    utils::FrameResizer resizer{enc_ctx, &pool_.arena_};
+
+    auto ofmt = utils::makeOutputFormat("ogg");
+    AVFormatContext* ofmt_ctx = ofmt.get();
+    Output output{output_, job.out_fd, job.streaming};
+    ofmt_ctx->pb = output.avio();
+    ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    AVStream* out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+    ASSERT(out_stream);
+    ASSERT_AV(avcodec_parameters_from_context(out_stream->codecpar, enc_ctx));
+    ASSERT_AV(STATS_TIMED(mux, avformat_write_header(ofmt_ctx, nullptr)));
+
+    auto encode = [&](const AVFrame* src) {
+      ASSERT_AV(STATS_TIMED(encode, avcodec_send_frame(enc_ctx, src)));
+      while (true) {
+        auto ret = STATS_TIMED(encode,
+                               avcodec_receive_packet(enc_ctx, out_pkt.get()));
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+          return;
+        }
+        ASSERT_AV(ret);
+        av_packet_rescale_ts(out_pkt.get(), enc_ctx->time_base,
+                             out_stream->time_base);
+        ASSERT_AV(STATS_TIMED(
+            mux, av_interleaved_write_frame(ofmt_ctx, out_pkt.get())));
+      }
+    };
+    auto decode = [&](const AVPacket* src) {
+      ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx, src)));
+      while (true) {
+        auto ret =
+            STATS_TIMED(decode, avcodec_receive_frame(dec_ctx, frame.get()));
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+          return;
+        }
+        ASSERT_AV(ret);
+        STATS_ADD(frames, 1);
+        resizer.write(frame.get());
+        av_frame_unref(frame.get());
+        while (AVFrame* resized = resizer.read()) {
+          encode(resized);
+        }
+      }
+    };
+    AVFormatContext* ifmt_ctx = input->ifmt_ctx_;
+    while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt.get())) >= 0) {
+      DEFER {
+        av_packet_unref(pkt.get());
+      };
+      if (pkt->stream_index == input->stream_index_) {
+        STATS_ADD(packets, 1);
+        utils::control::reached(pkt.get(), in_stream->time_base);
+        decode(pkt.get());
+      }
+    }
+    ASSERT_OK(utils::control::check());
+    decode(nullptr);
+    resizer.write(nullptr);
+    while (AVFrame* resized = resizer.read()) {
+      encode(resized);
+    }
+    encode(nullptr);
+    ASSERT_AV(STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx, nullptr)));
+    ASSERT_AV(STATS_TIMED(mux, av_write_trailer(ofmt_ctx)));
+  }
+
+  // `ticket` (reservation of the job) is held until the job is done
+  nlohmann::json run(const nlohmann::json& request,
+                     std::vector<unix_socket::Fd>& fds,
+                     admission::Ticket ticket,
+                     nlohmann::json& reply) {
+    auto operation =
+        admission::parseOperation(request.at("job").get<std::string>());
+    reply["admission"] = ticket.toJson();
+    if (operation == admission::Operation::probe) {
+      return probe(fds[0].get());
+    }
+
+    ASSERT(fds.size() >= 2);
+    Job job{fds[0].get(), fds[1].get(), ticket.streaming_};
+    std::map<std::string, std::string> metadata;
+    if (request.contains("metadata")) {
+      metadata = request["metadata"].get<decltype(metadata)>();
+    }
+    output_.clear();
+    if (operation == admission::Operation::remux) {
+      remux(job, metadata);
+    } else {
+      transcode(job, request.value("bit_rate", int64_t{0}));
+    }
+    if (!job.streaming) {
+      STATS_SCOPE(output_copy);
+      unix_socket::writeAll(job.out_fd, output_.data(), output_.size());
+    }
+    struct stat st;
+    ASSERT(::fstat(job.out_fd, &st) == 0);
+    return {{"bytes", st.st_size}};
+  }
+
+  void serve(Connection& connection, admission::Ticket ticket) {
+    auto& request = connection.request;
+    auto accepted = connection.accepted;
+    auto started = Clock::now();
+    nlohmann::json reply;
+    utils::stats::Stats stats;
+    utils::control::Control control;
+    control.setDeadline(accepted, request.value("deadline_ms", deadline_ms_));
+    try {
+      utils::stats::JobScope job{stats};
+      utils::control::Scope control_scope{control};
+      STATS_SCOPE(total);
+      reply["data"] =
+          run(request, connection.fds, std::move(ticket), reply);
+      reply["ok"] = true;
+    } catch (const std::exception& e) {
+      // e.g. AVERROR_EXIT of a read is reported as what stopped the job
+      reply["ok"] = false;
+      reply["data"] = control.reason_ != utils::control::Reason::none
+                          ? control.message()
+                          : e.what();
+    }
+    auto finished = Clock::now();
+    jobs_++;
+    reply["latency"] = {{"queue_ms", toMs(started - accepted)},
+                        {"run_ms", toMs(finished - started)},
+                        {"total_ms", toMs(finished - accepted)}};
+    reply["worker"] = {{"jobs", jobs_}, {"pool", pool_.toJson()}};
+    reply["scheduler"] = scheduler_.toJson();
+    reply["stats"] = stats.toJson();
+    reply["control"] = control.toJson();
+    unix_socket::send(connection.fd.get(), reply);
+  }
+};
+
+//
+// intake (on the accepting thread)
+//
+
+constexpr int INTAKE_TIMEOUT_S = 1;
+
+// reads the request of a new connection and estimates its job (none if the
+// peer closed without a request)
+std::optional<admission::Estimate> intake(Connection& connection) {
+  timeval timeout = {INTAKE_TIMEOUT_S, 0};
+  ASSERT(::setsockopt(connection.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                      sizeof(timeout)) == 0);
+  if (!unix_socket::receive(connection.fd.get(), connection.request,
+                            connection.fds)) {
+    return {};
+  }
+  auto operation = admission::parseOperation(
+      connection.request.at("job").get<std::string>());
+  ASSERT(!connection.fds.empty());
+  struct stat st;
+  ASSERT(::fstat(connection.fds[0].get(), &st) == 0);
+  return admission::estimate(operation, st.st_size);
+}
+
+//
+// main
+//
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto socket_path = cli.argument("--socket");
+  auto workers = cli.argument<int>("--workers").value_or(
+      std::max(1u, std::thread::hardware_concurrency()));
+  auto queue_size = cli.argument<int>("--queue").value_or(64);
+  auto memory_budget = cli.argument<int64_t>("--memory-budget").value_or(0);
+  auto deadline_ms = cli.argument<double>("--deadline-ms").value_or(0);
+  auto aging = cli.argument<double>("--aging").value_or(
+      admission::DEFAULT_AGING / (1 << 20));
+  if (!socket_path) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+  ASSERT(workers > 0 && queue_size > 0 && aging > 0);
+
+  // peer may go away before reply
+  std::signal(SIGPIPE, SIG_IGN);
+
+  auto server = unix_socket::listen(socket_path.value(), queue_size);
+  std::mutex log_mutex;
+  Scheduler scheduler{memory_budget << 20, static_cast<size_t>(queue_size),
+                      aging * (1 << 20)};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++) {
+    threads.emplace_back([&]() {
+      Worker worker{scheduler, deadline_ms};
+      while (true) {
+        auto [connection, ticket] = scheduler.pop();
+        try {
+          worker.serve(*connection, std::move(ticket));
+        } catch (const std::exception& e) {
+          // broken connection (job errors are replied)
+          std::lock_guard lock{log_mutex};
+          std::cerr << e.what() << std::endl;
+        }
+      }
+    });
+  }
+  std::cout << "listening on " << socket_path.value() << " (" << workers
+            << " workers)" << std::endl;
+
+  while (true) {
+    unix_socket::Fd fd{::accept4(server.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+    if (!fd) {
+      int error = errno;
+      if (error == EMFILE || error == ENFILE || error == ENOBUFS ||
+          error == ENOMEM) {
+        // out of fds/memory. the connection stays in the backlog, retry
+        // once running jobs released some
+        {
+          std::lock_guard lock{log_mutex};
+          std::cerr << "accept: " << std::strerror(error) << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      // peer gone before accept, signal
+      ASSERT(error == EINTR || error == ECONNABORTED || error == EAGAIN ||
+             error == EWOULDBLOCK || error == EPROTO);
+      continue;
+    }
+    auto connection = std::make_unique<Connection>();
+    connection->fd = std::move(fd);
+    connection->accepted = Clock::now();
+
+    // error replies here (peer may be gone already, must not take the
+    // daemon down)
+    auto reject = [&](const std::string& message) {
+      try {
+        unix_socket::send(connection->fd.get(),
+                          {{"ok", false}, {"data", message}});
+      } catch (const std::exception& e) {
+        std::lock_guard lock{log_mutex};
+        std::cerr << e.what() << std::endl;
+      }
+    };
+    std::optional<admission::Estimate> estimate;
+    try {
+      estimate = intake(*connection);
+    } catch (const std::exception& e) {
+      // e.g. malformed request or timed out
+      reject(e.what());
+      continue;
+    }
+    if (estimate && !scheduler.tryPush(*estimate, std::move(connection))) {
+      reject("busy");
+    }
+  }
+}
@@ -0,0 +1,67 @@
+// client of the conversion daemon (example-11)
+//   --socket /tmp/conversion.sock --job remux --in test.webm --out test.opus
+//   (--job probe doesn't take --out, --bit-rate is for --job transcode,
+//   --deadline-ms overrides the daemon's default)
+// files are opened here and passed as fds, then the reply json is printed
+// with the round trip time ("client_ms") added.
+
+#include <chrono>
+#include <csignal>
+#include <nlohmann/json.hpp>
+#include "unix-socket.hpp"
+#include "utils.hpp"
+
+int main(int argc, const char** argv) {
+  // parse arguments
+  utils::Cli cli{argc, argv};
+  auto socket_path = cli.argument("--socket");
+  auto job = cli.argument("--job").value_or("remux");
+  auto in_file = cli.argument("--in");
+  auto out_file = cli.argument("--out");
+  auto in_metadata = cli.argument("--in-metadata");
+  auto bit_rate = cli.argument<int64_t>("--bit-rate");
+  auto deadline_ms = cli.argument<double>("--deadline-ms");
+  if (!socket_path || !in_file || (job != "probe" && !out_file)) {
+    std::cout << cli.help() << std::endl;
+    return 1;
+  }
+  std::signal(SIGPIPE, SIG_IGN);
+
+  auto start = std::chrono::steady_clock::now();
+
+  // request
+  nlohmann::json request = {{"job", job}};
+  if (in_metadata) {
+    request["metadata"] = nlohmann::json::parse(in_metadata.value());
+  }
+  if (bit_rate) {
+    request["bit_rate"] = bit_rate.value();
+  }
+  if (deadline_ms) {
+    request["deadline_ms"] = deadline_ms.value();
+  }
+  unix_socket::Fd in_fd{::open(in_file->c_str(), O_RDONLY | O_CLOEXEC)};
+  ASSERT(in_fd);
+  std::vector<int> fds = {in_fd.get()};
+  unix_socket::Fd out_fd;
+  if (out_file) {
+    out_fd = unix_socket::Fd{::open(out_file->c_str(),
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                    0644)};
+    ASSERT(out_fd);
+    fds.push_back(out_fd.get());
+  }
+
+  // round trip
+  auto connection = unix_socket::connect(socket_path.value());
+  unix_socket::send(connection.get(), request, fds);
+  nlohmann::json reply;
+  std::vector<unix_socket::Fd> unused;
+  ASSERT(unix_socket::receive(connection.get(), reply, unused));
+
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  reply["latency"]["client_ms"] =
+      std::chrono::duration<double, std::milli>(elapsed).count();
+  std::cout << reply.dump(2) << std::endl;
+  return reply.value("ok", false) ? 0 : 1;
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+// single demux pass routed to multiple sinks per stream
+//
+// - packets are passed to every sink of its stream as is. sinks which keep
+//   packets take a new reference (av_packet_ref), so the payload is shared
+//   between sinks instead of copied
+// - streams without sinks are discarded at demuxer level
+//
+//   fanout::Pipeline pipeline{ifmt_ctx};
+//   auto& opus = pipeline.add(1, fanout::makeCopySink(stream, metadata));
+//   auto& pcm = pipeline.add(1, std::make_unique<fanout::DecodeSink>());
+//   pipeline.run();
+//   opus.output(); pcm.output();
+
+#include <map>
+#include <memory>
+#include "ogg-opus-writer.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace fanout {
+
+struct Sink {
+  virtual ~Sink() = default;
+  virtual void open(const AVStream* in_stream) = 0;
+  // `pkt` is owned by the pipeline and unref-ed after all sinks are called
+  virtual void write(const AVPacket* pkt) = 0;
+  virtual void finish() = 0;
+  virtual const std::vector<uint8_t>& output() = 0;
+};
+
+//
+// stream copy via libavformat muxer
+//
+
+struct CopySink : Sink {
+  std::string format_;
+  std::map<std::string, std::string> metadata_;
+  BufferOutput output_;
+  AVFormatContext* ofmt_ctx_ = nullptr;
+  AVPacket* pkt_ = nullptr;
+  AVRational in_time_base_;
+
+  CopySink(const std::string& format,
+           const std::map<std::string, std::string>& metadata)
+      : format_{format}, metadata_{metadata} {}
+
+  ~CopySink() {
+    av_packet_free(&pkt_);
+    avformat_free_context(ofmt_ctx_);
+  }
+
+  void open(const AVStream* in_stream) override {
+    avformat_alloc_output_context2(&ofmt_ctx_, NULL, format_.c_str(), NULL);
+    ASSERT(ofmt_ctx_);
+    ofmt_ctx_->pb = output_.avio_ctx_;
+    ofmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    for (auto& [k, v] : metadata_) {
+      av_dict_set(&ofmt_ctx_->metadata, k.c_str(), v.c_str(), 0);
+    }
+
+    AVStream* out_stream = avformat_new_stream(ofmt_ctx_, nullptr);
+    ASSERT(out_stream);
+    ASSERT_AV(
+        avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar));
+    av_dict_copy(&out_stream->metadata, in_stream->metadata, 0);  // language
+    out_stream->time_base = in_time_base_ = in_stream->time_base;
+
+    pkt_ = utils::allocPacket();
+
+    ASSERT_AV(STATS_TIMED(mux, avformat_write_header(ofmt_ctx_, nullptr)));
+  }
+
+  void write(const AVPacket* pkt) override {
+    STATS_SCOPE(mux);
+    ASSERT_AV(av_packet_ref(pkt_, pkt));
+    pkt_->stream_index = 0;
+    av_packet_rescale_ts(pkt_, in_time_base_, ofmt_ctx_->streams[0]->time_base);
+    ASSERT_AV(av_interleaved_write_frame(ofmt_ctx_, pkt_));
+  }
+
+  void finish() override {
+    STATS_SCOPE(mux);
+    ASSERT_AV(av_interleaved_write_frame(ofmt_ctx_, nullptr));
+    ASSERT_AV(av_write_trailer(ofmt_ctx_));
+  }
+
+  const std::vector<uint8_t>& output() override { return output_.output_; }
+};
+
+//
+// opus stream copy via ogg_opus::Writer
+//
+
+struct OggCopySink : Sink {
+  std::map<std::string, std::string> metadata_;
+  std::vector<uint8_t> output_;
+  std::unique_ptr<ogg_opus::Writer> writer_;
+  AVPacket* pkt_ = nullptr;
+
+  OggCopySink(const std::map<std::string, std::string>& metadata)
+      : metadata_{metadata} {}
+
+  ~OggCopySink() {
+    writer_.reset();
+    av_packet_free(&pkt_);
+  }
+
+  void open(const AVStream* in_stream) override {
+    auto par = in_stream->codecpar;
+    std::vector<uint8_t> opus_head(par->extradata,
+                                   par->extradata + par->extradata_size);
+    writer_ = std::make_unique<ogg_opus::Writer>(output_, opus_head, metadata_,
+                                                 ogg_opus::Writer::Options{});
+    pkt_ = utils::allocPacket();
+  }
+
+  void write(const AVPacket* pkt) override {
+    STATS_SCOPE(mux);
+    ASSERT_AV(av_packet_ref(pkt_, pkt));
+    writer_->writePacket(pkt_);  // takes over the new reference
+  }
+
+  void finish() override {
+    STATS_SCOPE(mux);
+    writer_->finish();
+  }
+
+  const std::vector<uint8_t>& output() override { return output_; }
+};
+
+// ogg page writer when possible (cf. ogg_opus::canCopy)
+inline std::unique_ptr<Sink> makeCopySink(
+    const AVStream* in_stream,
+    const std::map<std::string, std::string>& metadata,
+    bool fast_path = true) {
+  if (fast_path && ogg_opus::canCopy(in_stream)) {
+    return std::make_unique<OggCopySink>(metadata);
+  }
+  return std::make_unique<CopySink>("opus", metadata);
+}
+
+//
+// decode to raw samples of the first channel (cf. example-02)
+//
+
+struct DecodeSink : Sink {
+  utils::BufferArena arena_;
+  AVCodecContext* dec_ctx_ = nullptr;
+  AVFrame* frame_ = nullptr;
+  std::vector<uint8_t> output_;
+
+  ~DecodeSink() {
+    av_frame_free(&frame_);
+    avcodec_free_context(&dec_ctx_);
+  }
+
+  void open(const AVStream* in_stream) override {
+    const AVCodec* dec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+    ASSERT(dec);
+    dec_ctx_ = utils::allocCodecContext(dec);
+    ASSERT_AV(avcodec_parameters_to_context(dec_ctx_, in_stream->codecpar));
+    arena_.attach(dec_ctx_);
+    ASSERT_AV(avcodec_open2(dec_ctx_, dec, NULL));
+    frame_ = utils::allocFrame();
+  }
+
+  // decoder takes its own reference of the packet
+  void write(const AVPacket* pkt) override { decode(pkt); }
+
+  void finish() override { decode(nullptr); }
+
+  void decode(const AVPacket* pkt) {
+    ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx_, pkt)));
+    while (true) {
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx_, frame_));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      STATS_ADD(frames, 1);
+      STATS_SCOPE(output_copy);
+      auto format = static_cast<AVSampleFormat>(frame_->format);
+      size_t size = frame_->nb_samples * av_get_bytes_per_sample(format);
+      uint8_t* src = frame_->extended_data[0];
+      output_.insert(output_.end(), src, src + size);
+      av_frame_unref(frame_);
+    }
+  }
+
+  const std::vector<uint8_t>& output() override { return output_; }
+};
+
+//
+// pipeline
+//
+
+struct Pipeline {
+  AVFormatContext* ifmt_ctx_;
+  std::vector<std::vector<std::unique_ptr<Sink>>> sinks_;  // per stream
+
+  Pipeline(AVFormatContext* ifmt_ctx)
+      : ifmt_ctx_{ifmt_ctx}, sinks_(ifmt_ctx->nb_streams) {}
+
+  Sink& add(int stream_index, std::unique_ptr<Sink> sink) {
+    ASSERT(0 <= stream_index && stream_index < (int)sinks_.size());
+    sinks_[stream_index].push_back(std::move(sink));
+    return *sinks_[stream_index].back();
+  }
+
+  void run() {
+    for (size_t i = 0; i < sinks_.size(); i++) {
+      AVStream* stream = ifmt_ctx_->streams[i];
+      if (sinks_[i].empty()) {
+        stream->discard = AVDISCARD_ALL;
+      }
+      for (auto& sink : sinks_[i]) {
+        sink->open(stream);
+      }
+    }
+
+    AVPacket* pkt = utils::allocPacket();
+    DEFER {
+      av_packet_free(&pkt);
+    };
+
+    while (STATS_TIMED(demux, av_read_frame(ifmt_ctx_, pkt)) >= 0) {
+      ASSERT(pkt->stream_index < (int)sinks_.size());
+      STATS_ADD(packets, 1);
+      for (auto& sink : sinks_[pkt->stream_index]) {
+        sink->write(pkt);
+      }
+      av_packet_unref(pkt);
+    }
+
+    for (auto& sinks : sinks_) {
+      for (auto& sink : sinks) {
+        sink->finish();
+      }
+    }
+  }
+};
+
+inline std::vector<int> audioStreams(const AVFormatContext* ifmt_ctx) {
+  std::vector<int> result;
+  for (unsigned i = 0; i < ifmt_ctx->nb_streams; i++) {
+    if (ifmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+      result.push_back(i);
+    }
+  }
+  return result;
+}
+
+}  // namespace fanout
@@ -0,0 +1,334 @@
+#pragma once
+
+// acoustic fingerprint for duplicate detection (chromaprint-like)
+//
+// - decoded frames are mixed down to mono and decimated to ~12kHz (box
+//   filter), then a chroma vector (12 pitch classes of 28Hz..3.5kHz) is
+//   taken from a 4096 point real FFT (cf. spectrogram.hpp) every 1/3 frame.
+// - each chroma frame (smoothed over 4 frames) becomes a 32 bit hash of
+//   comparisons between pitch classes and with the previous frame. upper 20
+//   bits only compare within a frame and are more stable, so they are the
+//   index key.
+// - `Index` keeps a short prefix of every fingerprint and a flat sorted
+//   array of (key, position) postings. a query votes for (id, offset) by
+//   exact key match and verifies the best candidates by bit error rate, so
+//   it touches only a few postings per query hash regardless of index size
+//   (about 0.5KB per indexed fingerprint).
+//
+// https://oxygene.sk/2011/01/how-does-chromaprint-work/
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "spectrogram.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+namespace fingerprint {
+
+constexpr int TARGET_RATE = 11025;
+constexpr int FFT_SIZE = 4096;
+constexpr int HOP = FFT_SIZE / 3;
+constexpr int SMOOTHING = 4;
+constexpr double MIN_FREQ = 28;
+constexpr double MAX_FREQ = 3520;
+constexpr int KEY_SHIFT = 12;
+
+//
+// fingerprint from decoded frames
+//
+
+struct Builder {
+  int sample_rate_ = 0;
+  int decimation_ = 1;
+  std::optional<spectrogram::RealFft> fft_;
+  std::vector<int> bin_class_;  // pitch class of fft bins (-1 for unused)
+  std::vector<float> window_;
+
+  // decimated samples waiting for the next fft frame
+  std::vector<float> pending_;
+  float decimate_sum_ = 0;
+  int decimate_count_ = 0;
+
+  std::vector<float> mono_;
+  std::vector<float> frame_;
+  std::vector<float> power_;
+  std::vector<std::array<float, 12>> history_;  // last SMOOTHING chroma
+  std::array<float, 12> previous_ = {};
+  int64_t nb_chroma_ = 0;
+
+  std::vector<uint32_t> hashes_;
+
+  void addFrame(const AVFrame* frame) {
+    if (!fft_) {
+      init(frame->sample_rate);
+    }
+    ASSERT(frame->sample_rate == sample_rate_);
+    utils::mixdown(frame, mono_);
+    addSamples(mono_.data(), mono_.size());
+  }
+
+  void init(int sample_rate) {
+    sample_rate_ = sample_rate;
+    decimation_ = std::max(1, sample_rate / TARGET_RATE);
+    double rate = static_cast<double>(sample_rate) / decimation_;
+    fft_.emplace(FFT_SIZE);
+    bin_class_.assign(FFT_SIZE / 2 + 1, -1);
+    for (int k = 1; k <= FFT_SIZE / 2; k++) {
+      double freq = k * rate / FFT_SIZE;
+      if (MIN_FREQ <= freq && freq <= MAX_FREQ) {
+        auto note = std::lround(12 * std::log2(freq / 440)) + 69;
+        bin_class_[k] = static_cast<int>(note % 12);
+      }
+    }
+    for (int i = 0; i < FFT_SIZE; i++) {
+      window_.push_back(0.5 - 0.5 * std::cos(2 * M_PI * i / FFT_SIZE));
+    }
+    frame_.resize(FFT_SIZE);
+    power_.resize(FFT_SIZE / 2 + 1);
+    pending_.reserve(FFT_SIZE);
+  }
+
+  void addSamples(const float* x, int n) {
+    for (int i = 0; i < n; i++) {
+      decimate_sum_ += x[i];
+      if (++decimate_count_ == decimation_) {
+        pending_.push_back(decimate_sum_ / decimation_);
+        decimate_sum_ = 0;
+        decimate_count_ = 0;
+        if (pending_.size() == FFT_SIZE) {
+          addChroma();
+          pending_.erase(pending_.begin(), pending_.begin() + HOP);
+        }
+      }
+    }
+  }
+
+  void addChroma() {
+    for (int i = 0; i < FFT_SIZE; i++) {
+      frame_[i] = pending_[i] * window_[i];
+    }
+    fft_->power(frame_.data(), power_.data());
+    std::array<float, 12> chroma = {};
+    for (size_t k = 0; k < bin_class_.size(); k++) {
+      if (bin_class_[k] >= 0) {
+        chroma[bin_class_[k]] += power_[k];
+      }
+    }
+    float norm = 0;
+    for (auto v : chroma) {
+      norm += v * v;
+    }
+    norm = std::sqrt(norm);
+    for (auto& v : chroma) {
+      v = norm > 1e-10f ? v / norm : 0;
+    }
+
+    // moving average
+    history_.push_back(chroma);
+    if (history_.size() > SMOOTHING) {
+      history_.erase(history_.begin());
+    }
+    std::array<float, 12> smooth = {};
+    for (auto& h : history_) {
+      for (int c = 0; c < 12; c++) {
+        smooth[c] += h[c];
+      }
+    }
+    if (nb_chroma_++ > 0) {
+      hashes_.push_back(hash(smooth, previous_));
+    }
+    previous_ = smooth;
+  }
+
+  // bits 0-11: rise from previous frame
+  // bits 12-23: pitch class above next one
+  // bits 24-31: pair of classes above pair a major third up
+  static uint32_t hash(const std::array<float, 12>& s,
+                       const std::array<float, 12>& prev) {
+    uint32_t result = 0;
+    for (int c = 0; c < 12; c++) {
+      result |= uint32_t(s[c] > prev[c]) << c;
+      result |= uint32_t(s[c] > s[(c + 1) % 12]) << (12 + c);
+    }
+    for (int c = 0; c < 8; c++) {
+      float a = s[c] + s[(c + 1) % 12];
+      float b = s[(c + 4) % 12] + s[(c + 5) % 12];
+      result |= uint32_t(a > b) << (24 + c);
+    }
+    return result;
+  }
+
+  std::vector<uint32_t> finish() { return std::move(hashes_); }
+};
+
+// demux and decode `stream_index` of the input through `Builder`
+inline std::vector<uint32_t> compute(AVFormatContext* ifmt_ctx,
+                                     int stream_index) {
+  Builder builder;
+  utils::decodeStream(ifmt_ctx, stream_index, [&](const AVFrame* frame) {
+    STATS_SCOPE(analysis);
+    builder.addFrame(frame);
+  });
+  return builder.finish();
+}
+
+//
+// comparison
+//
+
+// 1 - bit error rate of `b` shifted by `offset` against `a` (0.5 for
+// unrelated audio), 0 if overlap is shorter than `min_overlap`
+inline double similarity(const uint32_t* a,
+                         size_t size_a,
+                         const uint32_t* b,
+                         size_t size_b,
+                         int offset,
+                         size_t min_overlap = 16) {
+  // a[i] vs b[i + offset]
+  int64_t begin = std::max<int64_t>(0, -offset);
+  int64_t end = std::min<int64_t>(size_a, int64_t(size_b) - offset);
+  if (end - begin < static_cast<int64_t>(min_overlap)) {
+    return 0;
+  }
+  uint64_t errors = 0;
+  for (int64_t i = begin; i < end; i++) {
+    errors += __builtin_popcount(a[i] ^ b[i + offset]);
+  }
+  return 1.0 - static_cast<double>(errors) / (32 * (end - begin));
+}
+
+//
+// in-memory index for near duplicate queries
+//
+
+struct Match {
+  uint32_t id;
+  int offset;  // frames of the indexed fingerprint before the query
+  double similarity;
+};
+
+struct IndexOptions {
+  int prefix = 64;             // indexed frames per fingerprint (~7s)
+  int stride = 2;              // posting every `stride` frames
+  int max_offset = 8;          // frames of misalignment
+  size_t max_postings = 4096;  // skip keys more common than this
+  int candidates = 8;          // verified per query
+};
+
+struct Index {
+
+  // key in upper bits and frame position in lower bits
+  struct Posting {
+    uint32_t key_pos;
+    uint32_t id;
+    bool operator<(const Posting& other) const {
+      return key_pos < other.key_pos ||
+             (key_pos == other.key_pos && id < other.id);
+    }
+  };
+  static constexpr int POS_BITS = 8;
+
+  IndexOptions options_;
+  std::vector<uint32_t> prefixes_;  // `prefix` hashes per id (zero padded)
+  std::vector<uint32_t> sizes_;
+  std::vector<Posting> postings_;
+  bool sorted_ = true;
+
+  Index(const IndexOptions& options = {}) : options_{options} {
+    ASSERT(options_.prefix + options_.max_offset < (1 << POS_BITS));
+  }
+
+  size_t size() const { return sizes_.size(); }
+
+  uint32_t add(const std::vector<uint32_t>& hashes) {
+    uint32_t id = sizes_.size();
+    size_t n = std::min<size_t>(hashes.size(), options_.prefix);
+    sizes_.push_back(n);
+    prefixes_.insert(prefixes_.end(), hashes.begin(), hashes.begin() + n);
+    prefixes_.resize(prefixes_.size() + options_.prefix - n, 0);
+    for (size_t i = 0; i < n; i += options_.stride) {
+      postings_.push_back({postingKey(hashes[i], i), id});
+    }
+    sorted_ = false;
+    return id;
+  }
+
+  // after all `add` (batch)
+  void build() {
+    std::sort(postings_.begin(), postings_.end());
+    sorted_ = true;
+  }
+
+  static uint32_t postingKey(uint32_t hash, size_t pos) {
+    return ((hash >> KEY_SHIFT) << POS_BITS) | static_cast<uint32_t>(pos);
+  }
+
+  // best matches first
+  std::vector<Match> query(const std::vector<uint32_t>& hashes,
+                           double min_similarity = 0.75) const {
+    ASSERT(sorted_);
+    size_t n = std::min<size_t>(hashes.size(),
+                                options_.prefix + options_.max_offset);
+
+    // vote for (id, offset) by exact key match
+    std::unordered_map<uint64_t, int> votes;
+    for (size_t i = 0; i < n; i++) {
+      uint32_t lo = postingKey(hashes[i], 0);
+      uint32_t hi = lo | ((1u << POS_BITS) - 1);
+      auto first = std::lower_bound(postings_.begin(), postings_.end(),
+                                    Posting{lo, 0});
+      auto last = std::upper_bound(first, postings_.end(),
+                                   Posting{hi, UINT32_MAX});
+      if (static_cast<size_t>(last - first) > options_.max_postings) {
+        continue;
+      }
+      for (auto it = first; it != last; it++) {
+        int pos = it->key_pos & ((1u << POS_BITS) - 1);
+        int offset = pos - static_cast<int>(i);
+        if (std::abs(offset) <= options_.max_offset) {
+          uint64_t key = (uint64_t(it->id) << 32) | uint32_t(offset);
+          votes[key]++;
+        }
+      }
+    }
+
+    // verify most voted candidates
+    std::vector<std::pair<int, uint64_t>> ranked;
+    for (auto& [key, count] : votes) {
+      ranked.push_back({count, key});
+    }
+    auto k = std::min<size_t>(ranked.size(), options_.candidates);
+    std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(),
+                      std::greater<>());
+    std::vector<Match> result;
+    for (size_t i = 0; i < k; i++) {
+      uint32_t id = ranked[i].second >> 32;
+      int offset = static_cast<int32_t>(ranked[i].second & 0xffffffff);
+      if (std::any_of(result.begin(), result.end(),
+                      [&](auto& m) { return m.id == id; })) {
+        continue;
+      }
+      auto s = similarity(hashes.data(), n,
+                          prefixes_.data() + size_t(id) * options_.prefix,
+                          sizes_[id], offset);
+      if (s >= min_similarity) {
+        result.push_back({id, offset, s});
+      }
+    }
+    std::sort(result.begin(), result.end(), [](auto& a, auto& b) {
+      return a.similarity > b.similarity;
+    });
+    return result;
+  }
+};
+
+}  // namespace fingerprint
@@ -0,0 +1,132 @@
+#pragma once
+
+// dts ordered merge of packets from multiple streams (pull based)
+//
+// a packet is written only when every stream still running has a packet
+// queued, so the output is interleaved in dts order. the producer reads
+// only from streams which the queue `needs` (each stream is a separate
+// input), so a stream can't run ahead of the others and at most one packet
+// per stream is ever queued. there's no memory cap to enforce (a push based
+// merge of a single badly interleaved input would need one, cf.
+// max_interleave_delta of libavformat's own interleaving).
+//
+// packets are written with `av_write_frame` so that libavformat doesn't
+// buffer again.
+
+#include <deque>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace interleave {
+
+struct Queue {
+  struct Stream {
+    std::deque<AVPacket*> packets_;
+    bool eof_ = false;
+  };
+
+  AVFormatContext* ofmt_ctx_;
+  std::vector<Stream> streams_;
+  std::vector<AVPacket*> pool_;
+
+  // after avformat_write_header (output time bases are final)
+  Queue(AVFormatContext* ofmt_ctx)
+      : ofmt_ctx_{ofmt_ctx}, streams_(ofmt_ctx->nb_streams) {}
+
+  ~Queue() {
+    for (auto& stream : streams_) {
+      for (auto& pkt : stream.packets_) {
+        av_packet_free(&pkt);
+      }
+    }
+    for (auto& pkt : pool_) {
+      av_packet_free(&pkt);
+    }
+  }
+
+  // stream needs more packets before anything can be written
+  bool needs(int stream_index) const {
+    auto& stream = streams_[stream_index];
+    return stream.packets_.empty() && !stream.eof_;
+  }
+
+  // takes over packet's reference (timestamps in output stream time base)
+  void push(AVPacket* pkt) {
+    ASSERT(0 <= pkt->stream_index && pkt->stream_index < (int)streams_.size());
+    AVPacket* owned = nullptr;
+    if (pool_.empty()) {
+      owned = utils::allocPacket();
+    } else {
+      owned = pool_.back();
+      pool_.pop_back();
+    }
+    av_packet_move_ref(owned, pkt);
+    streams_[owned->stream_index].packets_.push_back(owned);
+  }
+
+  void setEof(int stream_index) { streams_[stream_index].eof_ = true; }
+
+  // write as many packets as ordering allows
+  void drain() {
+    while (hasPacket()) {
+      for (size_t i = 0; i < streams_.size(); i++) {
+        if (needs(i)) {
+          return;
+        }
+      }
+      writeNext();
+    }
+  }
+
+  // write everything left (all streams reached eof)
+  void flush() {
+    while (hasPacket()) {
+      writeNext();
+    }
+  }
+
+  bool hasPacket() const {
+    for (auto& stream : streams_) {
+      if (!stream.packets_.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static int64_t timestamp(const AVPacket* pkt) {
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+  }
+
+  void writeNext() {
+    // stream with the smallest head dts
+    int next = -1;
+    for (size_t i = 0; i < streams_.size(); i++) {
+      if (streams_[i].packets_.empty()) {
+        continue;
+      }
+      if (next < 0 ||
+          av_compare_ts(timestamp(streams_[i].packets_.front()),
+                        ofmt_ctx_->streams[i]->time_base,
+                        timestamp(streams_[next].packets_.front()),
+                        ofmt_ctx_->streams[next]->time_base) < 0) {
+        next = i;
+      }
+    }
+    ASSERT(next >= 0);
+
+    auto& packets = streams_[next].packets_;
+    AVPacket* pkt = packets.front();
+    packets.pop_front();
+    ASSERT_AV(STATS_TIMED(mux, av_write_frame(ofmt_ctx_, pkt)));
+    av_packet_unref(pkt);
+    pool_.push_back(pkt);
+  }
+};
+
+}  // namespace interleave
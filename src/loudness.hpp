@@ -0,0 +1,492 @@
+#pragma once
+
+// EBU R128 loudness analysis (ITU-R BS.1770-4, EBU Tech 3341/3342)
+//   integrated loudness (gated), loudness range and true peak
+//
+// - K-weighting is a cascade of two biquads per channel. the recursion is
+//   serial in time but independent across channels, so channels are
+//   filtered K_LANES at a time, interleaved into lanes of a vector type, and
+//   each step of both stages is one vector op over independent per lane
+//   state.
+// - true peak uses 4x oversampling with the 48 tap polyphase FIR of
+//   BS.1770-4 Annex 2. this is the expensive part. it's computed over
+//   blocks of output samples with the taps as the outer loop, so the inner
+//   loop is a contiguous multiply-add across samples (and the per sample
+//   peak an element-wise max), which is auto-vectorized (checked with -O3
+//   -fopt-info-vec).
+// - memory grows with 2 doubles per 100ms block (gating needs all blocks).
+//
+// https://tech.ebu.ch/docs/tech/tech3341.pdf
+// https://tech.ebu.ch/docs/tech/tech3342.pdf
+// cf. third_party/FFmpeg/libavfilter/ebur128.c
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <vector>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+}
+
+namespace loudness {
+
+constexpr double REFERENCE = -23.0;  // LUFS (EBU R128, RFC 7845 5.2.1)
+constexpr double ABSOLUTE_GATE = -70.0;
+constexpr double RELATIVE_GATE = -10.0;
+constexpr double RELATIVE_GATE_RANGE = -20.0;
+
+inline double toLoudness(double energy) {
+  return -0.691 + 10 * std::log10(energy);
+}
+
+inline double toEnergy(double loudness) {
+  return std::pow(10.0, (loudness + 0.691) / 10);
+}
+
+//
+// K-weighting
+//
+
+// coefficients (transposed direct form II)
+struct Biquad {
+  double b0_, b1_, b2_, a1_, a2_;
+};
+
+// coefficients for any sample rate (cf. libebur128)
+inline std::array<Biquad, 2> kWeighting(double sample_rate) {
+  // stage 1 (high shelf)
+  double f0 = 1681.974450955533;
+  double gain = 3.999843853973347;
+  double q = 0.7071752369554196;
+  double k = std::tan(M_PI * f0 / sample_rate);
+  double vh = std::pow(10.0, gain / 20.0);
+  double vb = std::pow(vh, 0.4996667741545416);
+  double a0 = 1.0 + k / q + k * k;
+  Biquad shelf = {(vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0,
+                  (vh - vb * k / q + k * k) / a0, 2.0 * (k * k - 1.0) / a0,
+                  (1.0 - k / q + k * k) / a0};
+
+  // stage 2 (high pass)
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = std::tan(M_PI * f0 / sample_rate);
+  a0 = 1.0 + k / q + k * k;
+  Biquad highpass = {1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0,
+                     (1.0 - k / q + k * k) / a0};
+  return {shelf, highpass};
+}
+
+// doubles per 128 bit vector (SSE2, wasm simd128)
+constexpr int K_LANES = 2;
+
+// vector of K_LANES doubles (gcc/clang vector extension: arithmetic is lane
+// wise and a scalar operand is broadcast)
+typedef double Lanes __attribute__((vector_size(K_LANES * sizeof(double))));
+
+// both stages for a group of K_LANES channels (lane l is channel l of the
+// group, unused lanes are zero). the loop vectorizer can't take the
+// recursion, so lanes are explicit.
+struct KWeighting {
+  std::array<Biquad, 2> stages_;
+  Lanes z1_[2] = {};
+  Lanes z2_[2] = {};
+
+  // adds sum of squares of the output per lane to `sum`
+  void process(const Lanes* x, int n, Lanes& sum) {
+    const auto [b0, b1, b2, a1, a2] = stages_[0];
+    const auto [d0, d1, d2, c1, c2] = stages_[1];
+    Lanes s1 = z1_[0], s2 = z2_[0], t1 = z1_[1], t2 = z2_[1];
+    Lanes acc = {};
+    for (int i = 0; i < n; i++) {
+      Lanes mid = b0 * x[i] + s1;
+      s1 = b1 * x[i] - a1 * mid + s2;
+      s2 = b2 * x[i] - a2 * mid;
+      Lanes out = d0 * mid + t1;
+      t1 = d1 * mid - c1 * out + t2;
+      t2 = d2 * mid - c2 * out;
+      acc += out * out;
+    }
+    z1_[0] = s1;
+    z2_[0] = s2;
+    z1_[1] = t1;
+    z2_[1] = t2;
+    sum += acc;
+  }
+};
+
+//
+// true peak (4x oversampling)
+//
+
+constexpr int TP_PHASES = 4;
+constexpr int TP_TAPS = 12;
+
+// BS.1770-4 Annex 2 (coefficients reversed so that
+// y[4n + p] = sum_j TP_COEFFS[p][j] * x[n - 11 + j])
+constexpr float TP_COEFFS[TP_PHASES][TP_TAPS] = {
+    {-0.0083007812500, 0.0148925781250, -0.0266113281250, 0.0476074218750,
+     -0.1022949218750, 0.9721679687500, 0.1373291015625, -0.0594482421875,
+     0.0332031250000, -0.0196533203125, 0.0109863281250, 0.0017089843750},
+    {-0.0189208984375, 0.0330810546875, -0.0582275390625, 0.1015625000000,
+     -0.2003173828125, 0.7797851562500, 0.4650878906250, -0.1665039062500,
+     0.0891113281250, -0.0517578125000, 0.0292968750000, -0.0291748046875},
+    {-0.0291748046875, 0.0292968750000, -0.0517578125000, 0.0891113281250,
+     -0.1665039062500, 0.4650878906250, 0.7797851562500, -0.2003173828125,
+     0.1015625000000, -0.0582275390625, 0.0330810546875, -0.0189208984375},
+    {0.0017089843750, 0.0109863281250, -0.0196533203125, 0.0332031250000,
+     -0.0594482421875, 0.1373291015625, 0.9721679687500, -0.1022949218750,
+     0.0476074218750, -0.0266113281250, 0.0148925781250, -0.0083007812500},
+};
+
+constexpr int TP_BLOCK = 64;  // output samples per phase at a time
+
+// `x` has TP_TAPS - 1 samples of history before `n` new samples.
+// (same sums in the same order as y[i] += TP_COEFFS[p][j] * x[i + j] per
+// sample, only the loops over samples and taps are swapped)
+inline float truePeak(const float* x, int n) {
+  float peaks[TP_BLOCK] = {};
+  for (int offset = 0; offset < n; offset += TP_BLOCK) {
+    int m = std::min(TP_BLOCK, n - offset);
+    const float* block = x + offset;
+    for (int p = 0; p < TP_PHASES; p++) {
+      float y[TP_BLOCK] = {};
+      for (int j = 0; j < TP_TAPS; j++) {
+        float coeff = TP_COEFFS[p][j];
+        for (int i = 0; i < m; i++) {
+          y[i] += coeff * block[i + j];
+        }
+      }
+      for (int i = 0; i < m; i++) {
+        peaks[i] = std::max(peaks[i], std::abs(y[i]));
+      }
+    }
+  }
+  return *std::max_element(peaks, peaks + TP_BLOCK);
+}
+
+//
+// meter
+//
+
+struct Result {
+  double integrated;   // LUFS (-inf for silence)
+  double range;        // LU
+  double true_peak;    // dBTP
+  double sample_peak;  // dBFS
+
+  // Q7.8 gain to reach the reference (RFC 7845 5.2.1 R128_TRACK_GAIN)
+  int r128TrackGain() const {
+    if (!std::isfinite(integrated)) {
+      return 0;
+    }
+    auto gain = std::lround((REFERENCE - integrated) * 256);
+    return static_cast<int>(std::clamp<long>(gain, -32768, 32767));
+  }
+
+  nlohmann::json toJson() const {
+    auto number = [](double x) -> nlohmann::json {
+      return std::isfinite(x) ? nlohmann::json(x) : nlohmann::json(nullptr);
+    };
+    return {{"integrated_lufs", number(integrated)},
+            {"range_lu", number(range)},
+            {"true_peak_dbtp", number(true_peak)},
+            {"sample_peak_dbfs", number(sample_peak)},
+            {"r128_track_gain", r128TrackGain()}};
+  }
+};
+
+struct Meter {
+  static constexpr int SUBBLOCKS_MOMENTARY = 4;   // 400ms
+  static constexpr int SUBBLOCKS_SHORT_TERM = 30;  // 3s
+
+  const int sample_rate_;
+  const int channels_;
+  std::vector<double> weights_;  // padded to whole groups with 0
+  std::vector<KWeighting> groups_;  // channels K_LANES at a time
+
+  // 100ms sub-blocks of channel weighted sum of squares
+  const int subblock_size_;
+  int subblock_pos_ = 0;
+  double subblock_sum_ = 0;
+  std::array<double, SUBBLOCKS_SHORT_TERM> subblocks_ = {};
+  size_t nb_subblocks_ = 0;
+  std::vector<double> momentary_;   // mean square of 400ms blocks
+  std::vector<double> short_term_;  // mean square of 3s blocks
+
+  // true peak (oversampling is skipped for 96kHz and above)
+  const bool oversample_;
+  std::vector<std::vector<float>> history_;  // TP_TAPS - 1 per channel
+  float true_peak_ = 0;
+  float sample_peak_ = 0;
+
+  // scratch
+  std::vector<Lanes> interleaved_;  // group of K_LANES channels
+  std::vector<float> window_;
+
+  // channel weights (1.0 for front, 1.41 for surround, 0 for LFE)
+  Meter(int sample_rate, const std::vector<double>& weights)
+      : sample_rate_{sample_rate},
+        channels_{static_cast<int>(weights.size())},
+        weights_{weights},
+        subblock_size_{sample_rate / 10},
+        oversample_{sample_rate < 96000} {
+    ASSERT(sample_rate_ >= 10 && channels_ > 0);
+    int nb_groups = (channels_ + K_LANES - 1) / K_LANES;
+    weights_.resize(nb_groups * K_LANES, 0.0);
+    groups_.resize(nb_groups, KWeighting{kWeighting(sample_rate_)});
+    history_.resize(channels_, std::vector<float>(TP_TAPS - 1, 0.0f));
+  }
+
+  // planar float samples
+  void addPlanar(const float* const* planes, int nb_samples) {
+    for (int offset = 0; offset < nb_samples;) {
+      // up to the end of the current sub-block
+      int n = std::min(nb_samples - offset, subblock_size_ - subblock_pos_);
+      interleaved_.resize(n);
+      for (size_t g = 0; g < groups_.size(); g++) {
+        for (int l = 0; l < K_LANES; l++) {
+          int c = g * K_LANES + l;
+          const float* x = c < channels_ ? planes[c] + offset : nullptr;
+          for (int i = 0; i < n; i++) {
+            interleaved_[i][l] = x ? x[i] : 0;
+          }
+        }
+        Lanes sum = {};
+        groups_[g].process(interleaved_.data(), n, sum);
+        for (int l = 0; l < K_LANES; l++) {
+          subblock_sum_ += weights_[g * K_LANES + l] * sum[l];
+        }
+      }
+      subblock_pos_ += n;
+      offset += n;
+      if (subblock_pos_ == subblock_size_) {
+        finishSubblock();
+      }
+    }
+    for (int c = 0; c < channels_; c++) {
+      addPeak(c, planes[c], nb_samples);
+    }
+  }
+
+  void addPeak(int c, const float* x, int n) {
+    for (int i = 0; i < n; i++) {
+      sample_peak_ = std::max(sample_peak_, std::abs(x[i]));
+    }
+    if (!oversample_) {
+      return;
+    }
+    auto& history = history_[c];
+    window_.resize(TP_TAPS - 1 + n);
+    std::copy(history.begin(), history.end(), window_.begin());
+    std::copy(x, x + n, window_.begin() + TP_TAPS - 1);
+    true_peak_ = std::max(true_peak_, truePeak(window_.data(), n));
+    std::copy(window_.end() - (TP_TAPS - 1), window_.end(), history.begin());
+  }
+
+  void finishSubblock() {
+    subblocks_[nb_subblocks_ % SUBBLOCKS_SHORT_TERM] = subblock_sum_;
+    nb_subblocks_++;
+    subblock_sum_ = 0;
+    subblock_pos_ = 0;
+    auto meanSquare = [&](int count) {
+      double sum = 0;
+      for (int i = 1; i <= count; i++) {
+        sum += subblocks_[(nb_subblocks_ - i) % SUBBLOCKS_SHORT_TERM];
+      }
+      return sum / (static_cast<double>(count) * subblock_size_);
+    };
+    if (nb_subblocks_ >= SUBBLOCKS_MOMENTARY) {
+      momentary_.push_back(meanSquare(SUBBLOCKS_MOMENTARY));
+    }
+    if (nb_subblocks_ >= SUBBLOCKS_SHORT_TERM) {
+      short_term_.push_back(meanSquare(SUBBLOCKS_SHORT_TERM));
+    }
+  }
+
+  // mean square of blocks above absolute gate and `relative` LU below their
+  // mean (`gated` receives loudness of blocks passing both gates)
+  static double gate(const std::vector<double>& blocks,
+                     double relative,
+                     std::vector<double>* gated = nullptr) {
+    double abs_energy = toEnergy(ABSOLUTE_GATE);
+    double sum = 0;
+    size_t count = 0;
+    for (auto block : blocks) {
+      if (block > abs_energy) {
+        sum += block;
+        count++;
+      }
+    }
+    if (count == 0) {
+      return 0;
+    }
+    double rel_energy = toEnergy(toLoudness(sum / count) + relative);
+    sum = 0;
+    count = 0;
+    for (auto block : blocks) {
+      if (block > abs_energy && block > rel_energy) {
+        sum += block;
+        count++;
+        if (gated) {
+          gated->push_back(toLoudness(block));
+        }
+      }
+    }
+    return count ? sum / count : 0;
+  }
+
+  Result result() const {
+    Result result;
+    result.integrated = toLoudness(gate(momentary_, RELATIVE_GATE));
+
+    // 10th to 95th percentile of gated short-term loudness (Tech 3342)
+    std::vector<double> gated;
+    gate(short_term_, RELATIVE_GATE_RANGE, &gated);
+    result.range = 0;
+    if (!gated.empty()) {
+      std::sort(gated.begin(), gated.end());
+      auto percentile = [&](double p) {
+        return gated[std::lround(p * (gated.size() - 1))];
+      };
+      result.range = percentile(0.95) - percentile(0.10);
+    }
+
+    auto peak = oversample_ ? std::max(true_peak_, sample_peak_) : sample_peak_;
+    result.true_peak = 20 * std::log10(peak);
+    result.sample_peak = 20 * std::log10(sample_peak_);
+    return result;
+  }
+};
+
+//
+// ffmpeg glue
+//
+
+inline std::vector<double> channelWeights(const AVChannelLayout& layout) {
+  std::vector<double> result;
+  for (int i = 0; i < layout.nb_channels; i++) {
+    auto channel = av_channel_layout_channel_from_index(&layout, i);
+    switch (channel) {
+      case AV_CHAN_LOW_FREQUENCY:
+      case AV_CHAN_LOW_FREQUENCY_2:
+        result.push_back(0.0);
+        break;
+      case AV_CHAN_SIDE_LEFT:
+      case AV_CHAN_SIDE_RIGHT:
+      case AV_CHAN_BACK_LEFT:
+      case AV_CHAN_BACK_RIGHT:
+        result.push_back(1.41);
+        break;
+      default:
+        result.push_back(1.0);
+    }
+  }
+  return result;
+}
+
+// float frames (planar or interleaved)
+struct FrameMeter {
+  std::optional<Meter> meter_;
+  std::vector<std::vector<float>> planes_;
+  std::vector<const float*> pointers_;
+
+  void addFrame(const AVFrame* frame) {
+    if (!meter_) {
+      meter_.emplace(frame->sample_rate, channelWeights(frame->ch_layout));
+    }
+    auto channels = frame->ch_layout.nb_channels;
+    ASSERT(channels == meter_->channels_);
+    pointers_.resize(channels);
+    switch (frame->format) {
+      case AV_SAMPLE_FMT_FLTP: {
+        for (int c = 0; c < channels; c++) {
+          pointers_[c] =
+              reinterpret_cast<const float*>(frame->extended_data[c]);
+        }
+        break;
+      }
+      case AV_SAMPLE_FMT_FLT: {
+        // deinterleave
+        planes_.resize(channels);
+        auto src = reinterpret_cast<const float*>(frame->data[0]);
+        for (int c = 0; c < channels; c++) {
+          planes_[c].resize(frame->nb_samples);
+          for (int i = 0; i < frame->nb_samples; i++) {
+            planes_[c][i] = src[i * channels + c];
+          }
+          pointers_[c] = planes_[c].data();
+        }
+        break;
+      }
+      default: {
+        ASSERT(false && "unsupported sample format");
+      }
+    }
+    meter_->addPlanar(pointers_.data(), frame->nb_samples);
+  }
+
+  Result result() const {
+    ASSERT(meter_);
+    return meter_->result();
+  }
+};
+
+// decode side branch for stream copy (packets are only read, so the same
+// packet can be passed to a muxer afterwards)
+struct Analyzer {
+  utils::BufferArena arena_;
+  AVCodecContext* dec_ctx_ = nullptr;
+  AVFrame* frame_ = nullptr;
+  FrameMeter meter_;
+
+  Analyzer(const AVCodecParameters* par) {
+    const AVCodec* dec = avcodec_find_decoder(par->codec_id);
+    ASSERT(dec);
+    dec_ctx_ = utils::allocCodecContext(dec);
+    ASSERT_AV(avcodec_parameters_to_context(dec_ctx_, par));
+    arena_.attach(dec_ctx_);
+    ASSERT_AV(avcodec_open2(dec_ctx_, dec, NULL));
+    frame_ = utils::allocFrame();
+  }
+
+  ~Analyzer() {
+    av_frame_free(&frame_);
+    avcodec_free_context(&dec_ctx_);
+  }
+
+  Analyzer(const Analyzer&) = delete;
+  Analyzer& operator=(const Analyzer&) = delete;
+
+  // nullptr to flush
+  void write(const AVPacket* pkt) {
+    ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx_, pkt)));
+    while (true) {
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx_, frame_));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      {
+        STATS_SCOPE(analysis);
+        meter_.addFrame(frame_);
+      }
+      av_frame_unref(frame_);
+    }
+  }
+
+  Result finish() {
+    write(nullptr);
+    return meter_.result();
+  }
+};
+
+}  // namespace loudness
@@ -0,0 +1,485 @@
+#pragma once
+
+// minimal audio-only matroska/webm block reader for opus extraction
+//
+// - no probing, no seeking, no allocation (packets are views into the input)
+// - only the first opus track is read, blocks of other tracks are skipped
+//   after reading their track number
+// - anything unexpected (lacing, content encoding, several audio tracks,
+//   broken sizes, ...) is reported as failure so that caller can fall back
+//   to libavformat
+// - so is a stopped job (cf. utils-control.hpp), the fallback then fails at
+//   its first AVIO read
+//
+// https://www.matroska.org/technical/elements.html
+// https://www.matroska.org/technical/codec_specs.html (A_OPUS)
+// third_party/FFmpeg/libavformat/matroskadec.c
+
+#include <cstring>
+#include <map>
+#include <string_view>
+#include "ogg-opus-writer.hpp"
+#include "utils-control.hpp"
+#include "utils-stats.hpp"
+#include "utils.hpp"
+
+namespace matroska {
+
+// element ids (with length marker as in the spec)
+enum : uint32_t {
+  ID_EBML = 0x1A45DFA3,
+  ID_DOC_TYPE = 0x4282,
+  ID_SEGMENT = 0x18538067,
+  ID_INFO = 0x1549A966,
+  ID_TIMECODE_SCALE = 0x2AD7B1,
+  ID_TRACKS = 0x1654AE6B,
+  ID_TRACK_ENTRY = 0xAE,
+  ID_TRACK_NUMBER = 0xD7,
+  ID_TRACK_TYPE = 0x83,
+  ID_CODEC_ID = 0x86,
+  ID_CODEC_PRIVATE = 0x63A2,
+  ID_CODEC_DELAY = 0x56AA,
+  ID_CONTENT_ENCODINGS = 0x6D80,
+  ID_CLUSTER = 0x1F43B675,
+  ID_TIMECODE = 0xE7,
+  ID_SIMPLE_BLOCK = 0xA3,
+  ID_BLOCK_GROUP = 0xA0,
+  ID_BLOCK = 0xA1,
+  ID_BLOCK_DURATION = 0x9B,
+  ID_DISCARD_PADDING = 0x75A2,
+};
+
+constexpr uint64_t TRACK_TYPE_AUDIO = 2;
+constexpr uint64_t UNKNOWN_SIZE = ~uint64_t{0};
+
+struct Element {
+  uint32_t id;
+  uint64_t size;  // UNKNOWN_SIZE for "live" elements
+  size_t data;    // offset of payload
+  size_t end;     // offset after payload (clamped to parent)
+};
+
+struct AudioTrack {
+  uint64_t number = 0;
+  std::string_view codec_id;
+  std::string_view codec_private;
+  uint64_t codec_delay_ns = 0;
+};
+
+// view into input buffer
+struct Packet {
+  const uint8_t* data;
+  size_t size;
+  int64_t pts_ns;
+  int64_t discard_padding_ns;
+};
+
+struct Reader {
+  const uint8_t* data_;
+  const size_t size_;
+  size_t pos_ = 0;
+  size_t segment_end_ = 0;
+  uint64_t timecode_scale_ = 1000000;
+  uint64_t cluster_timecode_ = 0;
+  AudioTrack track_;
+  int nb_audio_tracks_ = 0;
+
+  Reader(const uint8_t* data, size_t size) : data_{data}, size_{size} {}
+
+  //
+  // ebml primitives (all return false on malformed/out of bounds input)
+  //
+
+  // `keep_marker` for ids
+  bool readVint(size_t& pos, size_t end, uint64_t& value, bool keep_marker) {
+    if (pos >= end) {
+      return false;
+    }
+    uint8_t first = data_[pos];
+    if (first == 0) {
+      return false;
+    }
+    int length = 1;
+    while (!(first & (0x80 >> (length - 1)))) {
+      length++;
+    }
+    if (pos + length > end) {
+      return false;
+    }
+    value = keep_marker ? first : first & (0xFF >> length);
+    bool all_ones = value == (0xFFu >> length);
+    for (int i = 1; i < length; i++) {
+      all_ones = all_ones && data_[pos + i] == 0xFF;
+      value = (value << 8) | data_[pos + i];
+    }
+    if (!keep_marker && all_ones) {
+      value = UNKNOWN_SIZE;
+    }
+    pos += length;
+    return true;
+  }
+
+  bool readElement(size_t pos, size_t end, Element& element) {
+    uint64_t id;
+    if (!readVint(pos, end, id, true) || id > 0xFFFFFFFF ||
+        !readVint(pos, end, element.size, false)) {
+      return false;
+    }
+    element.id = static_cast<uint32_t>(id);
+    element.data = pos;
+    if (element.size == UNKNOWN_SIZE) {
+      element.end = end;
+      return true;
+    }
+    if (element.size > end - pos) {
+      return false;
+    }
+    element.end = pos + element.size;
+    return true;
+  }
+
+  uint64_t readUint(const Element& element) {
+    uint64_t value = 0;
+    for (size_t i = element.data; i < element.end; i++) {
+      value = (value << 8) | data_[i];
+    }
+    return value;
+  }
+
+  int64_t readInt(const Element& element) {
+    if (element.data == element.end) {
+      return 0;
+    }
+    auto size = element.end - element.data;
+    auto value = readUint(element);
+    if (size < 8 && (data_[element.data] & 0x80)) {
+      value |= ~uint64_t{0} << (8 * size);  // sign extend
+    }
+    return static_cast<int64_t>(value);
+  }
+
+  std::string_view readString(const Element& element) {
+    auto str = reinterpret_cast<const char*>(data_ + element.data);
+    auto size = element.end - element.data;
+    return std::string_view{str, strnlen(str, size)};
+  }
+
+  std::string_view readBinary(const Element& element) {
+    return std::string_view{reinterpret_cast<const char*>(data_ + element.data),
+                            element.end - element.data};
+  }
+
+  //
+  // headers (until the first cluster)
+  //
+
+  bool open() {
+    Element element;
+
+    // EBML header
+    if (!readElement(0, size_, element) || element.id != ID_EBML ||
+        element.size == UNKNOWN_SIZE) {
+      return false;
+    }
+    std::string_view doc_type;
+    for (size_t pos = element.data; pos < element.end;) {
+      Element child;
+      if (!readElement(pos, element.end, child)) {
+        return false;
+      }
+      if (child.id == ID_DOC_TYPE) {
+        doc_type = readString(child);
+      }
+      pos = child.end;
+    }
+    if (doc_type != "webm" && doc_type != "matroska") {
+      return false;
+    }
+
+    // Segment
+    Element segment;
+    if (!readElement(element.end, size_, segment) ||
+        segment.id != ID_SEGMENT) {
+      return false;
+    }
+    segment_end_ = segment.end;
+
+    // top level elements until Cluster
+    for (pos_ = segment.data; pos_ < segment_end_;) {
+      if (!readElement(pos_, segment_end_, element) ||
+          element.size == UNKNOWN_SIZE) {
+        // unknown size is only expected for Cluster
+        if (element.id != ID_CLUSTER) {
+          return false;
+        }
+      }
+      if (element.id == ID_CLUSTER) {
+        break;
+      }
+      if (element.id == ID_INFO && !parseInfo(element)) {
+        return false;
+      }
+      if (element.id == ID_TRACKS && !parseTracks(element)) {
+        return false;
+      }
+      pos_ = element.end;
+    }
+    return nb_audio_tracks_ == 1 && track_.codec_id == "A_OPUS";
+  }
+
+  bool parseInfo(const Element& info) {
+    for (size_t pos = info.data; pos < info.end;) {
+      Element child;
+      if (!readElement(pos, info.end, child)) {
+        return false;
+      }
+      if (child.id == ID_TIMECODE_SCALE) {
+        timecode_scale_ = readUint(child);
+      }
+      pos = child.end;
+    }
+    return timecode_scale_ > 0;
+  }
+
+  bool parseTracks(const Element& tracks) {
+    for (size_t pos = tracks.data; pos < tracks.end;) {
+      Element entry;
+      if (!readElement(pos, tracks.end, entry)) {
+        return false;
+      }
+      pos = entry.end;
+      if (entry.id != ID_TRACK_ENTRY) {
+        continue;
+      }
+      AudioTrack track;
+      uint64_t type = 0;
+      bool encoded = false;
+      for (size_t pos2 = entry.data; pos2 < entry.end;) {
+        Element child;
+        if (!readElement(pos2, entry.end, child)) {
+          return false;
+        }
+        switch (child.id) {
+          case ID_TRACK_NUMBER:
+            track.number = readUint(child);
+            break;
+          case ID_TRACK_TYPE:
+            type = readUint(child);
+            break;
+          case ID_CODEC_ID:
+            track.codec_id = readString(child);
+            break;
+          case ID_CODEC_PRIVATE:
+            track.codec_private = readBinary(child);
+            break;
+          case ID_CODEC_DELAY:
+            track.codec_delay_ns = readUint(child);
+            break;
+          case ID_CONTENT_ENCODINGS:
+            encoded = true;
+            break;
+        }
+        pos2 = child.end;
+      }
+      if (type == TRACK_TYPE_AUDIO) {
+        nb_audio_tracks_++;
+        if (encoded) {
+          return false;
+        }
+        track_ = track;
+      }
+    }
+    return true;
+  }
+
+  //
+  // blocks
+  //
+
+  // 1: packet, 0: end of input, -1: unexpected
+  int next(Packet& packet) {
+    while (pos_ < segment_end_) {
+      Element element;
+      if (!readElement(pos_, segment_end_, element)) {
+        return -1;
+      }
+      switch (element.id) {
+        case ID_CLUSTER: {
+          // step into cluster (children are scanned in the same loop, which
+          // also handles unknown-size clusters from live encoders)
+          pos_ = element.data;
+          cluster_timecode_ = 0;
+          continue;
+        }
+        case ID_TIMECODE: {
+          cluster_timecode_ = readUint(element);
+          break;
+        }
+        case ID_SIMPLE_BLOCK: {
+          pos_ = element.end;
+          int ret = readBlock(element, 0, packet);
+          if (ret != 0) {
+            return ret;
+          }
+          continue;
+        }
+        case ID_BLOCK_GROUP: {
+          pos_ = element.end;
+          int ret = readBlockGroup(element, packet);
+          if (ret != 0) {
+            return ret;
+          }
+          continue;
+        }
+        default: {
+          if (element.size == UNKNOWN_SIZE) {
+            return -1;
+          }
+        }
+      }
+      pos_ = element.end;
+    }
+    return 0;
+  }
+
+  int readBlockGroup(const Element& group, Packet& packet) {
+    Element block{};
+    int64_t discard_padding = 0;
+    for (size_t pos = group.data; pos < group.end;) {
+      Element child;
+      if (!readElement(pos, group.end, child)) {
+        return -1;
+      }
+      if (child.id == ID_BLOCK) {
+        block = child;
+      } else if (child.id == ID_DISCARD_PADDING) {
+        discard_padding = readInt(child);
+      }
+      pos = child.end;
+    }
+    if (block.id != ID_BLOCK) {
+      return -1;
+    }
+    return readBlock(block, discard_padding, packet);
+  }
+
+  // 1: packet of our track, 0: other track
+  int readBlock(const Element& block, int64_t discard_padding, Packet& packet) {
+    size_t pos = block.data;
+    uint64_t track_number;
+    if (!readVint(pos, block.end, track_number, false)) {
+      return -1;
+    }
+    if (track_number != track_.number) {
+      return 0;
+    }
+    if (pos + 3 > block.end) {
+      return -1;
+    }
+    auto timecode = static_cast<int16_t>(data_[pos] << 8 | data_[pos + 1]);
+    uint8_t flags = data_[pos + 2];
+    pos += 3;
+    if (flags & 0x06) {
+      return -1;  // lacing
+    }
+    packet.data = data_ + pos;
+    packet.size = block.end - pos;
+    packet.pts_ns = (static_cast<int64_t>(cluster_timecode_) + timecode) *
+                    static_cast<int64_t>(timecode_scale_);
+    packet.discard_padding_ns = discard_padding;
+    return 1;
+  }
+};
+
+//
+// webm -> ogg copy without libavformat (false if caller should fall back)
+//
+
+inline bool copyToOggOpus(const uint8_t* data,
+                          size_t size,
+                          const std::map<std::string, std::string>& metadata,
+                          std::vector<uint8_t>& output,
+                          const ogg_opus::Writer::Options& options = {}) {
+  Reader reader{data, size};
+  {
+    STATS_SCOPE(probe);
+    if (!reader.open()) {
+      return false;
+    }
+  }
+  auto& head = reader.track_.codec_private;
+  if (!ogg_opus::isOpusHead(reinterpret_cast<const uint8_t*>(head.data()),
+                            head.size())) {
+    return false;
+  }
+
+  // write to temporary so that `output` is untouched on failure
+  std::vector<uint8_t> result;
+  std::vector<uint8_t> opus_head(head.begin(), head.end());
+  ogg_opus::Writer writer{result, opus_head, metadata, options};
+  Packet packet;
+  while (true) {
+    int ret = STATS_TIMED(demux, reader.next(packet));
+    if (ret < 0) {
+      return false;
+    }
+    if (ret == 0) {
+      break;
+    }
+    // no AVIO reads to stop this loop (cf. utils-control.hpp)
+    utils::control::advance(reader.pos_, size);
+    utils::control::reached(packet.pts_ns / 1e9);
+    if (utils::control::stopped()) {
+      return false;
+    }
+    if (opus_packet::packetSamples(packet.data, packet.size) < 0) {
+      return false;
+    }
+    STATS_ADD(packets, 1);
+    STATS_SCOPE(mux);
+    // same rounding as matroskadec
+    auto end_trim = av_rescale(packet.discard_padding_ns, 48000, 1000000000);
+    writer.writePacket(packet.data, packet.size,
+                       std::max<int64_t>(0, end_trim));
+  }
+  STATS_SCOPE(mux);
+  writer.finish();
+  output = std::move(result);
+  return true;
+}
+
+// TOC statistics of the opus track without decoding (cf. copyToOggOpus)
+inline bool summarizeOpus(const uint8_t* data,
+                          size_t size,
+                          opus_packet::Summary& summary) {
+  Reader reader{data, size};
+  {
+    STATS_SCOPE(probe);
+    if (!reader.open()) {
+      return false;
+    }
+  }
+  // write to temporary so that `summary` is untouched on failure
+  opus_packet::Summary result;
+  Packet packet;
+  while (true) {
+    int ret = STATS_TIMED(demux, reader.next(packet));
+    if (ret < 0) {
+      return false;
+    }
+    if (ret == 0) {
+      break;
+    }
+    utils::control::advance(reader.pos_, size);
+    utils::control::reached(packet.pts_ns / 1e9);
+    if (utils::control::stopped()) {
+      return false;
+    }
+    STATS_ADD(packets, 1);
+    result.add(packet.data, packet.size);
+  }
+  summary = result;
+  return true;
+}
+
+}  // namespace matroska
@@ -0,0 +1,437 @@
+#pragma once
+
+// direct Ogg Opus page writer for single stream copy (fast path of the
+// generic libavformat "opus" muxer)
+//
+// https://www.rfc-editor.org/rfc/rfc3533 (ogg)
+// https://www.rfc-editor.org/rfc/rfc7845 (ogg opus)
+// third_party/FFmpeg/libavformat/oggenc.c
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <map>
+#include "opus-packet.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils-result.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+}
+
+namespace ogg_opus {
+
+//
+// ogg crc (polynomial 0x04c11db7, msb first, no reflection, no final xor)
+// with slicing-by-8 tables
+//
+
+struct CrcTable {
+  uint32_t table_[8][256] = {};
+
+  constexpr CrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i << 24;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc << 1) ^ ((crc & 0x80000000u) ? 0x04c11db7u : 0);
+      }
+      table_[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+      for (int i = 0; i < 256; i++) {
+        uint32_t prev = table_[k - 1][i];
+        table_[k][i] = (prev << 8) ^ table_[0][prev >> 24];
+      }
+    }
+  }
+};
+
+inline constexpr CrcTable CRC_TABLE{};
+
+inline uint32_t crc(uint32_t crc, const uint8_t* data, size_t size) {
+  auto& t = CRC_TABLE.table_;
+  while (size >= 8) {
+    uint32_t a = crc ^ (uint32_t(data[0]) << 24 | uint32_t(data[1]) << 16 |
+                        uint32_t(data[2]) << 8 | data[3]);
+    uint32_t b = uint32_t(data[4]) << 24 | uint32_t(data[5]) << 16 |
+                 uint32_t(data[6]) << 8 | data[7];
+    crc = t[7][a >> 24] ^ t[6][(a >> 16) & 0xff] ^ t[5][(a >> 8) & 0xff] ^
+          t[4][a & 0xff] ^ t[3][b >> 24] ^ t[2][(b >> 16) & 0xff] ^
+          t[1][(b >> 8) & 0xff] ^ t[0][b & 0xff];
+    data += 8;
+    size -= 8;
+  }
+  while (size--) {
+    crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+  }
+  return crc;
+}
+
+inline void writeLE(uint8_t* dst, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    dst[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+//
+// OpusHead/OpusTags
+//
+
+constexpr size_t OPUS_HEAD_SIZE = 19;
+
+// webm CodecPrivate and ogg extradata are OpusHead already
+inline bool isOpusHead(const uint8_t* data, size_t size) {
+  return size >= OPUS_HEAD_SIZE && std::memcmp(data, "OpusHead", 8) == 0;
+}
+
+inline std::vector<uint8_t> makeOpusTags(
+    const std::string& vendor,
+    const std::map<std::string, std::string>& metadata) {
+  std::vector<uint8_t> result;
+  auto put32 = [&](uint32_t value) {
+    uint8_t bytes[4];
+    writeLE(bytes, value, 4);
+    result.insert(result.end(), bytes, bytes + 4);
+  };
+  auto putString = [&](const std::string& s) {
+    result.insert(result.end(), s.begin(), s.end());
+  };
+  putString("OpusTags");
+  put32(vendor.size());
+  putString(vendor);
+  put32(metadata.size());
+  for (auto& [k, v] : metadata) {
+    put32(k.size() + 1 + v.size());
+    putString(k);
+    putString("=");
+    putString(v);
+  }
+  return result;
+}
+
+//
+// page writer
+//
+
+struct Writer {
+  struct Options {
+    uint32_t serial = 0x4f707573;
+    int64_t page_duration = 48000;  // samples (1 second as libavformat)
+    std::string vendor = "ffmpeg-experiment";
+    size_t tags_padding = 0;  // zero bytes after comments for `updateTags`
+  };
+
+  // packet data is either owned via `pkt` or borrowed (must outlive flush)
+  struct Entry {
+    const uint8_t* data;
+    size_t size;
+    int64_t granule;  // after this packet
+    AVPacket* pkt;
+  };
+
+  static constexpr int MAX_SEGMENTS = 255;
+  static constexpr uint8_t FLAG_CONTINUED = 0x01;
+  static constexpr uint8_t FLAG_BOS = 0x02;
+  static constexpr uint8_t FLAG_EOS = 0x04;
+
+  std::vector<uint8_t>& output_;
+  Options options_;
+  uint32_t page_seq_ = 0;
+  int64_t samples_ = 0;
+  bool finished_ = false;
+
+  // OpusTags packet and its pages within output_
+  size_t tags_size_ = 0;
+  size_t tags_begin_ = 0;
+  size_t tags_end_ = 0;
+
+  std::vector<Entry> pending_;
+  int pending_segments_ = 0;
+  int64_t pending_start_granule_ = 0;
+  std::vector<AVPacket*> pkt_pool_;
+
+  // data of the page being written
+  struct Span {
+    const uint8_t* data;
+    size_t size;
+  };
+  std::vector<Span> spans_;
+
+  Writer(std::vector<uint8_t>& output,
+         const std::vector<uint8_t>& opus_head,
+         const std::map<std::string, std::string>& metadata,
+         const Options& options)
+      : output_{output}, options_{options} {
+    ASSERT(isOpusHead(opus_head.data(), opus_head.size()));
+
+    // OpusHead alone on the first page and OpusTags on its own page(s)
+    push({opus_head.data(), opus_head.size(), 0, nullptr});
+    flush(0);
+    auto tags = makeOpusTags(options_.vendor, metadata);
+    tags.resize(tags.size() + options_.tags_padding, 0);
+    tags_size_ = tags.size();
+    tags_begin_ = output_.size();
+    push({tags.data(), tags.size(), 0, nullptr});
+    flush(0);
+    tags_end_ = output_.size();
+    pending_start_granule_ = 0;
+  }
+
+  ~Writer() {
+    for (auto& entry : pending_) {
+      av_packet_free(&entry.pkt);
+    }
+    for (auto& pkt : pkt_pool_) {
+      av_packet_free(&pkt);
+    }
+  }
+
+  // takes over packet's reference
+  void writePacket(AVPacket* pkt) {
+    AVPacket* owned = nullptr;
+    if (pkt_pool_.empty()) {
+      owned = utils::allocPacket();
+    } else {
+      owned = pkt_pool_.back();
+      pkt_pool_.pop_back();
+    }
+    av_packet_move_ref(owned, pkt);
+    writePacketImpl(owned->data, owned->size, endTrim(owned), owned);
+  }
+
+  // borrowed data must be valid until `finish`
+  void writePacket(const uint8_t* data, size_t size, int64_t end_trim = 0) {
+    writePacketImpl(data, size, end_trim, nullptr);
+  }
+
+  void finish() {
+    ASSERT(!finished_);
+    finished_ = true;
+    flush(FLAG_EOS);
+  }
+
+  // rewrite OpusTags in place (e.g. with a gain known only after all packets
+  // were seen). new tags have to fit in the original size including
+  // `Options::tags_padding` (RFC 7845 5.2 allows padding after comments).
+  void updateTags(const std::map<std::string, std::string>& metadata) {
+    auto tags = makeOpusTags(options_.vendor, metadata);
+    ASSERT(tags.size() <= tags_size_);
+    tags.resize(tags_size_, 0);
+
+    // packet size is unchanged, so only page bodies and crc are updated
+    size_t offset = 0;
+    for (size_t pos = tags_begin_; pos < tags_end_;) {
+      uint8_t* header = output_.data() + pos;
+      size_t header_size = 27 + header[26];
+      size_t body_size = 0;
+      for (int i = 0; i < header[26]; i++) {
+        body_size += header[27 + i];
+      }
+      std::memcpy(header + header_size, tags.data() + offset, body_size);
+      offset += body_size;
+      writeLE(header + 22, 0, 4);
+      writeLE(header + 22, crc(0, header, header_size + body_size), 4);
+      pos += header_size + body_size;
+    }
+    ASSERT(offset == tags_size_);
+  }
+
+  static int64_t endTrim(const AVPacket* pkt) {
+    size_t size = 0;
+    auto side = av_packet_get_side_data(pkt, AV_PKT_DATA_SKIP_SAMPLES, &size);
+    if (!side || size < 8) {
+      return 0;
+    }
+    // skip_samples (le32) of the end, unsigned (clamped by writePacketImpl)
+    return static_cast<uint32_t>(AV_RL32(side + 4));
+  }
+
+  void writePacketImpl(const uint8_t* data,
+                       size_t size,
+                       int64_t end_trim,
+                       AVPacket* pkt) {
+    ASSERT(!finished_);
+    auto samples = opus_packet::packetSamples(data, size);
+    ASSERT(samples >= 0);
+
+    // keep at least one packet pending so that `finish` has a page to mark
+    int segments = size / 255 + 1;
+    bool overflow = pending_segments_ + segments > MAX_SEGMENTS;
+    bool long_enough =
+        !pending_.empty() && pending_.back().granule - pending_start_granule_ >=
+                                 options_.page_duration;
+    if (!pending_.empty() && (overflow || long_enough)) {
+      flush(0);
+    }
+
+    // granule counts decoded samples including pre-skip (RFC 7845 4.)
+    samples_ += samples;
+    int64_t granule = samples_ - std::clamp<int64_t>(end_trim, 0, samples);
+    push({data, size, granule, pkt});
+  }
+
+  void push(const Entry& entry) {
+    pending_.push_back(entry);
+    pending_segments_ += entry.size / 255 + 1;
+  }
+
+  // write all pending packets (packets larger than a page are continued on
+  // next pages) and set `flags` on the last page
+  void flush(uint8_t flags) {
+    std::array<uint8_t, 27 + MAX_SEGMENTS> header;
+
+    // nothing was written since the last page but EOS still needs a page
+    if (pending_.empty() && (flags & FLAG_EOS)) {
+      spans_.clear();
+      writePage(header.data(), 0, FLAG_EOS, pending_start_granule_, spans_);
+      return;
+    }
+
+    size_t index = 0;
+    size_t offset = 0;  // offset within pending_[index]
+    bool continued = false;
+    while (index < pending_.size()) {
+      int nb_segments = 0;
+      int64_t granule = -1;
+      bool next_continued = false;
+      spans_.clear();
+      while (index < pending_.size() && nb_segments < MAX_SEGMENTS) {
+        auto& entry = pending_[index];
+        size_t remaining = entry.size - offset;
+        size_t capacity = (MAX_SEGMENTS - nb_segments) * 255;
+        if (remaining >= capacity) {
+          // lacing values of 255 only i.e. packet continues on next page
+          // (exactly `capacity` bytes also needs a terminating 0 lacing)
+          for (int i = nb_segments; i < MAX_SEGMENTS; i++) {
+            header[27 + i] = 255;
+          }
+          spans_.push_back({entry.data + offset, capacity});
+          nb_segments = MAX_SEGMENTS;
+          offset += capacity;
+          next_continued = true;
+          break;
+        }
+        for (size_t s = remaining; s >= 255; s -= 255) {
+          header[27 + nb_segments++] = 255;
+        }
+        header[27 + nb_segments++] = remaining % 255;
+        spans_.push_back({entry.data + offset, remaining});
+        granule = entry.granule;
+        index++;
+        offset = 0;
+      }
+      bool last = index == pending_.size();
+      uint8_t page_flags = (continued ? FLAG_CONTINUED : 0) |
+                           (page_seq_ == 0 ? FLAG_BOS : 0) |
+                           (last ? (flags & FLAG_EOS) : 0);
+      writePage(header.data(), nb_segments, page_flags, granule, spans_);
+      continued = next_continued;
+    }
+
+    // recycle packets
+    for (auto& entry : pending_) {
+      if (entry.pkt) {
+        av_packet_unref(entry.pkt);
+        pkt_pool_.push_back(entry.pkt);
+      }
+    }
+    if (!pending_.empty()) {
+      pending_start_granule_ = pending_.back().granule;
+    }
+    pending_.clear();
+    pending_segments_ = 0;
+  }
+
+  void writePage(uint8_t* header,
+                 int nb_segments,
+                 uint8_t flags,
+                 int64_t granule,
+                 const std::vector<Span>& spans) {
+    std::memcpy(header, "OggS", 4);
+    header[4] = 0;  // version
+    header[5] = flags;
+    writeLE(header + 6, static_cast<uint64_t>(granule), 8);
+    writeLE(header + 14, options_.serial, 4);
+    writeLE(header + 18, page_seq_++, 4);
+    writeLE(header + 22, 0, 4);
+    header[26] = static_cast<uint8_t>(nb_segments);
+    size_t header_size = 27 + nb_segments;
+
+    uint32_t checksum = crc(0, header, header_size);
+    size_t body_size = 0;
+    for (auto& span : spans) {
+      checksum = crc(checksum, span.data, span.size);
+      body_size += span.size;
+    }
+    writeLE(header + 22, checksum, 4);
+
+    // header and packet data go straight to the output
+    output_.reserve(output_.size() + header_size + body_size);
+    output_.insert(output_.end(), header, header + header_size);
+    for (auto& span : spans) {
+      output_.insert(output_.end(), span.data, span.data + span.size);
+    }
+  }
+};
+
+//
+// stream copy (cf. `runCopy` in example-03)
+//
+
+// single opus stream with OpusHead (mapping family is passed through as is)
+inline bool canCopy(const AVStream* in_stream) {
+  auto par = in_stream->codecpar;
+  return par->codec_id == AV_CODEC_ID_OPUS &&
+         isOpusHead(par->extradata, par->extradata_size);
+}
+
+// fails on a malformed packet instead of throwing (cf. utils-result.hpp)
+inline utils::Status tryCopy(
+    AVFormatContext* ifmt_ctx,
+    int stream_index,
+    const std::map<std::string, std::string>& metadata,
+    std::vector<uint8_t>& output,
+    const Writer::Options& options = {}) {
+  auto par = ifmt_ctx->streams[stream_index]->codecpar;
+  ASSERT_OR_RETURN(isOpusHead(par->extradata, par->extradata_size));
+  std::vector<uint8_t> opus_head(par->extradata,
+                                 par->extradata + par->extradata_size);
+  Writer writer{output, opus_head, metadata, options};
+
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+  while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt)) >= 0) {
+    DEFER {
+      av_packet_unref(pkt);
+    };
+    if (pkt->stream_index == stream_index) {
+      ASSERT_OR_RETURN(opus_packet::packetSamples(pkt->data, pkt->size) >= 0);
+      STATS_ADD(packets, 1);
+      utils::control::reached(pkt, ifmt_ctx->streams[stream_index]->time_base);
+      STATS_SCOPE(mux);
+      writer.writePacket(pkt);
+    }
+  }
+  auto status = utils::control::check();
+  if (!status.ok()) {
+    return status;
+  }
+  STATS_SCOPE(mux);
+  writer.finish();
+  return {};
+}
+
+inline void copy(AVFormatContext* ifmt_ctx,
+                 int stream_index,
+                 const std::map<std::string, std::string>& metadata,
+                 std::vector<uint8_t>& output,
+                 const Writer::Options& options = {}) {
+  ASSERT_OK(tryCopy(ifmt_ctx, stream_index, metadata, output, options));
+}
+
+}  // namespace ogg_opus
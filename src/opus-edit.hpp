@@ -0,0 +1,191 @@
+#pragma once
+
+// trim and concat of opus streams by packet copy (no decode/encode)
+//
+// all packets are laid out on a single decoded sample timeline (48kHz,
+// including pre-skip of the first input). trimming keeps whole packets and
+// signals the exact cut via
+// - start: OpusHead pre-skip (plus 80ms pre-roll so that decoder converges,
+//   RFC 7845 4.3 "Seeking and Pre-Roll")
+// - end: granule position of the last page (RFC 7845 4.4 "End Trimming")
+//
+// concatenated inputs must have the same channel count and mapping. granule
+// positions continue across inputs, so timestamps are rebased implicitly.
+// pre-skip/end padding of inner boundaries cannot be expressed in a single
+// logical stream and are kept as is (a few ms of encoder delay at each join).
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "ogg-opus-writer.hpp"
+#include "opus-packet.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace opus_edit {
+
+constexpr int64_t SAMPLE_RATE = 48000;
+constexpr int64_t PRE_ROLL = 3840;  // 80ms
+
+struct Source {
+  AVFormatContext* ifmt_ctx;
+  int stream_index;
+};
+
+// playback range in samples (end < 0 for until the end)
+struct Range {
+  int64_t start = 0;
+  int64_t end = -1;
+};
+
+inline int64_t toSamples(double seconds) {
+  return std::llround(seconds * SAMPLE_RATE);
+}
+
+inline uint16_t preSkip(const std::vector<uint8_t>& opus_head) {
+  return opus_head[10] | (opus_head[11] << 8);
+}
+
+// channel count, output gain, mapping family and mapping table have to match
+// (the output has a single OpusHead, so another gain would change the level
+// of the inputs after the first)
+inline bool isCompatible(const std::vector<uint8_t>& a,
+                         const std::vector<uint8_t>& b) {
+  return a.size() == b.size() && a[9] == b[9] && a[16] == b[16] &&
+         a[17] == b[17] &&
+         std::equal(a.begin() + 18, a.end(), b.begin() + 18);
+}
+
+struct Packet {
+  AVPacket* pkt;
+  int64_t pos;  // decoded sample position of the first sample
+  int64_t samples;
+  int64_t end_trim;
+};
+
+// packets of all inputs on a single timeline (packet data is shared
+// read-only by `write`, so multiple ranges can be written concurrently)
+struct Timeline {
+  std::vector<uint8_t> opus_head;
+  std::vector<Packet> packets;
+  int64_t end = 0;  // decoded samples without end padding
+
+  Timeline() = default;
+  Timeline(const Timeline&) = delete;
+  Timeline& operator=(const Timeline&) = delete;
+
+  ~Timeline() {
+    for (auto& packet : packets) {
+      av_packet_free(&packet.pkt);
+    }
+  }
+
+  // playback samples (without pre-skip)
+  int64_t duration() const { return end - preSkip(opus_head); }
+};
+
+inline void collect(const std::vector<Source>& sources, Timeline& timeline) {
+  ASSERT(!sources.empty());
+  auto& opus_head = timeline.opus_head;
+  auto& packets = timeline.packets;
+  int64_t pos = 0;
+  for (auto& source : sources) {
+    auto par = source.ifmt_ctx->streams[source.stream_index]->codecpar;
+    ASSERT(par->codec_id == AV_CODEC_ID_OPUS);
+    ASSERT(ogg_opus::isOpusHead(par->extradata, par->extradata_size));
+    std::vector<uint8_t> head(par->extradata,
+                              par->extradata + par->extradata_size);
+    if (opus_head.empty()) {
+      opus_head = head;
+    }
+    ASSERT(isCompatible(opus_head, head));
+
+    while (true) {
+      AVPacket* pkt = utils::allocPacket();
+      auto ret = STATS_TIMED(demux, av_read_frame(source.ifmt_ctx, pkt));
+      if (ret < 0 || pkt->stream_index != source.stream_index) {
+        av_packet_free(&pkt);
+        if (ret == AVERROR_EOF) {
+          break;
+        }
+        ASSERT_AV(ret);
+        continue;
+      }
+      STATS_ADD(packets, 1);
+      packets.push_back({pkt, pos, 0, 0});
+      auto samples = opus_packet::packetSamples(pkt->data, pkt->size);
+      ASSERT(samples >= 0);
+      packets.back().samples = samples;
+      pos += samples;
+    }
+    // end padding of the last packet is only meaningful at the very end
+    if (&source == &sources.back() && !packets.empty()) {
+      auto& last = packets.back();
+      last.end_trim = ogg_opus::Writer::endTrim(last.pkt);
+    }
+  }
+  ASSERT(!packets.empty());
+  timeline.end = pos - packets.back().end_trim;
+}
+
+inline void write(const Timeline& timeline,
+                  const Range& range,
+                  const std::map<std::string, std::string>& metadata,
+                  std::vector<uint8_t>& output,
+                  const ogg_opus::Writer::Options& options = {}) {
+  auto& packets = timeline.packets;
+  auto opus_head = timeline.opus_head;
+
+  // map playback range to decoded sample positions
+  int64_t pre_skip = preSkip(opus_head);
+  int64_t total = timeline.end;
+  int64_t start = std::clamp<int64_t>(range.start + pre_skip, 0, total);
+  int64_t end = range.end < 0 ? total
+                              : std::clamp<int64_t>(range.end + pre_skip,
+                                                    start, total);
+  ASSERT(start < end);
+
+  // first packet starts at least pre-roll before the cut and last packet
+  // contains the cut (packets are sorted by `pos`)
+  auto preroll = std::max<int64_t>(0, start - PRE_ROLL);
+  auto it_first = std::partition_point(
+      packets.begin() + 1, packets.end(),
+      [&](const Packet& packet) { return packet.pos <= preroll; });
+  size_t first = it_first - packets.begin() - 1;
+  auto it_last = std::partition_point(
+      packets.begin() + first, packets.end() - 1,
+      [&](const Packet& packet) { return packet.pos + packet.samples < end; });
+  size_t last = it_last - packets.begin();
+
+  // new pre-skip (16 bits)
+  int64_t new_pre_skip = start - packets[first].pos;
+  ASSERT(new_pre_skip <= 0xffff);
+  ogg_opus::writeLE(&opus_head[10], new_pre_skip, 2);
+
+  // packet data is borrowed until `finish`
+  STATS_SCOPE(mux);
+  ogg_opus::Writer writer{output, opus_head, metadata, options};
+  for (size_t i = first; i <= last; i++) {
+    auto& packet = packets[i];
+    int64_t end_trim = i == last ? packet.pos + packet.samples - end : 0;
+    writer.writePacket(packet.pkt->data, packet.pkt->size, end_trim);
+  }
+  writer.finish();
+}
+
+inline void edit(const std::vector<Source>& sources,
+                 const Range& range,
+                 const std::map<std::string, std::string>& metadata,
+                 std::vector<uint8_t>& output,
+                 const ogg_opus::Writer::Options& options = {}) {
+  Timeline timeline;
+  collect(sources, timeline);
+  write(timeline, range, metadata, output, options);
+}
+
+}  // namespace opus_edit
@@ -0,0 +1,186 @@
+#pragma once
+
+// opus packet header parsing (TOC byte and frame count)
+// https://www.rfc-editor.org/rfc/rfc6716#section-3.1
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace opus_packet {
+
+constexpr int MAX_PACKET_SAMPLES = 5760;  // 120ms at 48kHz
+
+// samples per frame at 48kHz
+inline int frameSamples(uint8_t toc) {
+  int config = toc >> 3;
+  if (config < 12) {
+    // SILK-only (10, 20, 40, 60 ms)
+    constexpr int SILK[4] = {480, 960, 1920, 2880};
+    return SILK[config & 3];
+  }
+  if (config < 16) {
+    // hybrid (10, 20 ms)
+    return (config & 1) ? 960 : 480;
+  }
+  // CELT-only (2.5, 5, 10, 20 ms)
+  constexpr int CELT[4] = {120, 240, 480, 960};
+  return CELT[config & 3];
+}
+
+// -1 if malformed
+inline int frameCount(const uint8_t* data, size_t size) {
+  if (size < 1) {
+    return -1;
+  }
+  switch (data[0] & 3) {
+    case 0:
+      return 1;
+    case 1:
+    case 2:
+      return 2;
+    default:
+      return size < 2 ? -1 : (data[1] & 0x3f);
+  }
+}
+
+// -1 if malformed
+inline int packetSamples(const uint8_t* data, size_t size) {
+  int count = frameCount(data, size);
+  if (count <= 0) {
+    return -1;
+  }
+  int samples = count * frameSamples(data[0]);
+  return samples > MAX_PACKET_SAMPLES ? -1 : samples;
+}
+
+//
+// TOC fields (RFC 6716 3.1 Table 2)
+//
+
+enum Mode { MODE_SILK, MODE_HYBRID, MODE_CELT, MODE_SIZE };
+
+enum Bandwidth { BW_NB, BW_MB, BW_WB, BW_SWB, BW_FB, BW_SIZE };
+
+inline Mode mode(uint8_t toc) {
+  int config = toc >> 3;
+  return config < 12 ? MODE_SILK : config < 16 ? MODE_HYBRID : MODE_CELT;
+}
+
+inline Bandwidth bandwidth(uint8_t toc) {
+  int config = toc >> 3;
+  if (config < 12) {
+    return static_cast<Bandwidth>(config / 4);  // NB, MB, WB
+  }
+  if (config < 16) {
+    return config < 14 ? BW_SWB : BW_FB;
+  }
+  constexpr Bandwidth CELT[4] = {BW_NB, BW_WB, BW_SWB, BW_FB};
+  return CELT[(config - 16) / 4];
+}
+
+inline bool isStereo(uint8_t toc) {
+  return toc & 0x4;
+}
+
+//
+// per stream summary from TOC byte and frame count only (no decoding)
+//
+
+struct Summary {
+  // 2.5, 5, 10, 20, 40, 60 ms
+  static constexpr int FRAME_SIZES[6] = {120, 240, 480, 960, 1920, 2880};
+  static constexpr int BIT_RATE_BIN = 8000;  // bits per second
+  static constexpr int BIT_RATE_BINS = 64;   // last bin for >= 504kbps
+
+  int64_t packets = 0;
+  int64_t bytes = 0;
+  int64_t samples = 0;  // at 48kHz
+  int64_t malformed = 0;
+  int64_t stereo = 0;
+  std::array<int64_t, MODE_SIZE> modes = {};
+  std::array<int64_t, BW_SIZE> bandwidths = {};
+  std::array<int64_t, 6> frame_sizes = {};  // by FRAME_SIZES
+  std::array<int64_t, 49> frame_counts = {};  // frames per packet (1..48)
+  std::array<int64_t, BIT_RATE_BINS> bit_rates = {};  // per packet
+
+  void add(const uint8_t* data, size_t size) {
+    int count = frameCount(data, size);
+    int nb_samples = packetSamples(data, size);
+    if (count <= 0 || nb_samples < 0) {
+      malformed++;
+      return;
+    }
+    uint8_t toc = data[0];
+    packets++;
+    bytes += size;
+    samples += nb_samples;
+    stereo += isStereo(toc);
+    modes[mode(toc)]++;
+    bandwidths[bandwidth(toc)]++;
+    int frame_samples = frameSamples(toc);
+    for (size_t i = 0; i < frame_sizes.size(); i++) {
+      if (FRAME_SIZES[i] == frame_samples) {
+        frame_sizes[i] += count;
+      }
+    }
+    frame_counts[count]++;
+    int64_t bit_rate = int64_t(size) * 8 * 48000 / nb_samples;
+    bit_rates[std::min<int64_t>(bit_rate / BIT_RATE_BIN, BIT_RATE_BINS - 1)]++;
+  }
+
+  nlohmann::json toJson() const {
+    double seconds = samples / 48000.0;
+    auto frame_sizes_ms = nlohmann::json::object();
+    for (size_t i = 0; i < frame_sizes.size(); i++) {
+      if (frame_sizes[i] > 0) {
+        // e.g. "2.5", "20"
+        std::ostringstream key;
+        key << FRAME_SIZES[i] / 48.0;
+        frame_sizes_ms[key.str()] = frame_sizes[i];
+      }
+    }
+    auto frames_per_packet = nlohmann::json::object();
+    for (size_t i = 0; i < frame_counts.size(); i++) {
+      if (frame_counts[i] > 0) {
+        frames_per_packet[std::to_string(i)] = frame_counts[i];
+      }
+    }
+    // trailing empty bins are dropped
+    auto last = bit_rates.size();
+    while (last > 0 && bit_rates[last - 1] == 0) {
+      last--;
+    }
+    return {
+        {"packets", packets},
+        {"bytes", bytes},
+        {"malformed", malformed},
+        {"duration", seconds},
+        {"bit_rate", seconds > 0 ? bytes * 8 / seconds : 0},
+        {"modes",
+         {{"silk", modes[MODE_SILK]},
+          {"hybrid", modes[MODE_HYBRID]},
+          {"celt", modes[MODE_CELT]}}},
+        {"bandwidths",
+         {{"nb", bandwidths[BW_NB]},
+          {"mb", bandwidths[BW_MB]},
+          {"wb", bandwidths[BW_WB]},
+          {"swb", bandwidths[BW_SWB]},
+          {"fb", bandwidths[BW_FB]}}},
+        {"stereo_packets", stereo},
+        {"frame_sizes_ms", frame_sizes_ms},
+        {"frames_per_packet", frames_per_packet},
+        {"bit_rate_histogram",
+         {{"bin", BIT_RATE_BIN},
+          {"counts", std::vector<int64_t>(bit_rates.begin(),
+                                          bit_rates.begin() + last)}}},
+    };
+  }
+};
+
+}  // namespace opus_packet
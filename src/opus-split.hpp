@@ -0,0 +1,144 @@
+#pragma once
+
+// split opus audio into chapters by stream copy
+//
+// packets are indexed once (opus_edit::collect) and every chapter is then
+// written from the shared packet data in parallel (opus_edit::write only
+// reads the timeline). each output gets its own OpusTags from the common
+// metadata overridden by the chapter's metadata.
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <nlohmann/json.hpp>
+#include <thread>
+#include "opus-edit.hpp"
+#include "utils-stats.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+}
+
+namespace opus_split {
+
+struct Chapter {
+  opus_edit::Range range;  // end < 0 for until next chapter or the end
+  std::map<std::string, std::string> metadata;
+};
+
+// chapters embedded in input (e.g. matroska Chapters, ogg CHAPTERxx tags)
+inline std::vector<Chapter> fromInput(const AVFormatContext* ifmt_ctx) {
+  std::vector<Chapter> result;
+  for (unsigned i = 0; i < ifmt_ctx->nb_chapters; i++) {
+    auto chapter = ifmt_ctx->chapters[i];
+    AVRational samples = {1, opus_edit::SAMPLE_RATE};
+    auto& entry = result.emplace_back();
+    entry.range.start =
+        av_rescale_q(chapter->start, chapter->time_base, samples);
+    entry.range.end = av_rescale_q(chapter->end, chapter->time_base, samples);
+    entry.metadata = utils::mapFromAVDictionary(chapter->metadata);
+  }
+  return result;
+}
+
+// [{ "start": 0, "end": 60.5, "metadata": { "title": "..." } }, ...] in
+// seconds ("end" is optional)
+inline std::vector<Chapter> fromJson(const nlohmann::json& data) {
+  ASSERT(data.is_array());
+  std::vector<Chapter> result;
+  for (auto& item : data) {
+    auto& entry = result.emplace_back();
+    entry.range.start = opus_edit::toSamples(item.at("start").get<double>());
+    if (item.contains("end")) {
+      entry.range.end = opus_edit::toSamples(item["end"].get<double>());
+    }
+    if (item.contains("metadata")) {
+      for (auto& prop : item["metadata"].items()) {
+        entry.metadata[prop.key()] = prop.value().get<std::string>();
+      }
+    }
+  }
+  return result;
+}
+
+// `num_threads <= 1` writes on the calling thread (e.g. emscripten without
+// pthread). stats of worker threads are merged into the current job.
+inline std::vector<std::vector<uint8_t>> split(
+    const opus_edit::Timeline& timeline,
+    std::vector<Chapter> chapters,
+    const std::map<std::string, std::string>& metadata,
+    int num_threads) {
+  // open ended chapters until next chapter's start
+  std::stable_sort(chapters.begin(), chapters.end(), [](auto& a, auto& b) {
+    return a.range.start < b.range.start;
+  });
+  for (size_t i = 0; i + 1 < chapters.size(); i++) {
+    if (chapters[i].range.end < 0) {
+      chapters[i].range.end = chapters[i + 1].range.start;
+    }
+  }
+
+  // per chapter OpusTags
+  std::vector<std::map<std::string, std::string>> tags(chapters.size());
+  for (size_t i = 0; i < chapters.size(); i++) {
+    tags[i] = metadata;
+    tags[i]["TRACKNUMBER"] = std::to_string(i + 1);
+    for (auto& [k, v] : chapters[i].metadata) {
+      tags[i][k] = v;
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> outputs(chapters.size());
+  auto writeChapter = [&](size_t i) {
+    opus_edit::write(timeline, chapters[i].range, tags[i], outputs[i]);
+  };
+  num_threads = std::min<int>(num_threads, chapters.size());
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < chapters.size(); i++) {
+      writeChapter(i);
+    }
+    return outputs;
+  }
+
+  // workers take the next chapter until none left
+  std::atomic<size_t> next{0};
+  std::vector<std::exception_ptr> errors(num_threads);
+  std::vector<utils::stats::Stats> stats(num_threads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++) {
+    workers.emplace_back([&, t]() {
+      utils::stats::JobScope job{stats[t]};
+      auto work = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < chapters.size();) {
+          writeChapter(i);
+        }
+      };
+#if UTILS_EXCEPTIONS
+      try {
+        work();
+      } catch (...) {
+        errors[t] = std::current_exception();
+        next = chapters.size();
+      }
+#else
+      work();  // a failure aborts anyway
+#endif
+    });
+  }
+  for (int t = 0; t < num_threads; t++) {
+    workers[t].join();
+    if (utils::stats::current) {
+      utils::stats::current->merge(stats[t]);
+    }
+  }
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  return outputs;
+}
+
+}  // namespace opus_split
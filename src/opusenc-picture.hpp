@@ -42,6 +42,7 @@
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include "utils.hpp"
 
 namespace opusenc_picture {
 
@@ -434,7 +435,7 @@ inline std::string encode(const std::vector<uint8_t>& picture) {
   std::string encoded_string{encoded};
   free(encoded);
   if (error) {
-    throw std::runtime_error{"failed to encode picture"};
+    UTILS_FAIL("failed to encode picture");
   }
   return encoded_string;
 }
@@ -0,0 +1,229 @@
+#pragma once
+
+// statically composed packet pipeline (demux -> stages -> mux)
+//
+// - a stage is a callable `stage(item, next)` which passes what it produces
+//   to `next(...)` (packets, or frames after `Decode`). a stage with state
+//   to flush also has `finish(next)` which ends with `next.finish()`.
+// - `makeChain(stages...)` nests them by value into a single type, so the per
+//   packet path is plain inlined calls (no virtual or std::function).
+// - what depends on the job but is fixed for it (e.g. whether timestamps
+//   need rescaling, whether there's a side analysis) is lifted into template
+//   parameters by `dispatch`, so unused stages don't exist in the hot loop
+//
+//   pipeline::dispatch(needs_rescale, [&](auto rescale) {
+//     auto chain = pipeline::makeChain(
+//         pipeline::SelectStream{stream_index},
+//         pipeline::ToOutput<rescale>{out_stream->index, from, to},
+//         pipeline::Mux{ofmt_ctx});
+//     pipeline::run(ifmt_ctx, pkt, chain);
+//   });
+
+#include <type_traits>
+#include <utility>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace pipeline {
+
+//
+// chain
+//
+
+template <class Stage, class Next, class = void>
+struct HasFinish : std::false_type {};
+
+template <class Stage, class Next>
+struct HasFinish<Stage,
+                 Next,
+                 std::void_t<decltype(std::declval<Stage&>().finish(
+                     std::declval<Next&>()))>> : std::true_type {};
+
+template <class... Stages>
+struct Chain;
+
+// end of chain (after a sink)
+template <>
+struct Chain<> {
+  template <class T>
+  void operator()(T*) {}
+  void finish() {}
+};
+
+template <class Stage, class... Rest>
+struct Chain<Stage, Rest...> {
+  Stage stage_;
+  Chain<Rest...> rest_;
+
+  template <class T>
+  void operator()(T* item) {
+    stage_(item, rest_);
+  }
+  void finish() {
+    if constexpr (HasFinish<Stage, Chain<Rest...>>::value) {
+      stage_.finish(rest_);
+    } else {
+      rest_.finish();
+    }
+  }
+};
+
+inline Chain<> makeChain() {
+  return {};
+}
+
+template <class Stage, class... Rest>
+Chain<Stage, Rest...> makeChain(Stage stage, Rest... rest) {
+  return {std::move(stage), makeChain(std::move(rest)...)};
+}
+
+// `fn(std::true_type)` or `fn(std::false_type)` by `value`
+template <class Fn>
+void dispatch(bool value, Fn fn) {
+  if (value) {
+    fn(std::true_type{});
+  } else {
+    fn(std::false_type{});
+  }
+}
+
+// demux everything into `chain` and flush it (unless the job was stopped,
+// cf. utils-control.hpp)
+template <class ChainT>
+void run(AVFormatContext* ifmt_ctx, AVPacket* pkt, ChainT& chain) {
+  while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt)) >= 0) {
+    utils::control::reached(pkt,
+                            ifmt_ctx->streams[pkt->stream_index]->time_base);
+    chain(pkt);
+    av_packet_unref(pkt);
+  }
+  ASSERT_OK(utils::control::check());
+  chain.finish();
+}
+
+//
+// stages
+//
+
+struct SelectStream {
+  int stream_index_;
+
+  template <class Next>
+  void operator()(AVPacket* pkt, Next& next) {
+    if (pkt->stream_index == stream_index_) {
+      STATS_ADD(packets, 1);
+      next(pkt);
+    }
+  }
+};
+
+// retarget to the output stream (rescaling only if time bases differ)
+template <bool RESCALE>
+struct ToOutput {
+  int stream_index_;
+  AVRational from_;
+  AVRational to_;
+
+  template <class Next>
+  void operator()(AVPacket* pkt, Next& next) {
+    pkt->stream_index = stream_index_;
+    if constexpr (RESCALE) {
+      av_packet_rescale_ts(pkt, from_, to_);
+    }
+    next(pkt);
+  }
+};
+
+// side branch seeing each item before the rest of the chain
+template <class Fn>
+struct Tap {
+  Fn fn_;
+
+  template <class T, class Next>
+  void operator()(T* item, Next& next) {
+    fn_(static_cast<const T*>(item));
+    next(item);
+  }
+};
+
+template <class Fn>
+Tap<Fn> tap(Fn fn) {
+  return {std::move(fn)};
+}
+
+// packets -> frames received into `frame_`
+struct Decode {
+  AVCodecContext* dec_ctx_;
+  AVFrame* frame_;
+
+  template <class Next>
+  void operator()(const AVPacket* pkt, Next& next) {
+    ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx_, pkt)));
+    while (true) {
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx_, frame_));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      STATS_ADD(frames, 1);
+      next(frame_);
+      av_frame_unref(frame_);
+    }
+  }
+
+  template <class Next>
+  void finish(Next& next) {
+    (*this)(static_cast<const AVPacket*>(nullptr), next);
+    next.finish();
+  }
+};
+
+// frames -> packets received into `pkt_`
+struct Encode {
+  AVCodecContext* enc_ctx_;
+  AVPacket* pkt_;
+
+  template <class Next>
+  void operator()(const AVFrame* frame, Next& next) {
+    ASSERT_AV(STATS_TIMED(encode, avcodec_send_frame(enc_ctx_, frame)));
+    while (true) {
+      auto ret = STATS_TIMED(encode, avcodec_receive_packet(enc_ctx_, pkt_));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      next(pkt_);
+      av_packet_unref(pkt_);
+    }
+  }
+
+  template <class Next>
+  void finish(Next& next) {
+    (*this)(static_cast<const AVFrame*>(nullptr), next);
+    next.finish();
+  }
+};
+
+// sink (header is written by the caller, trailer by `finish`)
+struct Mux {
+  AVFormatContext* ofmt_ctx_;
+
+  template <class Next>
+  void operator()(AVPacket* pkt, Next&) {
+    ASSERT_AV(STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, pkt)));
+  }
+
+  template <class Next>
+  void finish(Next&) {
+    ASSERT_AV(
+        STATS_TIMED(mux, av_interleaved_write_frame(ofmt_ctx_, nullptr)));
+    ASSERT_AV(STATS_TIMED(mux, av_write_trailer(ofmt_ctx_)));
+  }
+};
+
+}  // namespace pipeline
@@ -0,0 +1,355 @@
+#pragma once
+
+// streaming mel spectrogram quantized to 8 bits (e.g. QC thumbnails)
+//
+// - decoded frames are mixed down to mono into a ring of `fft_size` samples
+//   and a column is emitted every `hop` samples, so PCM is never held as a
+//   whole.
+// - real FFT of size N is a complex radix-2 FFT of size N/2 on even/odd
+//   samples followed by the split step. data is kept as separate re/im
+//   arrays and twiddles are stored contiguously per stage, so butterflies
+//   from the third stage on are straight __restrict loops over arrays
+//   which are auto-vectorized (checked with -O3 -fopt-info-vec). the first
+//   two stages (twiddles 1 and -i) are one scalar radix-4 pass.
+// - power spectrum is reduced by triangular mel filters (HTK mel scale) and
+//   mapped from [min_db, 0] dBFS to [0, 255].
+//
+// binary format (little endian)
+//   "SPEC"          magic
+//   u8              version (1)
+//   u8              reserved (0)
+//   u16             number of bins (mel filters)
+//   u32             sample rate
+//   u32             fft size
+//   u32             hop size
+//   u32             number of columns
+//   u8 * columns * bins  column by column (time), low to high frequency
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <vector>
+#include "ogg-opus-writer.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+namespace spectrogram {
+
+constexpr uint8_t VERSION = 1;
+
+struct Options {
+  int fft_size = 2048;  // power of 2
+  int hop = 512;
+  int bins = 128;
+  float min_db = -90;
+};
+
+//
+// radix-2 FFT (complex, in place, separate re/im arrays)
+//
+
+struct Fft {
+  int n_;
+  std::vector<int> bit_reverse_;
+  std::vector<std::vector<float>> twiddle_re_;  // per stage
+  std::vector<std::vector<float>> twiddle_im_;
+
+  Fft(int n) : n_{n} {
+    ASSERT(n >= 2 && (n & (n - 1)) == 0);
+    int bits = 0;
+    while ((1 << bits) < n) {
+      bits++;
+    }
+    bit_reverse_.resize(n);
+    for (int i = 0; i < n; i++) {
+      int r = 0;
+      for (int b = 0; b < bits; b++) {
+        r |= ((i >> b) & 1) << (bits - 1 - b);
+      }
+      bit_reverse_[i] = r;
+    }
+    for (int len = 2; len <= n; len *= 2) {
+      auto& re = twiddle_re_.emplace_back(len / 2);
+      auto& im = twiddle_im_.emplace_back(len / 2);
+      for (int j = 0; j < len / 2; j++) {
+        double angle = -2 * M_PI * j / len;
+        re[j] = std::cos(angle);
+        im[j] = std::sin(angle);
+      }
+    }
+  }
+
+  void forward(float* re, float* im) const {
+    for (int i = 0; i < n_; i++) {
+      int r = bit_reverse_[i];
+      if (i < r) {
+        std::swap(re[i], re[r]);
+        std::swap(im[i], im[r]);
+      }
+    }
+    // len 2 and 4 have trivial twiddles (1, -i) and are narrower than a
+    // vector, so they're fused into one scalar radix-4 pass
+    if (n_ >= 4) {
+      for (int i = 0; i < n_; i += 4) {
+        float r0 = re[i] + re[i + 1], i0 = im[i] + im[i + 1];
+        float r1 = re[i] - re[i + 1], i1 = im[i] - im[i + 1];
+        float r2 = re[i + 2] + re[i + 3], i2 = im[i + 2] + im[i + 3];
+        float r3 = re[i + 2] - re[i + 3], i3 = im[i + 2] - im[i + 3];
+        re[i] = r0 + r2;
+        im[i] = i0 + i2;
+        re[i + 2] = r0 - r2;
+        im[i + 2] = i0 - i2;
+        // (r3 + i i3) * -i
+        re[i + 1] = r1 + i3;
+        im[i + 1] = i1 - r3;
+        re[i + 3] = r1 - i3;
+        im[i + 3] = i1 + r3;
+      }
+    } else {
+      butterflies(re, im, re + 1, im + 1, twiddle_re_[0].data(),
+                  twiddle_im_[0].data(), 1);
+    }
+    int stage = 2;
+    for (int len = 8; len <= n_; len *= 2, stage++) {
+      int half = len / 2;
+      for (int i = 0; i < n_; i += len) {
+        butterflies(re + i, im + i, re + i + half, im + i + half,
+                    twiddle_re_[stage].data(), twiddle_im_[stage].data(),
+                    half);
+      }
+    }
+  }
+
+  // a += w b, b = a - w b over `half` contiguous elements. halves of a
+  // block never overlap, which __restrict tells the vectorizer (instead of
+  // a runtime alias check of six pointers it gives up on)
+  static void butterflies(float* __restrict ar,
+                          float* __restrict ai,
+                          float* __restrict br,
+                          float* __restrict bi,
+                          const float* __restrict wr,
+                          const float* __restrict wi,
+                          int half) {
+    for (int j = 0; j < half; j++) {
+      float tr = br[j] * wr[j] - bi[j] * wi[j];
+      float ti = br[j] * wi[j] + bi[j] * wr[j];
+      br[j] = ar[j] - tr;
+      bi[j] = ai[j] - ti;
+      ar[j] = ar[j] + tr;
+      ai[j] = ai[j] + ti;
+    }
+  }
+};
+
+// power spectrum (N/2 + 1 bins) of N real samples
+struct RealFft {
+  int n_;
+  Fft fft_;
+  std::vector<float> split_re_;  // e^{-2 pi i k / N}
+  std::vector<float> split_im_;
+  std::vector<float> re_;
+  std::vector<float> im_;
+
+  RealFft(int n) : n_{n}, fft_{n / 2} {
+    for (int k = 0; k <= n / 2; k++) {
+      split_re_.push_back(std::cos(-2 * M_PI * k / n));
+      split_im_.push_back(std::sin(-2 * M_PI * k / n));
+    }
+    re_.resize(n / 2);
+    im_.resize(n / 2);
+  }
+
+  void power(const float* x, float* out) {
+    int m = n_ / 2;
+    for (int i = 0; i < m; i++) {
+      re_[i] = x[2 * i];
+      im_[i] = x[2 * i + 1];
+    }
+    fft_.forward(re_.data(), im_.data());
+    // E[k] = (Z[k] + Z*[m - k]) / 2, O[k] = (Z[k] - Z*[m - k]) / 2i
+    // X[k] = E[k] + e^{-2 pi i k / N} O[k]
+    for (int k = 0; k <= m; k++) {
+      int a = k % m;
+      int b = (m - k) % m;
+      float er = (re_[a] + re_[b]) / 2;
+      float ei = (im_[a] - im_[b]) / 2;
+      float or_ = (im_[a] + im_[b]) / 2;
+      float oi = -(re_[a] - re_[b]) / 2;
+      float xr = er + split_re_[k] * or_ - split_im_[k] * oi;
+      float xi = ei + split_re_[k] * oi + split_im_[k] * or_;
+      out[k] = xr * xr + xi * xi;
+    }
+  }
+};
+
+//
+// mel filter bank
+//
+
+inline double hzToMel(double hz) {
+  return 2595 * std::log10(1 + hz / 700);
+}
+
+inline double melToHz(double mel) {
+  return 700 * (std::pow(10.0, mel / 2595) - 1);
+}
+
+struct MelFilter {
+  int start;  // first fft bin
+  std::vector<float> weights;
+};
+
+inline std::vector<MelFilter> melFilters(int bins,
+                                         int fft_size,
+                                         int sample_rate) {
+  int nb_fft = fft_size / 2 + 1;
+  double mel_max = hzToMel(sample_rate / 2.0);
+  std::vector<double> edges;  // fft bin position of bins + 2 edges
+  for (int i = 0; i < bins + 2; i++) {
+    edges.push_back(melToHz(mel_max * i / (bins + 1)) * fft_size / sample_rate);
+  }
+  std::vector<MelFilter> result;
+  for (int b = 0; b < bins; b++) {
+    double lo = edges[b], mid = edges[b + 1], hi = edges[b + 2];
+    int start = std::max(0, static_cast<int>(std::ceil(lo)));
+    int end = std::min(nb_fft - 1, static_cast<int>(std::floor(hi)));
+    auto& filter = result.emplace_back();
+    filter.start = start;
+    for (int k = start; k <= end; k++) {
+      double w = k <= mid ? (k - lo) / (mid - lo) : (hi - k) / (hi - mid);
+      filter.weights.push_back(std::max(0.0, w));
+    }
+    // narrow filters at low frequency still take the nearest fft bin
+    if (filter.weights.empty()) {
+      filter.start = std::min(nb_fft - 1, static_cast<int>(std::lround(mid)));
+      filter.weights.push_back(1);
+    }
+  }
+  return result;
+}
+
+//
+// streaming builder
+//
+
+struct Builder {
+  Options options_;
+  int sample_rate_ = 0;
+  std::optional<RealFft> fft_;
+  std::vector<MelFilter> filters_;
+  std::vector<float> window_;
+  float scale_db_ = 0;  // full scale sine to 0 dB
+
+  std::vector<float> ring_;  // last `fft_size` samples
+  int64_t ring_pos_ = 0;     // total samples written
+  int64_t next_column_;      // sample position where next column ends
+  std::vector<float> frame_;
+  std::vector<float> power_;
+  std::vector<float> mono_;
+
+  std::vector<uint8_t> data_;
+  uint32_t columns_ = 0;
+
+  Builder(const Options& options) : options_{options} {
+    ASSERT(options_.hop > 0 && options_.bins > 0 && options_.min_db < 0);
+    next_column_ = options_.fft_size;
+    ring_.resize(options_.fft_size, 0.0f);
+    frame_.resize(options_.fft_size);
+    power_.resize(options_.fft_size / 2 + 1);
+
+    // periodic hann
+    double sum = 0;
+    for (int i = 0; i < options_.fft_size; i++) {
+      window_.push_back(0.5 - 0.5 * std::cos(2 * M_PI * i / options_.fft_size));
+      sum += window_.back();
+    }
+    scale_db_ = -20 * std::log10(sum / 2);
+  }
+
+  void addFrame(const AVFrame* frame) {
+    if (!fft_) {
+      sample_rate_ = frame->sample_rate;
+      fft_.emplace(options_.fft_size);
+      filters_ = melFilters(options_.bins, options_.fft_size, sample_rate_);
+    }
+    ASSERT(frame->sample_rate == sample_rate_);
+    utils::mixdown(frame, mono_);
+    addSamples(mono_.data(), mono_.size());
+  }
+
+  void addSamples(const float* x, int n) {
+    int size = options_.fft_size;
+    while (n > 0) {
+      // copy up to the next column into the ring
+      int k = std::min<int64_t>(n, next_column_ - ring_pos_);
+      for (int i = 0; i < k; i++) {
+        ring_[(ring_pos_ + i) % size] = x[i];
+      }
+      ring_pos_ += k;
+      x += k;
+      n -= k;
+      if (ring_pos_ == next_column_) {
+        int offset = ring_pos_ % size;
+        for (int i = 0; i < size; i++) {
+          frame_[i] = ring_[(offset + i) % size] * window_[i];
+        }
+        addColumn();
+        next_column_ += options_.hop;
+      }
+    }
+  }
+
+  void addColumn() {
+    fft_->power(frame_.data(), power_.data());
+    float range = -options_.min_db;
+    for (auto& filter : filters_) {
+      float sum = 0;
+      for (size_t i = 0; i < filter.weights.size(); i++) {
+        sum += filter.weights[i] * power_[filter.start + i];
+      }
+      float db = 10 * std::log10(sum + 1e-20f) + scale_db_;
+      float v = (db - options_.min_db) / range * 255;
+      data_.push_back(static_cast<uint8_t>(std::clamp(v, 0.0f, 255.0f)));
+    }
+    columns_++;
+  }
+
+  std::vector<uint8_t> finish() {
+    std::vector<uint8_t> result;
+    auto put = [&](uint64_t value, int bytes) {
+      uint8_t buffer[4];
+      ogg_opus::writeLE(buffer, value, bytes);
+      result.insert(result.end(), buffer, buffer + bytes);
+    };
+    result.insert(result.end(), {'S', 'P', 'E', 'C'});
+    put(VERSION, 1);
+    put(0, 1);
+    put(options_.bins, 2);
+    put(sample_rate_, 4);
+    put(options_.fft_size, 4);
+    put(options_.hop, 4);
+    put(columns_, 4);
+    result.insert(result.end(), data_.begin(), data_.end());
+    return result;
+  }
+};
+
+// demux and decode `stream_index` of the input through `Builder`
+inline std::vector<uint8_t> compute(AVFormatContext* ifmt_ctx,
+                                    int stream_index,
+                                    const Options& options = {}) {
+  Builder builder{options};
+  utils::decodeStream(ifmt_ctx, stream_index, [&](const AVFrame* frame) {
+    STATS_SCOPE(analysis);
+    builder.addFrame(frame);
+  });
+  STATS_SCOPE(output_copy);
+  return builder.finish();
+}
+
+}  // namespace spectrogram
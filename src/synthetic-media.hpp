@@ -0,0 +1,146 @@
+#pragma once
+
+// deterministic opus test inputs (no download needed)
+// third_party/FFmpeg/doc/examples/encode_audio.c
+// third_party/FFmpeg/doc/examples/muxing.c
+
+#include <cmath>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+}
+
+namespace synthetic_media {
+
+constexpr int SAMPLE_RATE = 48000;
+
+struct Options {
+  std::string format = "webm";  // "webm" or "opus" (i.e. ogg)
+  double seconds = 10;
+  int channels = 2;
+  int64_t bit_rate = 96000;
+  uint32_t seed = 0;
+};
+
+//
+// signal (tone sweep + a bit of noise) which doesn't depend on anything but
+// `seed` and sample index so that encoded output is reproducible
+//
+
+struct Signal {
+  uint32_t state_;
+  double phase_ = 0;
+
+  Signal(uint32_t seed) : state_{seed * 2654435761u + 1} {}
+
+  float next(int64_t index, int channel) {
+    // numerical recipes LCG
+    state_ = state_ * 1664525u + 1013904223u;
+    float noise = static_cast<float>(state_ >> 8) / (1 << 24) * 2 - 1;
+
+    // 220Hz -> 880Hz sweep every 8 seconds (phase advances once per sample)
+    if (channel == 0) {
+      double t = std::fmod(static_cast<double>(index) / SAMPLE_RATE, 8.0);
+      double freq = 220 * std::pow(2.0, t / 4);
+      phase_ = std::fmod(phase_ + 2 * M_PI * freq / SAMPLE_RATE, 2 * M_PI);
+    }
+    double tone = std::sin(phase_ + channel * M_PI / 2);
+    return static_cast<float>(0.3 * tone + 0.02 * noise);
+  }
+};
+
+inline std::vector<uint8_t> generate(const Options& options) {
+  BufferOutput output;
+  AVFormatContext* ofmt_ctx = nullptr;
+  avformat_alloc_output_context2(&ofmt_ctx, NULL, options.format.c_str(),
+                                 NULL);
+  ASSERT(ofmt_ctx);
+  DEFER {
+    avformat_free_context(ofmt_ctx);
+  };
+  ofmt_ctx->pb = output.avio_ctx_;
+  ofmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  // encoder
+  const AVCodec* enc = avcodec_find_encoder(AV_CODEC_ID_OPUS);
+  ASSERT(enc);
+  AVCodecContext* enc_ctx = utils::allocCodecContext(enc);
+  DEFER {
+    avcodec_free_context(&enc_ctx);
+  };
+  enc_ctx->sample_rate = SAMPLE_RATE;
+  av_channel_layout_default(&enc_ctx->ch_layout, options.channels);
+  enc_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  enc_ctx->bit_rate = options.bit_rate;
+  enc_ctx->time_base = {1, SAMPLE_RATE};
+  enc_ctx->thread_count = 1;  // keep output deterministic
+  enc_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+  if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  ASSERT_AV(avcodec_open2(enc_ctx, enc, NULL));
+
+  // output stream
+  AVStream* out_stream = avformat_new_stream(ofmt_ctx, nullptr);
+  ASSERT(out_stream);
+  ASSERT_AV(avcodec_parameters_from_context(out_stream->codecpar, enc_ctx));
+  out_stream->time_base = enc_ctx->time_base;
+
+  // allocate AVFrame and AVPacket
+  AVFrame* frame = utils::allocFrame();
+  DEFER {
+    av_frame_free(&frame);
+  };
+  frame->nb_samples = enc_ctx->frame_size;
+  frame->format = enc_ctx->sample_fmt;
+  frame->sample_rate = enc_ctx->sample_rate;
+  ASSERT_AV(av_channel_layout_copy(&frame->ch_layout, &enc_ctx->ch_layout));
+  ASSERT_AV(av_frame_get_buffer(frame, 0));
+
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+
+  ASSERT_AV(avformat_write_header(ofmt_ctx, nullptr));
+
+  auto writePackets = [&]() {
+    while (true) {
+      auto ret = avcodec_receive_packet(enc_ctx, pkt);
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      pkt->stream_index = out_stream->index;
+      av_packet_rescale_ts(pkt, enc_ctx->time_base, out_stream->time_base);
+      ASSERT_AV(av_interleaved_write_frame(ofmt_ctx, pkt));
+    }
+  };
+
+  // encode signal
+  Signal signal{options.seed};
+  auto total = static_cast<int64_t>(options.seconds * SAMPLE_RATE);
+  for (int64_t pts = 0; pts < total; pts += frame->nb_samples) {
+    ASSERT_AV(av_frame_make_writable(frame));
+    for (int i = 0; i < frame->nb_samples; i++) {
+      for (int ch = 0; ch < options.channels; ch++) {
+        reinterpret_cast<float*>(frame->data[ch])[i] = signal.next(pts + i, ch);
+      }
+    }
+    frame->pts = pts;
+    ASSERT_AV(avcodec_send_frame(enc_ctx, frame));
+    writePackets();
+  }
+  ASSERT_AV(avcodec_send_frame(enc_ctx, nullptr));
+  writePackets();
+  ASSERT_AV(av_interleaved_write_frame(ofmt_ctx, nullptr));
+  ASSERT_AV(av_write_trailer(ofmt_ctx));
+
+  return output.output_;
+}
+
+}  // namespace synthetic_media
@@ -0,0 +1,224 @@
+#pragma once
+
+// unix domain socket with fd passing (cf. example-11 daemon, example-12)
+//
+// - a message is a u32 (little endian) size followed by a json payload, and
+//   file descriptors ride along as SCM_RIGHTS ancillary data of the first
+//   chunk, so files are opened by the client and never named over the socket
+// - `MappedFile` maps a received input fd read only so that the fast paths
+//   (e.g. matroska::copyToOggOpus) read the page cache without any copy
+//
+// https://man7.org/linux/man-pages/man7/unix.7.html
+// https://man7.org/linux/man-pages/man3/cmsg.3.html
+
+#include <cerrno>
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace unix_socket {
+
+constexpr size_t MAX_FDS = 4;
+constexpr uint32_t MAX_MESSAGE_SIZE = 1 << 24;
+
+// owned file descriptor
+struct Fd {
+  int fd_ = -1;
+
+  Fd() = default;
+  explicit Fd(int fd) : fd_{fd} {}
+  Fd(Fd&& other) : fd_{other.fd_} { other.fd_ = -1; }
+  Fd& operator=(Fd&& other) {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+  Fd(const Fd&) = delete;
+  Fd& operator=(const Fd&) = delete;
+  ~Fd() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  int get() const { return fd_; }
+  explicit operator bool() const { return fd_ >= 0; }
+};
+
+inline sockaddr_un makeAddress(const std::string& path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  ASSERT(path.size() < sizeof(addr.sun_path));
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+// replaces a stale socket file left by a previous run
+inline Fd listen(const std::string& path, int backlog) {
+  Fd fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  ASSERT(fd);
+  auto addr = makeAddress(path);
+  ::unlink(path.c_str());
+  ASSERT(::bind(fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+         0);
+  ASSERT(::listen(fd.get(), backlog) == 0);
+  return fd;
+}
+
+inline Fd connect(const std::string& path) {
+  Fd fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  ASSERT(fd);
+  auto addr = makeAddress(path);
+  ASSERT(::connect(fd.get(), reinterpret_cast<sockaddr*>(&addr),
+                   sizeof(addr)) == 0);
+  return fd;
+}
+
+inline void writeAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    auto n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    ASSERT(n > 0);
+    data += n;
+    size -= n;
+  }
+}
+
+//
+// framed json messages
+//
+
+inline void send(int fd,
+                 const nlohmann::json& message,
+                 const std::vector<int>& fds = {}) {
+  ASSERT(fds.size() <= MAX_FDS);
+  auto payload = message.dump();
+  ASSERT(payload.size() <= MAX_MESSAGE_SIZE);
+  std::vector<uint8_t> data(4 + payload.size());
+  for (int i = 0; i < 4; i++) {
+    data[i] = (payload.size() >> (8 * i)) & 0xff;
+  }
+  std::memcpy(data.data() + 4, payload.data(), payload.size());
+
+  // fds go with the first byte, the rest is plain writes
+  iovec iov = {data.data(), data.size()};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)] = {};
+  if (!fds.empty()) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+  ssize_t n;
+  do {
+    n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  ASSERT(n > 0);
+  writeAll(fd, data.data() + n, data.size() - n);
+}
+
+// false on orderly shutdown by peer before a new message
+inline bool receive(int fd, nlohmann::json& message, std::vector<Fd>& fds) {
+  uint8_t header[4];
+  size_t pos = 0;
+  auto readSome = [&](uint8_t* buffer, size_t size) -> ssize_t {
+    iovec iov = {buffer, size};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)] = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+      n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      // `msg` wasn't filled in (control messages would be garbage)
+      return n;
+    }
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+          int received;
+          std::memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int),
+                      sizeof(int));
+          fds.emplace_back(received);
+        }
+      }
+    }
+    ASSERT(!(msg.msg_flags & MSG_CTRUNC));
+    return n;
+  };
+
+  while (pos < sizeof(header)) {
+    auto n = readSome(header + pos, sizeof(header) - pos);
+    if (n == 0 && pos == 0) {
+      return false;
+    }
+    ASSERT(n > 0);
+    pos += n;
+  }
+  uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) |
+                  (uint32_t(header[3]) << 24);
+  ASSERT(size <= MAX_MESSAGE_SIZE);
+  std::vector<uint8_t> payload(size);
+  for (pos = 0; pos < size;) {
+    auto n = readSome(payload.data() + pos, size - pos);
+    ASSERT(n > 0);
+    pos += n;
+  }
+  message = nlohmann::json::parse(payload.begin(), payload.end());
+  return true;
+}
+
+//
+// read only mapping of a passed file
+//
+
+struct MappedFile {
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+
+  MappedFile(int fd) {
+    struct stat st;
+    ASSERT(::fstat(fd, &st) == 0);
+    size_ = st.st_size;
+    if (size_ == 0) {
+      return;
+    }
+    void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ASSERT(addr != MAP_FAILED);
+    ::madvise(addr, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const uint8_t*>(addr);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data_) {
+      ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+};
+
+}  // namespace unix_socket
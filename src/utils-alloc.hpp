@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "utils.hpp"
+
+//
+// allocation tracking (opt-in via -DUTILS_ALLOC=ON)
+//
+// ffmpeg's av_malloc/av_realloc/av_free are thin wrappers of
+// posix_memalign/realloc/free (third_party/FFmpeg/libavutil/mem.c), so
+// instead of wrapping each av_xxx (internal calls within mem.c e.g.
+// av_mallocz -> av_malloc cannot be wrapped at link time), the libc
+// primitives are wrapped with `-Wl,--wrap=...` (see CMakeLists.txt).
+// C++ allocations are tracked by replacing global operator new/delete.
+//
+// pointers are never modified and sizes come from malloc_usable_size, so
+// memory allocated/freed outside of the tracked paths only skews the numbers.
+//
+// counters are process global. per job/stage numbers (see utils-stats.hpp)
+// are exact only when jobs don't run concurrently.
+//
+// NOTE: this header defines the wrappers when enabled, so it must be
+// included from a single translation unit per target (which is always the
+// case for the targets here).
+//
+
+#ifndef UTILS_ALLOC
+#define UTILS_ALLOC 0
+#endif
+
+#if UTILS_ALLOC
+#include <malloc.h>
+#endif
+
+namespace utils::alloc {
+
+enum Category {
+  c,    // malloc family (ffmpeg and any C code statically linked)
+  cpp,  // operator new
+  CATEGORY_SIZE,
+};
+
+struct Counters {
+  std::atomic<int64_t> live_bytes_{0};
+  std::atomic<int64_t> peak_bytes_{0};
+  std::atomic<uint64_t> count_[CATEGORY_SIZE] = {};
+  std::atomic<uint64_t> bytes_[CATEGORY_SIZE] = {};
+};
+
+inline Counters counters;
+
+struct Snapshot {
+  int64_t live_bytes = 0;
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+};
+
+inline Snapshot snapshot() {
+  Snapshot result;
+  result.live_bytes = counters.live_bytes_.load(std::memory_order_relaxed);
+  for (int i = 0; i < CATEGORY_SIZE; i++) {
+    result.count += counters.count_[i].load(std::memory_order_relaxed);
+    result.bytes += counters.bytes_[i].load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+#if UTILS_ALLOC
+
+inline size_t usableSize(void* ptr) {
+  return ptr ? malloc_usable_size(ptr) : 0;
+}
+
+inline void onAlloc(Category category, void* ptr) {
+  if (!ptr) {
+    return;
+  }
+  int64_t size = usableSize(ptr);
+  counters.count_[category].fetch_add(1, std::memory_order_relaxed);
+  counters.bytes_[category].fetch_add(size, std::memory_order_relaxed);
+  auto live =
+      counters.live_bytes_.fetch_add(size, std::memory_order_relaxed) + size;
+  auto peak = counters.peak_bytes_.load(std::memory_order_relaxed);
+  while (live > peak && !counters.peak_bytes_.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed)) {
+  }
+}
+
+inline void onFree(size_t size) {
+  counters.live_bytes_.fetch_sub(size, std::memory_order_relaxed);
+}
+
+#endif
+
+//
+// peak of a (nested) region relative to the live bytes at its start
+//
+
+struct PeakScope {
+  int64_t start_live_ = 0;
+  int64_t outer_peak_ = 0;
+
+  void start() {
+#if UTILS_ALLOC
+    start_live_ = counters.live_bytes_.load(std::memory_order_relaxed);
+    outer_peak_ = counters.peak_bytes_.exchange(start_live_,
+                                                std::memory_order_relaxed);
+#endif
+  }
+
+  int64_t finish() {
+#if UTILS_ALLOC
+    auto peak = counters.peak_bytes_.load(std::memory_order_relaxed);
+    counters.peak_bytes_.store(std::max(peak, outer_peak_),
+                               std::memory_order_relaxed);
+    return peak - start_live_;
+#else
+    return 0;
+#endif
+  }
+};
+
+}  // namespace utils::alloc
+
+#if UTILS_ALLOC
+
+//
+// link time wrappers
+//
+
+extern "C" {
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+int __real_posix_memalign(void** ptr, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  auto ptr = __real_malloc(size);
+  utils::alloc::onAlloc(utils::alloc::c, ptr);
+  return ptr;
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  auto ptr = __real_calloc(count, size);
+  utils::alloc::onAlloc(utils::alloc::c, ptr);
+  return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  auto old_size = utils::alloc::usableSize(ptr);
+  auto new_ptr = __real_realloc(ptr, size);
+  if (new_ptr || size == 0) {
+    utils::alloc::onFree(old_size);
+    utils::alloc::onAlloc(utils::alloc::c, new_ptr);
+  }
+  return new_ptr;
+}
+
+void __wrap_free(void* ptr) {
+  utils::alloc::onFree(utils::alloc::usableSize(ptr));
+  __real_free(ptr);
+}
+
+int __wrap_posix_memalign(void** ptr, size_t alignment, size_t size) {
+  auto ret = __real_posix_memalign(ptr, alignment, size);
+  if (ret == 0) {
+    utils::alloc::onAlloc(utils::alloc::c, *ptr);
+  }
+  return ret;
+}
+
+}  // extern "C"
+
+//
+// global operator new/delete (bypass malloc wrapper to not count twice)
+//
+
+inline void* utilsAllocNew(size_t size, size_t alignment) {
+  void* ptr = nullptr;
+  size = size ? size : 1;
+  if (alignment <= alignof(std::max_align_t)) {
+    ptr = __real_malloc(size);
+  } else if (__real_posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = nullptr;
+  }
+  utils::alloc::onAlloc(utils::alloc::cpp, ptr);
+  return ptr;
+}
+
+// std::bad_alloc, or abort in builds without exceptions (cf. UTILS_FAIL)
+[[noreturn]] inline void utilsAllocFail() {
+#if UTILS_EXCEPTIONS
+  throw std::bad_alloc{};
+#else
+  utils::fatal("bad_alloc");
+#endif
+}
+
+inline void utilsAllocDelete(void* ptr) {
+  utils::alloc::onFree(utils::alloc::usableSize(ptr));
+  __real_free(ptr);
+}
+
+void* operator new(size_t size) {
+  auto ptr = utilsAllocNew(size, 0);
+  if (!ptr) {
+    utilsAllocFail();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  auto ptr = utilsAllocNew(size, static_cast<size_t>(alignment));
+  if (!ptr) {
+    utilsAllocFail();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return utilsAllocNew(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return utilsAllocNew(size, 0);
+}
+
+void operator delete(void* ptr) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  utilsAllocDelete(ptr);
+}
+
+#endif
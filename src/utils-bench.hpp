@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include <numeric>
+#include "utils-stats.hpp"
+#include "utils.hpp"
+
+//
+// micro benchmark helper with machine readable report
+//
+// report schema (shared with src/emscripten-bench.js):
+// {
+//   "schema": "ffmpeg-experiment-bench/1",
+//   "runtime": "native" | "wasm",
+//   "build": { ... },
+//   "results": [
+//     {
+//       "name": "remux", "input": "webm-60s",
+//       "bytes": 123, "media_seconds": 60, "iterations": 5,
+//       "seconds": { "min": 0.1, "median": 0.1, "mean": 0.1 },
+//       "throughput_mb_s": 1.2, "realtime": 600
+//     }, ...
+//   ]
+// }
+//
+
+namespace utils::bench {
+
+constexpr const char* SCHEMA = "ffmpeg-experiment-bench/1";
+
+// one warmup run and then `iterations` measured runs
+template <class Fn>
+std::vector<double> measure(int iterations, Fn fn) {
+  fn();
+  std::vector<double> result;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.push_back(elapsed.count());
+  }
+  return result;
+}
+
+struct Report {
+  nlohmann::json build_ = nlohmann::json::object();
+  nlohmann::json results_ = nlohmann::json::array();
+
+  Report() {
+#ifdef NDEBUG
+    build_["type"] = "release";
+#else
+    build_["type"] = "debug";
+#endif
+    build_["compiler"] = __VERSION__;
+    build_["stats"] = static_cast<bool>(UTILS_STATS);
+  }
+
+  // `bytes` and `media_seconds` are amount of work done by a single run
+  nlohmann::json& add(const std::string& name,
+                      const std::string& input,
+                      size_t bytes,
+                      double media_seconds,
+                      std::vector<double> seconds) {
+    ASSERT(!seconds.empty());
+    std::sort(seconds.begin(), seconds.end());
+    auto n = seconds.size();
+    auto min = seconds[0];
+    auto median = n % 2 ? seconds[n / 2]
+                        : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+    auto mean = std::accumulate(seconds.begin(), seconds.end(), 0.0) / n;
+    results_.push_back({
+        {"name", name},
+        {"input", input},
+        {"bytes", bytes},
+        {"media_seconds", media_seconds},
+        {"iterations", n},
+        {"seconds", {{"min", min}, {"median", median}, {"mean", mean}}},
+        {"throughput_mb_s", bytes / median / 1e6},
+        {"realtime", media_seconds / median},
+    });
+    return results_.back();
+  }
+
+  nlohmann::json toJson() const {
+    return {{"schema", SCHEMA},
+            {"runtime", "native"},
+            {"build", build_},
+            {"results", results_}};
+  }
+};
+
+}  // namespace utils::bench
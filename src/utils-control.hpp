@@ -0,0 +1,166 @@
+#pragma once
+
+// cooperative cancellation, deadline and progress of the job running on this
+// thread
+//
+// - a `Control` is set up by whoever runs the job (deadline, progress
+//   callback) and installed on the job's thread by `Scope` (same as
+//   utils::stats::JobScope). `cancel` may be called from any thread.
+// - the job polls it where it already does work per unit of input: AVIO
+//   reads of BufferInput/FdInput (cf. utils-ffmpeg.hpp) fail with
+//   AVERROR_EXIT once it's stopped, so libavformat unwinds through its usual
+//   error paths, and loops which don't read through AVIO
+//   (matroska::copyToOggOpus) poll per packet. as a demux loop also ends on
+//   AVERROR_EXIT, it's followed by `check()` rather than taken for EOF.
+// - `poll` is an atomic load and a counter. the clock is only read every
+//   POLL_PERIOD polls, to test the deadline and to pass `progress_` to the
+//   callback at most every `progress_interval_`. without a Control installed
+//   the hooks are a thread_local load.
+// - a blocking read (e.g. pipe) isn't interrupted, the deadline is only seen
+//   once it returns
+//
+//   utils::control::Control control;
+//   control.setTimeout(5000);
+//   control.on_progress_ = [](auto& progress) { ...; return true; };
+//   utils::control::Scope scope{control};
+//   ... // ASSERT_OK(utils::control::check()) fails as "deadline exceeded"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include <string>
+#include "utils-result.hpp"
+#include "utils.hpp"
+
+namespace utils::control {
+
+using Clock = std::chrono::steady_clock;
+
+struct Progress {
+  int64_t bytes = 0;        // input position
+  int64_t total_bytes = 0;  // input size (0 if unknown)
+  double seconds = 0;       // media time of the last packet
+
+  nlohmann::json toJson() const {
+    return {{"bytes", bytes},
+            {"total_bytes", total_bytes},
+            {"seconds", seconds}};
+  }
+};
+
+enum class Reason { none, cancelled, deadline };
+
+struct Control {
+  static constexpr int POLL_PERIOD = 16;
+
+  // any thread
+  std::atomic<bool> cancelled_{false};
+
+  // set before the job starts
+  Clock::time_point deadline_ = Clock::time_point::max();
+  std::function<bool(const Progress&)> on_progress_;  // false to cancel
+  Clock::duration progress_interval_ = std::chrono::milliseconds(100);
+
+  // job's thread
+  Progress progress_;
+  Reason reason_ = Reason::none;
+  int polls_ = 0;
+  Clock::time_point next_progress_ = {};
+
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  // `ms` after `start` (none unless positive)
+  void setDeadline(Clock::time_point start, double ms) {
+    if (ms > 0) {
+      deadline_ = start + std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double, std::milli>(ms));
+    }
+  }
+  void setTimeout(double ms) { setDeadline(Clock::now(), ms); }
+
+  // true once the job should stop (stays so)
+  bool poll() {
+    if (reason_ != Reason::none) {
+      return true;
+    }
+    if (cancelled_.load(std::memory_order_relaxed)) {
+      reason_ = Reason::cancelled;
+      return true;
+    }
+    if (++polls_ < POLL_PERIOD) {
+      return false;
+    }
+    polls_ = 0;
+    auto now = Clock::now();
+    if (now >= deadline_) {
+      reason_ = Reason::deadline;
+      return true;
+    }
+    if (on_progress_ && now >= next_progress_) {
+      next_progress_ = now + progress_interval_;
+      if (!on_progress_(progress_)) {
+        reason_ = Reason::cancelled;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::string message() const {
+    switch (reason_) {
+      case Reason::cancelled:
+        return "cancelled";
+      case Reason::deadline:
+        return "deadline exceeded";
+      default:
+        return "";
+    }
+  }
+
+  nlohmann::json toJson() const {
+    return {{"stopped", message()}, {"progress", progress_.toJson()}};
+  }
+};
+
+// control of the job currently running on this thread (nullptr if none)
+inline thread_local Control* current = nullptr;
+
+struct Scope {
+  Control* previous_;
+
+  Scope(Control& control) : previous_{current} { current = &control; }
+  ~Scope() { current = previous_; }
+};
+
+//
+// hooks for the job
+//
+
+inline bool stopped() {
+  return current && current->poll();
+}
+
+// input position after a read
+inline void advance(int64_t bytes, int64_t total_bytes) {
+  if (current) {
+    current->progress_.bytes = bytes;
+    current->progress_.total_bytes = total_bytes;
+  }
+}
+
+inline void reached(double seconds) {
+  if (current) {
+    current->progress_.seconds = seconds;
+  }
+}
+
+// error if stopped (e.g. after a demux loop which ended on AVERROR_EXIT)
+inline Status check() {
+  if (stopped()) {
+    return Error{current->message()};
+  }
+  return {};
+}
+
+}  // namespace utils::control
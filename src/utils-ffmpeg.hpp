@@ -1,28 +1,93 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <map>
+#include "utils-control.hpp"
+#include "utils-result.hpp"
+#include "utils-stats.hpp"
 #include "utils.hpp"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
 #include <libavformat/avio.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
 #include <libavutil/dict.h>
+#include <libavutil/samplefmt.h>
 }
 
-#define ASSERT_AV(EXPR)                                                       \
-  do {                                                                        \
-    int code = EXPR;                                                          \
-    if (code < 0) {                                                           \
-      std::vector<char> message;                                              \
-      message.resize(100);                                                    \
-      av_strerror(code, message.data(), message.size());                      \
-      std::ostringstream ostr;                                                \
-      ostr << "[" << __FILE__ << ":" << __LINE__ << "] (AV-" << -code << ": " \
-           << message.data() << ") " << #EXPR;                                \
-      throw std::runtime_error{ostr.str()};                                   \
-    }                                                                         \
+namespace utils {
+
+// e.g. "[file:line] (AV-1094995529: Invalid data found ...) expr"
+inline std::string avErrorMessage(int code,
+                                  const char* file,
+                                  int line,
+                                  const char* expr) {
+  std::vector<char> message;
+  message.resize(100);
+  av_strerror(code, message.data(), message.size());
+  std::ostringstream ostr;
+  ostr << "[" << file << ":" << line << "] (AV-" << -code << ": "
+       << message.data() << ") " << expr;
+  return ostr.str();
+}
+
+}  // namespace utils
+
+#define ASSERT_AV(EXPR)                                                     \
+  do {                                                                      \
+    int code = EXPR;                                                        \
+    if (code < 0) {                                                         \
+      UTILS_FAIL(::utils::avErrorMessage(code, __FILE__, __LINE__, #EXPR)); \
+    }                                                                       \
   } while (0)
 
+// cf. utils-result.hpp
+#define ASSERT_AV_OR_RETURN(EXPR)                                    \
+  do {                                                               \
+    int code = EXPR;                                                 \
+    if (code < 0) {                                                  \
+      return ::utils::Error{                                         \
+          ::utils::avErrorMessage(code, __FILE__, __LINE__, #EXPR)}; \
+    }                                                                \
+  } while (0)
+
+//
+// packet/frame/codec context allocation (asserted, and counted as
+// "allocations" of the current job where it happens, cf. utils-stats.hpp)
+//
+
+namespace utils {
+
+inline AVPacket* allocPacket() {
+  AVPacket* pkt = av_packet_alloc();
+  ASSERT(pkt);
+  STATS_ADD(allocations, 1);
+  return pkt;
+}
+
+inline AVFrame* allocFrame() {
+  AVFrame* frame = av_frame_alloc();
+  ASSERT(frame);
+  STATS_ADD(allocations, 1);
+  return frame;
+}
+
+inline AVCodecContext* allocCodecContext(const AVCodec* codec) {
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  ASSERT(ctx);
+  STATS_ADD(allocations, 1);
+  return ctx;
+}
+
+}  // namespace utils
+
 //
 // AVDictionary to std::map
 //
@@ -41,6 +106,383 @@ std::map<std::string, std::string> mapFromAVDictionary(
 
 }  // namespace utils
 
+//
+// frame and packet data from AVBufferPool per size class (power of two), so
+// that a steady state decode or encode doesn't go to av_malloc per frame.
+//
+// - `attach` installs get_buffer2 (audio decoders) and get_encode_buffer
+//   (encoders with AV_CODEC_CAP_DR1) on a codec context before avcodec_open2.
+//   video and frames with more planes than AVFrame::data fall back to the
+//   default allocator. `getAudioBuffer` serves frames filled outside of a
+//   codec (cf. FrameResizer).
+// - buffers handed out keep their pool alive (av_buffer_pool_uninit only
+//   marks it), so frames and packets may outlive the arena. the codec
+//   contexts attached to it may not.
+// - packets from demuxers can't be served this way (libavformat allocates
+//   them internally), stream copy avoids them by matroska::Reader or
+//   ogg_opus instead.
+//
+
+namespace utils {
+
+struct BufferArena {
+  static constexpr size_t MIN_SIZE = 1 << 10;
+
+  std::map<size_t, AVBufferPool*> pools_;  // size class -> pool
+
+  // totals
+  int64_t allocated_ = 0;  // pool misses
+  int64_t served_ = 0;
+
+  BufferArena() = default;
+  BufferArena(const BufferArena&) = delete;
+  BufferArena& operator=(const BufferArena&) = delete;
+
+  ~BufferArena() {
+    for (auto& [size, pool] : pools_) {
+      av_buffer_pool_uninit(&pool);
+    }
+  }
+
+  void attach(AVCodecContext* ctx) {
+    ctx->opaque = this;
+    ctx->get_buffer2 = BufferArena::getBuffer2;
+    ctx->get_encode_buffer = BufferArena::getEncodeBuffer;
+  }
+
+  // at least `size` bytes
+  AVBufferRef* get(size_t size) {
+    size_t size_class = MIN_SIZE;
+    while (size_class < size) {
+      size_class <<= 1;
+    }
+    auto& pool = pools_[size_class];
+    if (!pool) {
+      pool = av_buffer_pool_init2(size_class, this, BufferArena::allocate,
+                                  NULL);
+      if (!pool) {
+        return nullptr;
+      }
+    }
+    served_++;
+    return av_buffer_pool_get(pool);
+  }
+
+  static AVBufferRef* allocate(void* opaque, size_t size) {
+    reinterpret_cast<BufferArena*>(opaque)->allocated_++;
+    STATS_ADD(allocations, 1);
+    return av_buffer_alloc(size);
+  }
+
+  static int getBuffer2(AVCodecContext* ctx, AVFrame* frame, int flags) {
+    auto self = reinterpret_cast<BufferArena*>(ctx->opaque);
+    if (ctx->codec_type != AVMEDIA_TYPE_AUDIO ||
+        planeCount(frame) > AV_NUM_DATA_POINTERS) {
+      return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+    return self->getAudioBuffer(frame);
+  }
+
+  static int planeCount(const AVFrame* frame) {
+    auto format = static_cast<AVSampleFormat>(frame->format);
+    return av_sample_fmt_is_planar(format) ? frame->ch_layout.nb_channels : 1;
+  }
+
+  // data of an audio frame with format, ch_layout and nb_samples set
+  // (av_frame_get_buffer if it has more planes than AVFrame::data)
+  int getAudioBuffer(AVFrame* frame) {
+    auto format = static_cast<AVSampleFormat>(frame->format);
+    int channels = frame->ch_layout.nb_channels;
+    int planes = planeCount(frame);
+    if (planes > AV_NUM_DATA_POINTERS) {
+      return av_frame_get_buffer(frame, 0);
+    }
+    int linesize = 0;
+    int ret = av_samples_get_buffer_size(&linesize, channels,
+                                         frame->nb_samples, format, 0);
+    if (ret < 0) {
+      return ret;
+    }
+    for (int i = 0; i < planes; i++) {
+      frame->buf[i] = get(linesize);
+      if (!frame->buf[i]) {
+        av_frame_unref(frame);
+        return AVERROR(ENOMEM);
+      }
+      frame->data[i] = frame->buf[i]->data;
+    }
+    frame->extended_data = frame->data;
+    frame->linesize[0] = linesize;
+    return 0;
+  }
+
+  static int getEncodeBuffer(AVCodecContext* ctx, AVPacket* pkt, int) {
+    auto self = reinterpret_cast<BufferArena*>(ctx->opaque);
+    pkt->buf = self->get(pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!pkt->buf) {
+      return AVERROR(ENOMEM);
+    }
+    pkt->data = pkt->buf->data;
+    std::memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+  }
+
+  nlohmann::json toJson() const {
+    return {{"pools", pools_.size()},
+            {"allocated", allocated_},
+            {"served", served_}};
+  }
+};
+
+}  // namespace utils
+
+//
+// decoded audio re-chunked into frames of the encoder's frame_size, with pts
+// counted in samples from 0 (in the encoder's time base). so the encoder
+// neither depends on the decoder's time base (e.g. 1/1000 of webm) nor on
+// its frame size (e.g. aac 1024 or mp3 1152 samples while opus takes 960).
+// what's left at the end of stream comes out as a shorter frame (encoders
+// with AV_CODEC_CAP_SMALL_LAST_FRAME, e.g. opus).
+//
+//   resizer.write(frame);  // nullptr at the end of stream
+//   while (AVFrame* out = resizer.read()) { avcodec_send_frame(...); }
+//
+
+namespace utils {
+
+struct FrameResizer {
+  const AVCodecContext* enc_ctx_;
+  BufferArena* arena_;  // frame data from `arena_` if given
+  AVAudioFifo* fifo_;
+  AVFrame* frame_;
+  int64_t samples_ = 0;  // read so far
+  bool flushing_ = false;
+
+  FrameResizer(const AVCodecContext* enc_ctx, BufferArena* arena = nullptr)
+      : enc_ctx_{enc_ctx}, arena_{arena} {
+    fifo_ = av_audio_fifo_alloc(enc_ctx->sample_fmt,
+                                enc_ctx->ch_layout.nb_channels,
+                                std::max(enc_ctx->frame_size, 1));
+    ASSERT(fifo_);
+    frame_ = utils::allocFrame();
+    STATS_ADD(allocations, 1);  // fifo_
+  }
+  FrameResizer(const FrameResizer&) = delete;
+  FrameResizer& operator=(const FrameResizer&) = delete;
+
+  ~FrameResizer() {
+    av_frame_free(&frame_);
+    av_audio_fifo_free(fifo_);
+  }
+
+  // decoded frame in the encoder's sample format, rate and layout
+  void write(const AVFrame* frame) {
+    if (!frame) {
+      flushing_ = true;
+      return;
+    }
+    ASSERT(frame->format == enc_ctx_->sample_fmt);
+    ASSERT(frame->ch_layout.nb_channels == enc_ctx_->ch_layout.nb_channels);
+    int written = av_audio_fifo_write(
+        fifo_, reinterpret_cast<void**>(frame->extended_data),
+        frame->nb_samples);
+    ASSERT(written == frame->nb_samples);
+  }
+
+  // next frame for the encoder (valid until the next `read`), nullptr until
+  // a whole frame was written (or nothing is left after the end of stream)
+  AVFrame* read() {
+    av_frame_unref(frame_);
+    int available = av_audio_fifo_size(fifo_);
+    int size = enc_ctx_->frame_size > 0 ? enc_ctx_->frame_size : available;
+    if (available == 0 || (available < size && !flushing_)) {
+      return nullptr;
+    }
+    size = std::min(size, available);
+    frame_->format = enc_ctx_->sample_fmt;
+    ASSERT_AV(av_channel_layout_copy(&frame_->ch_layout, &enc_ctx_->ch_layout));
+    frame_->sample_rate = enc_ctx_->sample_rate;
+    frame_->nb_samples = size;
+    ASSERT_AV(arena_ ? arena_->getAudioBuffer(frame_)
+                     : av_frame_get_buffer(frame_, 0));
+    int read = av_audio_fifo_read(
+        fifo_, reinterpret_cast<void**>(frame_->extended_data), size);
+    ASSERT(read == size);
+    frame_->pts = av_rescale_q(samples_, {1, enc_ctx_->sample_rate},
+                               enc_ctx_->time_base);
+    samples_ += size;
+    return frame_;
+  }
+};
+
+}  // namespace utils
+
+//
+// cancellation and progress hooks (cf. utils-control.hpp)
+//
+
+namespace utils::control {
+
+// for AVFormatContext::interrupt_callback, which libavformat checks itself
+// e.g. between packets of avformat_find_stream_info (custom AVIO reads are
+// stopped by BufferInput/FdInput instead)
+inline int interruptCallback(void* opaque) {
+  return static_cast<Control*>(opaque)->poll();
+}
+
+// lets libavformat poll the current control (left as is without one)
+inline void attach(AVFormatContext* fmt_ctx) {
+  if (current) {
+    fmt_ctx->interrupt_callback = {interruptCallback, current};
+  }
+}
+
+inline void reached(const AVPacket* pkt, AVRational time_base) {
+  if (current && pkt->pts != AV_NOPTS_VALUE) {
+    current->progress_.seconds = pkt->pts * av_q2d(time_base);
+  }
+}
+
+}  // namespace utils::control
+
+//
+// demux and decode a single stream, passing each frame to `on_frame` (frame
+// is unref'ed after the callback, so analyses stream without holding PCM)
+//
+
+namespace utils {
+
+template <class Fn>
+void decodeStream(AVFormatContext* ifmt_ctx, int stream_index, Fn on_frame) {
+  auto par = ifmt_ctx->streams[stream_index]->codecpar;
+  const AVCodec* dec = avcodec_find_decoder(par->codec_id);
+  ASSERT(dec);
+  BufferArena arena;
+  AVCodecContext* dec_ctx = utils::allocCodecContext(dec);
+  DEFER {
+    avcodec_free_context(&dec_ctx);
+  };
+  ASSERT_AV(avcodec_parameters_to_context(dec_ctx, par));
+  arena.attach(dec_ctx);
+  ASSERT_AV(avcodec_open2(dec_ctx, dec, NULL));
+
+  AVFrame* frame = utils::allocFrame();
+  DEFER {
+    av_frame_free(&frame);
+  };
+  AVPacket* pkt = utils::allocPacket();
+  DEFER {
+    av_packet_free(&pkt);
+  };
+
+  auto decodePacket = [&](const AVPacket* packet) {
+    ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx, packet)));
+    while (true) {
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx, frame));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        return;
+      }
+      ASSERT_AV(ret);
+      STATS_ADD(frames, 1);
+      on_frame(static_cast<const AVFrame*>(frame));
+      av_frame_unref(frame);
+    }
+  };
+  auto time_base = ifmt_ctx->streams[stream_index]->time_base;
+  while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt)) >= 0) {
+    if (pkt->stream_index == stream_index) {
+      STATS_ADD(packets, 1);
+      control::reached(pkt, time_base);
+      decodePacket(pkt);
+    }
+    av_packet_unref(pkt);
+  }
+  ASSERT_OK(control::check());
+  decodePacket(nullptr);
+}
+
+// average channels of a planar or interleaved float frame
+inline void mixdown(const AVFrame* frame, std::vector<float>& mono) {
+  int channels = frame->ch_layout.nb_channels;
+  int n = frame->nb_samples;
+  float scale = 1.0f / channels;
+  mono.assign(n, 0.0f);
+  switch (frame->format) {
+    case AV_SAMPLE_FMT_FLTP: {
+      for (int c = 0; c < channels; c++) {
+        auto src = reinterpret_cast<const float*>(frame->extended_data[c]);
+        for (int i = 0; i < n; i++) {
+          mono[i] += src[i] * scale;
+        }
+      }
+      break;
+    }
+    case AV_SAMPLE_FMT_FLT: {
+      auto src = reinterpret_cast<const float*>(frame->data[0]);
+      for (int i = 0; i < n; i++) {
+        for (int c = 0; c < channels; c++) {
+          mono[i] += src[i * channels + c] * scale;
+        }
+      }
+      break;
+    }
+    default: {
+      ASSERT(false && "unsupported sample format");
+    }
+  }
+}
+
+}  // namespace utils
+
+//
+// AVIO buffers recycled per thread, so that repeated short jobs don't go to
+// av_malloc (cf. utils-pool.hpp). a buffer replaced by libavformat (e.g.
+// grown while probing) is freed instead.
+//
+
+namespace utils {
+
+struct AvioBufferCache {
+  static constexpr size_t MAX_IDLE = 8;  // per size
+  std::map<size_t, std::vector<uint8_t*>> idle_;
+
+  ~AvioBufferCache() {
+    for (auto& [size, buffers] : idle_) {
+      for (auto buffer : buffers) {
+        av_free(buffer);
+      }
+    }
+  }
+
+  uint8_t* acquire(size_t size) {
+    auto& buffers = idle_[size];
+    if (!buffers.empty()) {
+      auto buffer = buffers.back();
+      buffers.pop_back();
+      return buffer;
+    }
+    auto buffer = reinterpret_cast<uint8_t*>(av_malloc(size));
+    ASSERT(buffer);
+    STATS_ADD(allocations, 1);
+    return buffer;
+  }
+
+  void release(AVIOContext* avio_ctx, size_t size) {
+    auto& buffers = idle_[size];
+    if (static_cast<size_t>(avio_ctx->buffer_size) == size &&
+        buffers.size() < MAX_IDLE) {
+      buffers.push_back(avio_ctx->buffer);
+      avio_ctx->buffer = nullptr;
+      return;
+    }
+    av_freep(&avio_ctx->buffer);
+  }
+};
+
+inline thread_local AvioBufferCache avio_buffer_cache;
+
+}  // namespace utils
+
 //
 // AVIOContext wrapper for in-memory data
 //
@@ -50,11 +492,15 @@ struct BufferInput {
   std::vector<uint8_t> input_;
   size_t input_pos_ = 0;
 
-  BufferInput(const std::vector<uint8_t>& input) : input_{input} {
+  static constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
+
+  BufferInput(const std::vector<uint8_t>& input)
+      : BufferInput{std::vector<uint8_t>(input)} {}
+
+  // takes over `input` without copy
+  BufferInput(std::vector<uint8_t>&& input) : input_{std::move(input)} {
     // ffmpeg internal buffer (needs to be allocated on our own initially)
-    constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
-    auto avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
-    ASSERT(avio_buffer);
+    auto avio_buffer = utils::avio_buffer_cache.acquire(AVIO_BUFFER_SIZE);
 
     // instantiate AVIOContext (`seek` doesn't seem necessary but why not)
     avio_ctx_ =
@@ -64,7 +510,7 @@ struct BufferInput {
   }
 
   ~BufferInput() {
-    av_freep(&avio_ctx_->buffer);
+    utils::avio_buffer_cache.release(avio_ctx_, AVIO_BUFFER_SIZE);
     avio_context_free(&avio_ctx_);
   }
 
@@ -74,12 +520,19 @@ struct BufferInput {
   }
 
   int readPacketImpl(uint8_t* buf, int buf_size) {
+    STATS_SCOPE(io_read);
+    STATS_ADD(avio_refills, 1);
+    if (utils::control::stopped()) {
+      return AVERROR_EXIT;
+    }
     int read_size = std::min<int>(buf_size, input_.size() - input_pos_);
     if (read_size == 0) {
       return AVERROR_EOF;
     }
     std::memcpy(buf, &input_[input_pos_], read_size);
     input_pos_ += read_size;
+    STATS_ADD(bytes_read, read_size);
+    utils::control::advance(input_pos_, input_.size());
     return read_size;
   }
 
@@ -89,6 +542,7 @@ struct BufferInput {
 
   int64_t seekImpl(int64_t offset, int whence) {
     // cf. io_seek in third_party/FFmpeg/tools/target_dem_fuzzer.c
+    STATS_SCOPE(io_seek);
 
     if (whence == AVSEEK_SIZE) {
       return input_.size();
@@ -104,6 +558,7 @@ struct BufferInput {
       return -1;
     }
     input_pos_ = (size_t)offset;
+    STATS_ADD(seeks, 1);
     return 0;
   }
 };
@@ -111,21 +566,25 @@ struct BufferInput {
 struct BufferOutput {
   AVIOContext* avio_ctx_;
   std::vector<uint8_t> output_;
+  size_t output_pos_ = 0;
 
-  BufferOutput() {
+  // seekable output lets muxers go back to patch headers and write indices
+  // (e.g. matroska's Cues/SeekHead/Duration)
+  static constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
+
+  BufferOutput(bool seekable = false) {
     // ffmpeg internal buffer (needs to be allocated on our own initially)
-    constexpr size_t AVIO_BUFFER_SIZE = 1 << 12;  // 4K
-    auto avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
-    ASSERT(avio_buffer);
+    auto avio_buffer = utils::avio_buffer_cache.acquire(AVIO_BUFFER_SIZE);
 
     // instantiate AVIOContext
-    avio_ctx_ = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, this, NULL,
-                                   BufferOutput::writePacket, NULL);
+    avio_ctx_ = avio_alloc_context(
+        avio_buffer, AVIO_BUFFER_SIZE, 1, this, NULL, BufferOutput::writePacket,
+        seekable ? BufferOutput::seek : NULL);
     ASSERT(avio_ctx_);
   }
 
   ~BufferOutput() {
-    av_freep(&avio_ctx_->buffer);
+    utils::avio_buffer_cache.release(avio_ctx_, AVIO_BUFFER_SIZE);
     avio_context_free(&avio_ctx_);
   }
 
@@ -135,7 +594,161 @@ struct BufferOutput {
   }
 
   int writePacketImpl(uint8_t* buf, int buf_size) {
-    output_.insert(output_.end(), buf, buf + buf_size);
+    STATS_SCOPE(io_write);
+    STATS_ADD(bytes_written, buf_size);
+    if (output_pos_ == output_.size()) {
+      output_.insert(output_.end(), buf, buf + buf_size);
+    } else {
+      // overwrite after seek
+      auto end = output_pos_ + buf_size;
+      if (end > output_.size()) {
+        output_.resize(end);
+      }
+      std::memcpy(&output_[output_pos_], buf, buf_size);
+    }
+    output_pos_ += buf_size;
+    return buf_size;
+  }
+
+  static int64_t seek(void* opaque, int64_t offset, int whence) {
+    return reinterpret_cast<BufferOutput*>(opaque)->seekImpl(offset, whence);
+  }
+
+  int64_t seekImpl(int64_t offset, int whence) {
+    STATS_SCOPE(io_seek);
+    if (whence == AVSEEK_SIZE) {
+      return output_.size();
+    }
+    if (whence == SEEK_CUR) {
+      offset += output_pos_;
+    } else if (whence == SEEK_END) {
+      offset += output_.size();
+    }
+    if (offset < 0 || output_.size() < (size_t)offset) {
+      return -1;
+    }
+    output_pos_ = (size_t)offset;
+    STATS_ADD(seeks, 1);
+    return offset;
+  }
+};
+
+//
+// AVIOContext wrapper for file descriptors (streaming, only the AVIO buffer
+// is held in memory, cf. admission.hpp)
+//
+
+struct FdInput {
+  AVIOContext* avio_ctx_;
+  const int fd_;
+  int64_t pos_ = 0;  // own position (fd might be shared with other process)
+
+  static constexpr size_t AVIO_BUFFER_SIZE = 1 << 16;  // 64K
+
+  FdInput(int fd) : fd_{fd} {
+    auto avio_buffer = utils::avio_buffer_cache.acquire(AVIO_BUFFER_SIZE);
+    avio_ctx_ = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, this,
+                                   FdInput::readPacket, NULL, FdInput::seek);
+    ASSERT(avio_ctx_);
+  }
+
+  ~FdInput() {
+    utils::avio_buffer_cache.release(avio_ctx_, AVIO_BUFFER_SIZE);
+    avio_context_free(&avio_ctx_);
+  }
+
+  static int readPacket(void* opaque, uint8_t* buf, int buf_size) {
+    auto self = reinterpret_cast<FdInput*>(opaque);
+    STATS_SCOPE(io_read);
+    STATS_ADD(avio_refills, 1);
+    if (utils::control::stopped()) {
+      return AVERROR_EXIT;
+    }
+    ssize_t n;
+    do {
+      n = ::pread(self->fd_, buf, buf_size, self->pos_);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      return AVERROR(errno);
+    }
+    if (n == 0) {
+      return AVERROR_EOF;
+    }
+    self->pos_ += n;
+    STATS_ADD(bytes_read, n);
+    utils::control::advance(self->pos_, 0);
+    return n;
+  }
+
+  static int64_t seek(void* opaque, int64_t offset, int whence) {
+    auto self = reinterpret_cast<FdInput*>(opaque);
+    STATS_SCOPE(io_seek);
+    struct stat st;
+    if (::fstat(self->fd_, &st) != 0) {
+      return AVERROR(errno);
+    }
+    if (whence == AVSEEK_SIZE) {
+      return st.st_size;
+    }
+    if (whence == SEEK_CUR) {
+      offset += self->pos_;
+    } else if (whence == SEEK_END) {
+      offset += st.st_size;
+    }
+    if (offset < 0 || st.st_size < offset) {
+      return -1;
+    }
+    self->pos_ = offset;
+    STATS_ADD(seeks, 1);
+    return offset;
+  }
+};
+
+struct FdOutput {
+  AVIOContext* avio_ctx_;
+  const int fd_;
+
+  static constexpr size_t AVIO_BUFFER_SIZE = 1 << 16;  // 64K
+
+  FdOutput(int fd, bool seekable = false) : fd_{fd} {
+    auto avio_buffer = utils::avio_buffer_cache.acquire(AVIO_BUFFER_SIZE);
+    avio_ctx_ = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, this,
+                                   NULL, FdOutput::writePacket,
+                                   seekable ? FdOutput::seek : NULL);
+    ASSERT(avio_ctx_);
+  }
+
+  ~FdOutput() {
+    utils::avio_buffer_cache.release(avio_ctx_, AVIO_BUFFER_SIZE);
+    avio_context_free(&avio_ctx_);
+  }
+
+  static int writePacket(void* opaque, uint8_t* buf, int buf_size) {
+    auto self = reinterpret_cast<FdOutput*>(opaque);
+    STATS_SCOPE(io_write);
+    for (int written = 0; written < buf_size;) {
+      auto n = ::write(self->fd_, buf + written, buf_size - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return AVERROR(errno ? errno : EIO);
+      }
+      written += n;
+    }
+    STATS_ADD(bytes_written, buf_size);
     return buf_size;
   }
+
+  static int64_t seek(void* opaque, int64_t offset, int whence) {
+    auto self = reinterpret_cast<FdOutput*>(opaque);
+    STATS_SCOPE(io_seek);
+    if (whence == AVSEEK_SIZE) {
+      struct stat st;
+      return ::fstat(self->fd_, &st) == 0 ? st.st_size : AVERROR(errno);
+    }
+    STATS_ADD(seeks, 1);
+    auto result = ::lseek(self->fd_, offset, whence);
+    return result < 0 ? AVERROR(errno) : result;
+  }
 };
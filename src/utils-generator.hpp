@@ -0,0 +1,269 @@
+#pragma once
+
+// coroutine generators over the demux/decode/encode state machines
+//
+// - `Generator<T>` is a move only, single pass input range (std::ranges
+//   view) resumed lazily by its iterator. an exception thrown inside the
+//   coroutine is rethrown from `begin` or `++`.
+// - `demux`, `decode` and `encode` hide the send/receive EAGAIN/EOF loops
+//   and compose with `|` (decode/encode accept any range of packets/frames)
+//     for (AVPacket* pkt : utils::demux(ifmt_ctx, in_pkt, stream_index) |
+//                          utils::decode(dec_ctx, frame) |
+//                          utils::encode(enc_ctx, out_pkt)) { ... }
+//   yielded packets/frames are borrowed (valid until the next `++`), and
+//   leaving the loop early destroys the whole chain which unrefs them.
+// - a stage resumes its upstream by a plain call, so nothing is allocated
+//   per item. coroutine frames (one per stage per job) are recycled through
+//   a per thread cache rather than operator new.
+// - requires C++20 (CXX_STANDARD 20 per target, cf. CMakeLists.txt)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <ranges>
+#include <utility>
+#include <vector>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace utils {
+
+//
+// coroutine frame cache
+//
+
+struct CoroutineFrameCache {
+  static constexpr size_t MAX_IDLE = 8;  // per size
+  std::map<size_t, std::vector<void*>> idle_;
+
+  ~CoroutineFrameCache() {
+    for (auto& [size, frames] : idle_) {
+      for (auto frame : frames) {
+        ::operator delete(frame);
+      }
+    }
+  }
+
+  void* allocate(size_t size) {
+    auto& frames = idle_[size];
+    if (!frames.empty()) {
+      auto frame = frames.back();
+      frames.pop_back();
+      return frame;
+    }
+    STATS_ADD(allocations, 1);
+    return ::operator new(size);
+  }
+
+  void deallocate(void* frame, size_t size) {
+    auto& frames = idle_[size];
+    if (frames.size() < MAX_IDLE) {
+      frames.push_back(frame);
+      return;
+    }
+    ::operator delete(frame);
+  }
+};
+
+inline thread_local CoroutineFrameCache coroutine_frame_cache;
+
+//
+// generator
+//
+
+template <class T>
+struct Generator : std::ranges::view_base {
+  struct promise_type {
+    T value_{};
+    std::exception_ptr error_;
+
+    Generator get_return_object() {
+      return Generator{Handle::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    std::suspend_always yield_value(T value) noexcept {
+      value_ = value;
+      return {};
+    }
+    void return_void() noexcept {}
+    void unhandled_exception() { error_ = std::current_exception(); }
+
+    static void* operator new(size_t size) {
+      return coroutine_frame_cache.allocate(size);
+    }
+    static void operator delete(void* frame, size_t size) {
+      coroutine_frame_cache.deallocate(frame, size);
+    }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct Iterator {
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    Handle handle_{};
+
+    T operator*() const { return handle_.promise().value_; }
+
+    Iterator& operator++() {
+      resume(handle_);
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+
+    bool operator==(std::default_sentinel_t) const { return handle_.done(); }
+  };
+
+  Handle handle_{};
+
+  explicit Generator(Handle handle) : handle_{handle} {}
+  Generator(Generator&& other) noexcept
+      : handle_{std::exchange(other.handle_, {})} {}
+  Generator& operator=(Generator&& other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  Generator(const Generator&) = delete;
+  Generator& operator=(const Generator&) = delete;
+  ~Generator() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  Iterator begin() {
+    resume(handle_);
+    return {handle_};
+  }
+  std::default_sentinel_t end() const noexcept { return {}; }
+
+  static void resume(Handle handle) {
+    handle.resume();
+    if (auto error = std::exchange(handle.promise().error_, nullptr)) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+//
+// stages
+//
+
+// packets of `stream_index` (every stream if negative) read into `pkt`.
+// a stopped job (cf. utils-control.hpp) throws rather than ends the range.
+inline Generator<AVPacket*> demux(AVFormatContext* ifmt_ctx,
+                                  AVPacket* pkt,
+                                  int stream_index = -1) {
+  DEFER {
+    av_packet_unref(pkt);
+  };
+  while (STATS_TIMED(demux, av_read_frame(ifmt_ctx, pkt)) >= 0) {
+    if (stream_index < 0 || pkt->stream_index == stream_index) {
+      STATS_ADD(packets, 1);
+      control::reached(pkt, ifmt_ctx->streams[pkt->stream_index]->time_base);
+      co_yield pkt;
+    }
+    av_packet_unref(pkt);
+  }
+  ASSERT_OK(control::check());
+}
+
+// frames received into `frame` (decoder is flushed at the end of `packets`)
+template <class Packets>
+Generator<AVFrame*> decode(AVCodecContext* dec_ctx,
+                           Packets packets,
+                           AVFrame* frame) {
+  DEFER {
+    av_frame_unref(frame);
+  };
+  auto it = std::ranges::begin(packets);
+  while (true) {
+    const AVPacket* pkt = it == std::ranges::end(packets) ? nullptr : *it;
+    ASSERT_AV(STATS_TIMED(decode, avcodec_send_packet(dec_ctx, pkt)));
+    while (true) {
+      auto ret = STATS_TIMED(decode, avcodec_receive_frame(dec_ctx, frame));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        break;
+      }
+      ASSERT_AV(ret);
+      STATS_ADD(frames, 1);
+      co_yield frame;
+      av_frame_unref(frame);
+    }
+    if (!pkt) {
+      break;
+    }
+    ++it;
+  }
+}
+
+// packets received into `pkt` (encoder is flushed at the end of `frames`)
+template <class Frames>
+Generator<AVPacket*> encode(AVCodecContext* enc_ctx,
+                            Frames frames,
+                            AVPacket* pkt) {
+  DEFER {
+    av_packet_unref(pkt);
+  };
+  auto it = std::ranges::begin(frames);
+  while (true) {
+    const AVFrame* frame = it == std::ranges::end(frames) ? nullptr : *it;
+    ASSERT_AV(STATS_TIMED(encode, avcodec_send_frame(enc_ctx, frame)));
+    while (true) {
+      auto ret = STATS_TIMED(encode, avcodec_receive_packet(enc_ctx, pkt));
+      if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+        break;
+      }
+      ASSERT_AV(ret);
+      co_yield pkt;
+      av_packet_unref(pkt);
+    }
+    if (!frame) {
+      break;
+    }
+    ++it;
+  }
+}
+
+// `packets | decode(dec_ctx, frame)`
+struct DecodeStage {
+  AVCodecContext* dec_ctx_;
+  AVFrame* frame_;
+};
+
+inline DecodeStage decode(AVCodecContext* dec_ctx, AVFrame* frame) {
+  return {dec_ctx, frame};
+}
+
+template <std::ranges::input_range Packets>
+Generator<AVFrame*> operator|(Packets&& packets, DecodeStage stage) {
+  return decode(stage.dec_ctx_, std::views::all(std::forward<Packets>(packets)),
+                stage.frame_);
+}
+
+// `frames | encode(enc_ctx, pkt)`
+struct EncodeStage {
+  AVCodecContext* enc_ctx_;
+  AVPacket* pkt_;
+};
+
+inline EncodeStage encode(AVCodecContext* enc_ctx, AVPacket* pkt) {
+  return {enc_ctx, pkt};
+}
+
+template <std::ranges::input_range Frames>
+Generator<AVPacket*> operator|(Frames&& frames, EncodeStage stage) {
+  return encode(stage.enc_ctx_, std::views::all(std::forward<Frames>(frames)),
+                stage.pkt_);
+}
+
+}  // namespace utils
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include "utils.hpp"
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+//
+// low overhead av_log capture
+//
+// - level is checked before anything is formatted
+// - message is formatted once into a thread local buffer (truncated if long)
+// - entry is published to a bounded lock-free ring, so it's safe to call from
+//   ffmpeg's worker threads and never allocates after construction
+//
+// ring is the bounded MPMC queue from
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+
+namespace utils {
+
+constexpr size_t LOG_MESSAGE_SIZE = 256;
+
+struct LogEntry {
+  int level;
+  uint32_t size;
+  char message[LOG_MESSAGE_SIZE];
+};
+
+struct LogRing {
+  struct Slot {
+    std::atomic<size_t> seq;
+    LogEntry entry;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  const size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<size_t> dropped_{0};
+
+  // capacity must be power of two
+  LogRing(size_t capacity) : slots_{new Slot[capacity]}, mask_{capacity - 1} {
+    ASSERT(capacity >= 2 && (capacity & mask_) == 0);
+    for (size_t i = 0; i < capacity; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // drops the entry (and counts it) when the ring is full
+  bool push(int level, const char* message, size_t size) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    size = std::min(size, LOG_MESSAGE_SIZE);
+    slot->entry.level = level;
+    slot->entry.size = static_cast<uint32_t>(size);
+    std::memcpy(slot->entry.message, message, size);
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(LogEntry& result) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t seq = slot->seq.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    result = slot->entry;
+    slot->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+//
+// av_log_set_callback wrapper (only one instance can be installed at a time)
+//
+
+struct LogCapture {
+  static inline std::atomic<LogCapture*> instance_{nullptr};
+
+  std::atomic<int> level_;
+  LogRing ring_;
+  int previous_level_;  // restored with the default callback
+
+  LogCapture(int level = AV_LOG_INFO, size_t capacity = 1 << 10)
+      : level_{level}, ring_{capacity}, previous_level_{av_log_get_level()} {
+    LogCapture* expected = nullptr;
+    ASSERT(instance_.compare_exchange_strong(expected, this));
+    av_log_set_level(level);
+    av_log_set_callback(LogCapture::callback);
+  }
+
+  ~LogCapture() {
+    av_log_set_callback(av_log_default_callback);
+    av_log_set_level(previous_level_);
+    instance_.store(nullptr, std::memory_order_release);
+  }
+
+  void setLevel(int level) {
+    level_.store(level, std::memory_order_relaxed);
+    av_log_set_level(level);
+  }
+
+  size_t dropped() const {
+    return ring_.dropped_.load(std::memory_order_relaxed);
+  }
+
+  static void callback(void*, int level, const char* fmt, va_list vl) {
+    auto self = instance_.load(std::memory_order_acquire);
+    if (!self || level > self->level_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    self->publish(level, fmt, vl);
+  }
+
+  void publish(int level, const char* fmt, va_list vl) {
+    thread_local char buffer[LOG_MESSAGE_SIZE];
+    int len = std::vsnprintf(buffer, sizeof(buffer), fmt, vl);
+    if (len <= 0) {
+      return;
+    }
+    ring_.push(level, buffer, std::min<size_t>(len, sizeof(buffer) - 1));
+  }
+
+  // consume entries published so far e.g.
+  //   logger.drain([](int level, std::string_view message) { ... });
+  template <class Fn>
+  size_t drain(Fn fn) {
+    size_t count = 0;
+    LogEntry entry;
+    while (ring_.pop(entry)) {
+      fn(entry.level, std::string_view{entry.message, entry.size});
+      count++;
+    }
+    return count;
+  }
+};
+
+}  // namespace utils
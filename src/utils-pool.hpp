@@ -0,0 +1,270 @@
+#pragma once
+
+// owning handles of ffmpeg objects and a pool to recycle them across jobs
+//
+// - `UniquePacket`, `UniqueFrame`, `UniqueCodecContext`, `UniqueInputFormat`
+//   and `UniqueOutputFormat` are std::unique_ptr with the matching av_*_free,
+//   so they can be moved around and returned instead of DEFER in every scope.
+// - `ContextPool` hands out packets, frames and codec contexts (`PacketPtr`,
+//   `FramePtr`, `CodecContextPtr`) whose deleter returns them to the pool.
+//   decoders are keyed by codec parameters (codec, rate, channels,
+//   extradata) and recycled by avcodec_flush_buffers. encoders are keyed by
+//   their settings and recycled only when the codec can be flushed
+//   (AV_CODEC_CAP_ENCODER_FLUSH), others are freed. their frame and packet
+//   data comes from the pool's `BufferArena` (cf. utils-ffmpeg.hpp).
+// - a handle released while an exception is in flight is freed rather than
+//   recycled. AVIO buffers are recycled separately (cf. utils-ffmpeg.hpp).
+// - a pool isn't thread safe, use one per worker thread and let it outlive
+//   the handles it gave out.
+
+#include <exception>
+#include <map>
+#include <memory>
+#include <vector>
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+namespace utils {
+
+//
+// owning handles
+//
+
+struct PacketFree {
+  void operator()(AVPacket* p) const { av_packet_free(&p); }
+};
+struct FrameFree {
+  void operator()(AVFrame* p) const { av_frame_free(&p); }
+};
+struct CodecContextFree {
+  void operator()(AVCodecContext* p) const { avcodec_free_context(&p); }
+};
+struct InputFormatFree {
+  void operator()(AVFormatContext* p) const { avformat_close_input(&p); }
+};
+struct OutputFormatFree {
+  void operator()(AVFormatContext* p) const { avformat_free_context(p); }
+};
+
+using UniquePacket = std::unique_ptr<AVPacket, PacketFree>;
+using UniqueFrame = std::unique_ptr<AVFrame, FrameFree>;
+using UniqueCodecContext = std::unique_ptr<AVCodecContext, CodecContextFree>;
+using UniqueInputFormat = std::unique_ptr<AVFormatContext, InputFormatFree>;
+using UniqueOutputFormat = std::unique_ptr<AVFormatContext, OutputFormatFree>;
+
+inline UniquePacket makePacket() {
+  return UniquePacket{allocPacket()};
+}
+
+inline UniqueFrame makeFrame() {
+  return UniqueFrame{allocFrame()};
+}
+
+// frames from `arena` if given (cf. BufferArena in utils-ffmpeg.hpp)
+inline UniqueCodecContext makeDecoder(const AVCodecParameters* par,
+                                      BufferArena* arena = nullptr) {
+  const AVCodec* dec = avcodec_find_decoder(par->codec_id);
+  ASSERT(dec);
+  UniqueCodecContext result{allocCodecContext(dec)};
+  ASSERT_AV(avcodec_parameters_to_context(result.get(), par));
+  if (arena) {
+    arena->attach(result.get());
+  }
+  ASSERT_AV(avcodec_open2(result.get(), dec, NULL));
+  return result;
+}
+
+// `format` e.g. "ogg" (pb is left to the caller)
+inline UniqueOutputFormat makeOutputFormat(const char* format) {
+  AVFormatContext* ofmt_ctx = nullptr;
+  avformat_alloc_output_context2(&ofmt_ctx, NULL, format, NULL);
+  ASSERT(ofmt_ctx);
+  return UniqueOutputFormat{ofmt_ctx};
+}
+
+//
+// pool
+//
+
+struct ContextPool;
+
+using CodecKey = std::vector<int64_t>;
+
+// deleters returning the object to `pool` (plain free without pool)
+struct PacketRecycle {
+  ContextPool* pool = nullptr;
+  int exceptions = 0;
+  inline void operator()(AVPacket* p) const;
+};
+struct FrameRecycle {
+  ContextPool* pool = nullptr;
+  int exceptions = 0;
+  inline void operator()(AVFrame* p) const;
+};
+struct CodecContextRecycle {
+  ContextPool* pool = nullptr;
+  int exceptions = 0;
+  CodecKey key;
+  inline void operator()(AVCodecContext* p) const;
+};
+
+using PacketPtr = std::unique_ptr<AVPacket, PacketRecycle>;
+using FramePtr = std::unique_ptr<AVFrame, FrameRecycle>;
+using CodecContextPtr = std::unique_ptr<AVCodecContext, CodecContextRecycle>;
+
+struct ContextPool {
+  static constexpr size_t MAX_IDLE = 8;  // per kind (or key)
+
+  // frame/packet data of the codecs below (declared first to outlive them)
+  BufferArena arena_;
+  std::vector<UniquePacket> packets_;
+  std::vector<UniqueFrame> frames_;
+  std::map<CodecKey, std::vector<UniqueCodecContext>> codecs_;
+
+  // totals
+  int64_t created_ = 0;
+  int64_t reused_ = 0;
+
+  PacketPtr packet() {
+    int exceptions = std::uncaught_exceptions();
+    if (!packets_.empty()) {
+      reused_++;
+      auto p = packets_.back().release();
+      packets_.pop_back();
+      return PacketPtr{p, {this, exceptions}};
+    }
+    created_++;
+    return PacketPtr{makePacket().release(), {this, exceptions}};
+  }
+
+  FramePtr frame() {
+    int exceptions = std::uncaught_exceptions();
+    if (!frames_.empty()) {
+      reused_++;
+      auto p = frames_.back().release();
+      frames_.pop_back();
+      return FramePtr{p, {this, exceptions}};
+    }
+    created_++;
+    return FramePtr{makeFrame().release(), {this, exceptions}};
+  }
+
+  static CodecKey decoderKey(const AVCodecParameters* par) {
+    CodecKey key = {0, par->codec_id, par->sample_rate,
+                    par->ch_layout.nb_channels};
+    key.insert(key.end(), par->extradata,
+               par->extradata + par->extradata_size);
+    return key;
+  }
+
+  CodecContextPtr decoder(const AVCodecParameters* par) {
+    auto key = decoderKey(par);
+    if (auto ctx = take(key)) {
+      avcodec_flush_buffers(ctx);
+      return wrap(ctx, std::move(key));
+    }
+    created_++;
+    return wrap(makeDecoder(par, &arena_).release(), std::move(key));
+  }
+
+  // `settings` distinguishes encoders (e.g. rate, channels, bit rate) and
+  // `open` returns a new opened encoder (attached to `arena_` by `open` if
+  // wanted)
+  template <class Fn>
+  CodecContextPtr encoder(const std::vector<int64_t>& settings, Fn open) {
+    CodecKey key = {1};
+    key.insert(key.end(), settings.begin(), settings.end());
+    if (auto ctx = take(key)) {
+      avcodec_flush_buffers(ctx);
+      return wrap(ctx, std::move(key));
+    }
+    created_++;
+    UniqueCodecContext ctx = open();
+    ASSERT(ctx);
+    return wrap(ctx.release(), std::move(key));
+  }
+
+  AVCodecContext* take(const CodecKey& key) {
+    auto found = codecs_.find(key);
+    if (found == codecs_.end() || found->second.empty()) {
+      return nullptr;
+    }
+    reused_++;
+    auto ctx = found->second.back().release();
+    found->second.pop_back();
+    return ctx;
+  }
+
+  CodecContextPtr wrap(AVCodecContext* ctx, CodecKey key) {
+    return CodecContextPtr{
+        ctx, {this, std::uncaught_exceptions(), std::move(key)}};
+  }
+
+  void recycle(AVPacket* p) {
+    av_packet_unref(p);
+    if (packets_.size() < MAX_IDLE) {
+      packets_.emplace_back(p);
+    } else {
+      av_packet_free(&p);
+    }
+  }
+
+  void recycle(AVFrame* p) {
+    av_frame_unref(p);
+    if (frames_.size() < MAX_IDLE) {
+      frames_.emplace_back(p);
+    } else {
+      av_frame_free(&p);
+    }
+  }
+
+  void recycle(AVCodecContext* p, const CodecKey& key) {
+    bool encoder = av_codec_is_encoder(p->codec);
+    bool flushable = !encoder ||
+                     (p->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH);
+    auto& idle = codecs_[key];
+    if (flushable && idle.size() < MAX_IDLE) {
+      idle.emplace_back(p);
+    } else {
+      avcodec_free_context(&p);
+    }
+  }
+
+  nlohmann::json toJson() const {
+    return {{"created", created_},
+            {"reused", reused_},
+            {"arena", arena_.toJson()}};
+  }
+};
+
+void PacketRecycle::operator()(AVPacket* p) const {
+  if (pool && std::uncaught_exceptions() == exceptions) {
+    pool->recycle(p);
+  } else {
+    av_packet_free(&p);
+  }
+}
+
+void FrameRecycle::operator()(AVFrame* p) const {
+  if (pool && std::uncaught_exceptions() == exceptions) {
+    pool->recycle(p);
+  } else {
+    av_frame_free(&p);
+  }
+}
+
+void CodecContextRecycle::operator()(AVCodecContext* p) const {
+  if (pool && std::uncaught_exceptions() == exceptions) {
+    pool->recycle(p, key);
+  } else {
+    avcodec_free_context(&p);
+  }
+}
+
+}  // namespace utils
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//
+// blocking bounded queue (hand off work between threads)
+//
+// `push` blocks while full, so a slow consumer applies back pressure to the
+// producer instead of letting the queue grow unbounded.
+//
+
+namespace utils {
+
+template <class T>
+struct BoundedQueue {
+  const size_t capacity_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+
+  BoundedQueue(size_t capacity) : capacity_{capacity} {}
+
+  void push(T item) {
+    {
+      std::unique_lock lock{mutex_};
+      not_full_.wait(lock, [&]() { return items_.size() < capacity_; });
+      items_.push_back(std::move(item));
+    }
+    not_empty_.notify_one();
+  }
+
+  // false instead of blocking when full (e.g. reject work under overload)
+  bool tryPush(T item) {
+    {
+      std::unique_lock lock{mutex_};
+      if (items_.size() >= capacity_) {
+        return false;
+      }
+      items_.push_back(std::move(item));
+    }
+    not_empty_.notify_one();
+    return true;
+  }
+
+  T pop() {
+    T item;
+    {
+      std::unique_lock lock{mutex_};
+      not_empty_.wait(lock, [&]() { return !items_.empty(); });
+      item = std::move(items_.front());
+      items_.pop_front();
+    }
+    not_full_.notify_one();
+    return item;
+  }
+};
+
+}  // namespace utils
@@ -0,0 +1,91 @@
+#pragma once
+
+// errors as values for code paths which have to report failures without
+// exceptions (emscripten targets built with -fno-exceptions, cf.
+// EMSCRIPTEN_EXCEPTIONS in CMakeLists.txt)
+//
+// - `Result<T>` holds a value or an `Error`, `Status` is `Result<void>`
+// - ASSERT_OR_RETURN (and ASSERT_AV_OR_RETURN in utils-ffmpeg.hpp) return
+//   the same message as ASSERT/ASSERT_AV would throw from the enclosing
+//   function. ASSIGN_OR_RETURN unwraps a nested `Result<T>`.
+// - ASSERT_OK turns a failed result back into ASSERT behavior (throw, or
+//   abort without exceptions) for callers of the throwing API
+// - only failures caused by the input go this way. broken invariants and
+//   allocation failures stay ASSERT, i.e. fatal without exceptions.
+//
+//   utils::Result<int> parse(...) {
+//     ASSERT_OR_RETURN(size >= 4);
+//     return value;
+//   }
+//   ASSIGN_OR_RETURN(auto value, parse(...));
+
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <variant>
+#include "utils.hpp"
+
+namespace utils {
+
+struct Error {
+  std::string message_;
+};
+
+template <class T>
+struct [[nodiscard]] Result {
+  std::variant<T, Error> value_;
+
+  Result(T value) : value_{std::move(value)} {}
+  Result(Error error) : value_{std::move(error)} {}
+
+  bool ok() const { return value_.index() == 0; }
+  T& value() { return std::get<0>(value_); }
+  const Error& error() const { return std::get<1>(value_); }
+};
+
+template <>
+struct [[nodiscard]] Result<void> {
+  std::optional<Error> error_;
+
+  Result() = default;
+  Result(Error error) : error_{std::move(error)} {}
+
+  bool ok() const { return !error_; }
+  void value() {}
+  const Error& error() const { return *error_; }
+};
+
+using Status = Result<void>;
+
+inline Error makeError(const char* file, int line, const std::string& what) {
+  std::ostringstream ostr;
+  ostr << "[" << file << ":" << line << "] " << what;
+  return Error{ostr.str()};
+}
+
+}  // namespace utils
+
+#define ASSERT_OR_RETURN(EXPR)                            \
+  if (!static_cast<bool>(EXPR)) {                         \
+    return ::utils::makeError(__FILE__, __LINE__, #EXPR); \
+  }
+
+#define _RESULT_VAR2(x) _result_var_##x
+#define _RESULT_VAR1(x) _RESULT_VAR2(x)
+#define _RESULT_VAR _RESULT_VAR1(__LINE__)
+
+#define ASSIGN_OR_RETURN(DECL, EXPR) \
+  auto _RESULT_VAR = (EXPR);         \
+  if (!_RESULT_VAR.ok()) {           \
+    return _RESULT_VAR.error();      \
+  }                                  \
+  DECL = std::move(_RESULT_VAR.value())
+
+#define ASSERT_OK(EXPR)                     \
+  do {                                      \
+    auto _result = (EXPR);                  \
+    if (!_result.ok()) {                    \
+      UTILS_FAIL(_result.error().message_); \
+    }                                       \
+  } while (0)
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <nlohmann/json.hpp>
+#include "utils-alloc.hpp"
+#include "utils.hpp"
+
+//
+// per job timers and counters
+//
+// usage:
+//   utils::stats::Stats stats;
+//   utils::stats::JobScope job{stats};  // installs `stats` for this thread
+//   STATS_ADD(packets, 1);
+//   STATS_SCOPE(decode);                           // until end of scope
+//   ASSERT(STATS_TIMED(demux, av_read_frame(...)) >= 0);  // single expression
+//   dbg(stats.toJson());
+//
+// timers are inclusive (e.g. "demux" contains "io_read" triggered inside of
+// av_read_frame). build with UTILS_STATS=0 to compile out everything.
+//
+// with UTILS_ALLOC=1 (see utils-alloc.hpp), each timer also records allocation
+// count/bytes and peak live bytes of its region, and the job records its
+// overall peak and the bytes still live when it ends.
+//
+
+#ifndef UTILS_STATS
+#define UTILS_STATS 1
+#endif
+
+namespace utils::stats {
+
+enum Counter {
+  bytes_read,
+  bytes_written,
+  packets,
+  frames,
+  seeks,
+  avio_refills,
+  allocations,
+  COUNTER_SIZE,
+};
+
+constexpr const char* COUNTER_NAMES[COUNTER_SIZE] = {
+    "bytes_read", "bytes_written", "packets",     "frames",
+    "seeks",      "avio_refills",  "allocations",
+};
+
+enum Timer {
+  io_read,
+  io_write,
+  io_seek,
+  probe,
+  demux,
+  decode,
+  encode,
+  analysis,
+  mux,
+  output_copy,
+  total,
+  TIMER_SIZE,
+};
+
+constexpr const char* TIMER_NAMES[TIMER_SIZE] = {
+    "io_read", "io_write", "io_seek", "probe",       "demux", "decode",
+    "encode",  "analysis", "mux",     "output_copy", "total",
+};
+
+using Clock = std::chrono::steady_clock;
+
+struct Stats {
+  std::array<uint64_t, COUNTER_SIZE> counters_ = {};
+  std::array<uint64_t, TIMER_SIZE> timer_ns_ = {};
+  std::array<uint64_t, TIMER_SIZE> timer_calls_ = {};
+
+  // allocation tracking
+  std::array<uint64_t, TIMER_SIZE> timer_alloc_count_ = {};
+  std::array<uint64_t, TIMER_SIZE> timer_alloc_bytes_ = {};
+  std::array<int64_t, TIMER_SIZE> timer_alloc_peak_ = {};
+  uint64_t alloc_count_ = 0;
+  uint64_t alloc_bytes_ = 0;
+  int64_t alloc_peak_ = 0;
+  int64_t alloc_live_ = 0;
+
+  void reset() { *this = Stats{}; }
+
+  // accumulate counters/timers of a job run on another thread (timers are
+  // then the sum of per thread time rather than wall time)
+  void merge(const Stats& other) {
+    for (int i = 0; i < COUNTER_SIZE; i++) {
+      counters_[i] += other.counters_[i];
+    }
+    for (int i = 0; i < TIMER_SIZE; i++) {
+      timer_ns_[i] += other.timer_ns_[i];
+      timer_calls_[i] += other.timer_calls_[i];
+      timer_alloc_count_[i] += other.timer_alloc_count_[i];
+      timer_alloc_bytes_[i] += other.timer_alloc_bytes_[i];
+      timer_alloc_peak_[i] =
+          std::max(timer_alloc_peak_[i], other.timer_alloc_peak_[i]);
+    }
+  }
+
+  nlohmann::json toJson() const {
+    auto result = nlohmann::json::object();
+    result["enabled"] = static_cast<bool>(UTILS_STATS);
+    result["counters"] = nlohmann::json::object();
+    result["timers"] = nlohmann::json::object();
+    for (int i = 0; i < COUNTER_SIZE; i++) {
+      result["counters"][COUNTER_NAMES[i]] = counters_[i];
+    }
+    for (int i = 0; i < TIMER_SIZE; i++) {
+      if (timer_calls_[i] == 0) {
+        continue;
+      }
+      auto& timer = result["timers"][TIMER_NAMES[i]];
+      timer = {{"calls", timer_calls_[i]},
+               {"ms", static_cast<double>(timer_ns_[i]) / 1e6}};
+      if (UTILS_ALLOC) {
+        timer["alloc"] = {{"count", timer_alloc_count_[i]},
+                          {"bytes", timer_alloc_bytes_[i]},
+                          {"peak_bytes", timer_alloc_peak_[i]}};
+      }
+    }
+    if (UTILS_ALLOC) {
+      result["memory"] = {{"count", alloc_count_},
+                          {"bytes", alloc_bytes_},
+                          {"peak_bytes", alloc_peak_},
+                          {"live_bytes", alloc_live_}};
+    }
+    return result;
+  }
+
+  // "-" for stdout
+  void dump(const std::string& filename) const {
+    auto report = toJson().dump(2);
+    if (filename == "-") {
+      std::cout << report << std::endl;
+      return;
+    }
+    std::ofstream ostr(filename);
+    ASSERT(ostr.is_open());
+    ostr << report << std::endl;
+  }
+};
+
+// stats of the job currently running on this thread (nullptr if none)
+inline thread_local Stats* current = nullptr;
+
+struct JobScope {
+  Stats* previous_;
+  alloc::Snapshot alloc_start_;
+  alloc::PeakScope alloc_peak_;
+
+  JobScope(Stats& stats) : previous_{current} {
+    current = &stats;
+    if (UTILS_ALLOC) {
+      alloc_start_ = alloc::snapshot();
+      alloc_peak_.start();
+    }
+  }
+
+  ~JobScope() {
+    if (UTILS_ALLOC) {
+      auto end = alloc::snapshot();
+      current->alloc_count_ += end.count - alloc_start_.count;
+      current->alloc_bytes_ += end.bytes - alloc_start_.bytes;
+      current->alloc_live_ += end.live_bytes - alloc_start_.live_bytes;
+      current->alloc_peak_ =
+          std::max(current->alloc_peak_, alloc_peak_.finish());
+    }
+    current = previous_;
+  }
+};
+
+inline void add(Counter counter, uint64_t value) {
+  if (current) {
+    current->counters_[counter] += value;
+  }
+}
+
+struct ScopedTimer {
+  Stats* stats_;
+  Timer timer_;
+  Clock::time_point start_;
+  alloc::Snapshot alloc_start_;
+  alloc::PeakScope alloc_peak_;
+
+  // clock is not touched when there's no job installed
+  ScopedTimer(Timer timer) : stats_{current}, timer_{timer} {
+    if (stats_) {
+      if (UTILS_ALLOC) {
+        alloc_start_ = alloc::snapshot();
+        alloc_peak_.start();
+      }
+      start_ = Clock::now();
+    }
+  }
+
+  ~ScopedTimer() {
+    if (stats_) {
+      auto elapsed = Clock::now() - start_;
+      stats_->timer_ns_[timer_] +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count();
+      stats_->timer_calls_[timer_]++;
+      if (UTILS_ALLOC) {
+        auto end = alloc::snapshot();
+        stats_->timer_alloc_count_[timer_] += end.count - alloc_start_.count;
+        stats_->timer_alloc_bytes_[timer_] += end.bytes - alloc_start_.bytes;
+        stats_->timer_alloc_peak_[timer_] =
+            std::max(stats_->timer_alloc_peak_[timer_], alloc_peak_.finish());
+      }
+    }
+  }
+};
+
+template <class Fn>
+auto timed(Timer timer, Fn fn) {
+  ScopedTimer scoped{timer};
+  return fn();
+}
+
+}  // namespace utils::stats
+
+#define _STATS_VAR2(x) _stats_var_##x
+#define _STATS_VAR1(x) _STATS_VAR2(x)
+
+#if UTILS_STATS
+#define STATS_ADD(COUNTER, VALUE) \
+  utils::stats::add(utils::stats::COUNTER, VALUE)
+#define STATS_SCOPE(TIMER) \
+  utils::stats::ScopedTimer _STATS_VAR1(__LINE__) { utils::stats::TIMER }
+#define STATS_TIMED(TIMER, ...) \
+  utils::stats::timed(utils::stats::TIMER, [&]() { return __VA_ARGS__; })
+#else
+#define STATS_ADD(COUNTER, VALUE) \
+  do {                            \
+  } while (0)
+#define STATS_SCOPE(TIMER) \
+  do {                     \
+  } while (0)
+#define STATS_TIMED(TIMER, ...) (__VA_ARGS__)
+#endif
@@ -1,23 +1,52 @@
 #pragma once
 
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
 //
 // assertion
 //
+// builds without exceptions (e.g. emscripten with -fno-exceptions) abort on
+// a failed assertion instead. errors to be reported from such builds go
+// through utils::Result (cf. utils-result.hpp).
+//
+
+#ifndef UTILS_EXCEPTIONS
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define UTILS_EXCEPTIONS 1
+#else
+#define UTILS_EXCEPTIONS 0
+#endif
+#endif
+
+namespace utils {
+
+[[noreturn]] inline void fatal(const std::string& message) {
+  std::cerr << message << std::endl;
+  std::abort();
+}
+
+}  // namespace utils
+
+#if UTILS_EXCEPTIONS
+#define UTILS_FAIL(MESSAGE) throw std::runtime_error{MESSAGE}
+#else
+#define UTILS_FAIL(MESSAGE) ::utils::fatal(MESSAGE)
+#endif
 
 #define ASSERT(EXPR)                                                \
   if (!static_cast<bool>(EXPR)) {                                   \
     std::ostringstream ostream;                                     \
     ostream << "[" << __FILE__ << ":" << __LINE__ << "] " << #EXPR; \
-    throw std::runtime_error{ostream.str()};                        \
+    UTILS_FAIL(ostream.str());                                      \
   }
 
 //
@@ -42,10 +71,11 @@ ostream& operator<<(ostream& ostr, const pair<T1, T2>& x) {
   return ostr << tie(x.first, x.second);
 }
 
-// "container" except std::string
+// "container" except std::string and std::string_view
 template <class T,
           class = decltype(begin(declval<T>())),
-          class = enable_if_t<!is_same<T, string>::value>>
+          class = enable_if_t<!is_same<T, string>::value &&
+                              !is_same<T, string_view>::value>>
 ostream& operator<<(ostream& ostr, const T& xs) {
   ostr << "{";
   bool sep = false;
@@ -0,0 +1,217 @@
+#pragma once
+
+// multi-resolution waveform peaks (min/max/rms per bin) from decoded frames
+//
+// - channels are mixed down to mono and reduced straight from each decoded
+//   frame, so memory doesn't depend on the track length except for the
+//   output itself.
+// - the finest level is reduced from samples with independent lanes (no
+//   reassociation needed, so it's auto-vectorized without -ffast-math, cf.
+//   EMSCRIPTEN_SIMD), coarser levels are folded from finished finer bins.
+//
+// binary format (little endian)
+//   "WFPK"             magic
+//   u8                 version (1)
+//   u8                 bits per value (16)
+//   u16                reserved (0)
+//   u32                sample rate
+//   u32                number of levels
+//   (u32, u32) * n     samples per bin and number of bins of each level
+//   (i16, i16, i16) *  min, max, rms of each bin (level by level, finest
+//                      first, scaled by 32767)
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <vector>
+#include "ogg-opus-writer.hpp"
+#include "utils-ffmpeg.hpp"
+#include "utils.hpp"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+namespace waveform {
+
+constexpr uint8_t VERSION = 1;
+constexpr uint8_t BITS = 16;
+constexpr int LANES = 8;
+
+inline const std::vector<int> DEFAULT_LEVELS = {256, 1024, 4096};
+
+// "256,1024,4096"
+inline std::vector<int> parseLevels(const std::string& s) {
+  std::vector<int> result;
+  std::istringstream istr{s};
+  for (std::string item; std::getline(istr, item, ',');) {
+    result.push_back(std::stoi(item));
+  }
+  return result;
+}
+
+struct Bin {
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  double sum_sq = 0;
+  int64_t count = 0;
+
+  void merge(const Bin& other) {
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    sum_sq += other.sum_sq;
+    count += other.count;
+  }
+};
+
+inline void reduce(const float* x, int n, Bin& bin) {
+  float mins[LANES], maxs[LANES], sums[LANES];
+  for (int l = 0; l < LANES; l++) {
+    mins[l] = bin.min;
+    maxs[l] = bin.max;
+    sums[l] = 0;
+  }
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    for (int l = 0; l < LANES; l++) {
+      float v = x[i + l];
+      mins[l] = v < mins[l] ? v : mins[l];
+      maxs[l] = v > maxs[l] ? v : maxs[l];
+      sums[l] += v * v;
+    }
+  }
+  for (; i < n; i++) {
+    mins[0] = std::min(mins[0], x[i]);
+    maxs[0] = std::max(maxs[0], x[i]);
+    sums[0] += x[i] * x[i];
+  }
+  for (int l = 0; l < LANES; l++) {
+    bin.min = std::min(bin.min, mins[l]);
+    bin.max = std::max(bin.max, maxs[l]);
+    bin.sum_sq += sums[l];
+  }
+  bin.count += n;
+}
+
+inline int16_t quantize(float v) {
+  return static_cast<int16_t>(std::lrint(std::clamp(v, -1.0f, 1.0f) * 32767));
+}
+
+struct Level {
+  int samples_per_bin;
+  Bin current;
+  std::vector<int16_t> data;  // (min, max, rms) per bin
+
+  void store() {
+    float rms = current.count ? std::sqrt(current.sum_sq / current.count) : 0;
+    data.push_back(quantize(current.count ? current.min : 0));
+    data.push_back(quantize(current.count ? current.max : 0));
+    data.push_back(quantize(rms));
+    current = {};
+  }
+};
+
+struct Builder {
+  std::vector<Level> levels_;
+  int sample_rate_ = 0;
+  std::vector<float> mono_;
+
+  // each level has to be a multiple of the previous one
+  Builder(const std::vector<int>& samples_per_bin) {
+    ASSERT(!samples_per_bin.empty());
+    for (size_t i = 0; i < samples_per_bin.size(); i++) {
+      ASSERT(samples_per_bin[i] > 0);
+      if (i > 0) {
+        ASSERT(samples_per_bin[i] % samples_per_bin[i - 1] == 0);
+      }
+      levels_.push_back({samples_per_bin[i], {}, {}});
+    }
+  }
+
+  // planar or interleaved float
+  void addFrame(const AVFrame* frame) {
+    if (sample_rate_ == 0) {
+      sample_rate_ = frame->sample_rate;
+    }
+    utils::mixdown(frame, mono_);
+    addSamples(mono_.data(), mono_.size());
+  }
+
+  void addSamples(const float* x, int n) {
+    auto& level = levels_[0];
+    while (n > 0) {
+      int k = std::min<int64_t>(n, level.samples_per_bin - level.current.count);
+      reduce(x, k, level.current);
+      x += k;
+      n -= k;
+      if (level.current.count == level.samples_per_bin) {
+        finishBin(0);
+      }
+    }
+  }
+
+  void finishBin(size_t i) {
+    if (i + 1 < levels_.size()) {
+      auto& next = levels_[i + 1];
+      next.current.merge(levels_[i].current);
+      levels_[i].store();
+      if (next.current.count == next.samples_per_bin) {
+        finishBin(i + 1);
+      }
+      return;
+    }
+    levels_[i].store();
+  }
+
+  std::vector<uint8_t> finish() {
+    // partial bins at the end (finer ones are folded first)
+    for (size_t i = 0; i < levels_.size(); i++) {
+      if (levels_[i].current.count > 0) {
+        if (i + 1 < levels_.size()) {
+          levels_[i + 1].current.merge(levels_[i].current);
+        }
+        levels_[i].store();
+      }
+    }
+
+    std::vector<uint8_t> result;
+    auto put = [&](uint64_t value, int bytes) {
+      uint8_t buffer[4];
+      ogg_opus::writeLE(buffer, value, bytes);
+      result.insert(result.end(), buffer, buffer + bytes);
+    };
+    result.insert(result.end(), {'W', 'F', 'P', 'K'});
+    put(VERSION, 1);
+    put(BITS, 1);
+    put(0, 2);
+    put(sample_rate_, 4);
+    put(levels_.size(), 4);
+    for (auto& level : levels_) {
+      put(level.samples_per_bin, 4);
+      put(level.data.size() / 3, 4);
+    }
+    for (auto& level : levels_) {
+      for (auto v : level.data) {
+        put(static_cast<uint16_t>(v), 2);
+      }
+    }
+    return result;
+  }
+};
+
+// demux and decode `stream_index` of the input through `Builder`
+inline std::vector<uint8_t> compute(AVFormatContext* ifmt_ctx,
+                                    int stream_index,
+                                    const std::vector<int>& samples_per_bin) {
+  Builder builder{samples_per_bin};
+  utils::decodeStream(ifmt_ctx, stream_index, [&](const AVFrame* frame) {
+    STATS_SCOPE(analysis);
+    builder.addFrame(frame);
+  });
+  STATS_SCOPE(output_copy);
+  return builder.finish();
+}
+
+}  // namespace waveform